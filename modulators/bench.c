@@ -0,0 +1,324 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stddef.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <float.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "modulators.h"
+
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
+#define MAX(x, y) ((x) >= (y) ? (x) : (y))
+
+//
+//Benchmarks
+//
+//Measures ns per advanced modulator and ns per value() call for every modulator type over
+//a range of population sizes and time steps, advance() and value() called per handle on a mixed
+//population (the cost of the dispatch), and advance_all over several environment counts.
+//Results go to stdout as CSV (default) or JSON (--json), one row per measurement; the dispatch
+//column says whether this build calls through the function table or switches on the type
+//(MODULATORS_SWITCH_DISPATCH).
+//
+//usage: bench [--json] [--max-population N] [--min-time MS] [--threads N] [--stats]
+//
+//--stats writes the instrumentation (a MODULATORS_STATS build) to stderr when done.
+//
+
+typedef struct BenchOptions {
+	bool json;
+	size_t max_population;
+	double min_time_ns;
+	int threads;
+	bool stats;
+}BenchOptions;
+
+typedef struct BenchResult {
+	const char *kind;
+	const char *dispatch;
+	const char *type;
+	size_t environments;
+	size_t population;
+	uint64_t dt;
+	int threads;
+	uint64_t iterations;
+	double ns_per_advance;
+	double ns_per_value;
+}BenchResult;
+
+static const size_t bench_populations[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+static const uint64_t bench_dts[] = { 100, 1000, 16667, 1000000 };
+static const size_t bench_environment_counts[] = { 1, 16, 256, 4096 };
+static const char *bench_type_names[] = { "WAVE", "SCALARSPRING", "SCALARGOALFOLLOWER", "NEWTONIAN", "SHIFTREGISTER" };
+static const char *bench_dispatch = MODULATORS_SWITCH_DISPATCH ? "switch" : "vtable";
+
+//Keeps the value() loops from being optimized away
+volatile float bench_sink;
+
+double bench_now_ns(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1e9 / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+void *bench_alloc(size_t size) {
+	void *ptr = malloc(size);
+	if (!ptr) {
+		perror("bench_alloc failed");
+		exit(1);
+	}
+	return ptr;
+}
+
+//A modulator of the given type with some spread in its parameters, k is its index in the population
+Modulator *bench_modulator(ModulatorType type, size_t k) {
+	char name[64];
+	snprintf(name, sizeof(name), "bench_%s_%zu", bench_type_names[type], k);
+	float spread = (float)(k % 97) / 97.0f;
+	switch (type) {
+	case(WAVE): {
+		Modulator *m = wave_modulator(name, 1.0f, 0.1f + spread);
+		set_wave_shape(m, (WaveShape)(k % 4));
+		return m;
+	}
+	case(SCALARSPRING):
+		return scalar_spring(name, 0.5f + spread, 0.5f, spread);
+	case(SCALARGOALFOLLOWER): {
+		char follower_name[80];
+		snprintf(follower_name, sizeof(follower_name), "%s_spring", name);
+		Modulator *m = scalar_goal_follower(name);
+		set_follower(m, scalar_spring(follower_name, 0.05f + 0.1f * spread, 0.5f, 0.0f));
+		add_region(m, (ValueRange){ 0.0f, 0.5f });
+		add_region(m, (ValueRange){ 0.5f, 1.0f });
+		return m;
+	}
+	case(NEWTONIAN): {
+		Modulator *m = newtonian(name, (ValueRange){ 0.5f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, 0.0f);
+		set_goal(m, 0.5f + spread);
+		return m;
+	}
+	case(SHIFTREGISTER):
+		return shift_register(name, 8 + k % 8, (ValueRange){ 0.0f, 1.0f }, 0.2f, 0.5f + spread, (ShiftRegisterInterp)(k % 3));
+	default:
+		assert(0);
+		return NULL;
+	}
+}
+
+//Repeat body, doubling the number of iterations until it runs for at least min_time_ns.
+//Returns the ns per iteration and the iteration count of the final run.
+#define BENCH_TIMED(min_time_ns, iterations, ns, body) \
+	do { \
+		for (iterations = 1;; iterations *= 2) { \
+			double start = bench_now_ns(); \
+			for (uint64_t it = 0; it < iterations; it++) { \
+				body; \
+			} \
+			ns = (bench_now_ns() - start) / (double)iterations; \
+			if (ns * (double)iterations >= (min_time_ns) || iterations >= (1ull << 40)) { \
+				break; \
+			} \
+		} \
+	} while (0)
+
+void bench_print(const BenchOptions *options, const BenchResult *r, bool first) {
+	if (options->json) {
+		printf("%s\n  {\"kind\": \"%s\", \"dispatch\": \"%s\", \"type\": \"%s\", \"environments\": %zu, \"population\": %zu, \"dt_us\": %llu, \"threads\": %d, \"iterations\": %llu, \"ns_per_advance\": %.3f, \"ns_per_value\": %.3f}",
+			first ? "" : ",", r->kind, r->dispatch, r->type, r->environments, r->population, (unsigned long long)r->dt, r->threads,
+			(unsigned long long)r->iterations, r->ns_per_advance, r->ns_per_value);
+	}
+	else {
+		printf("%s,%s,%s,%zu,%zu,%llu,%d,%llu,%.3f,%.3f\n", r->kind, r->dispatch, r->type, r->environments, r->population,
+			(unsigned long long)r->dt, r->threads, (unsigned long long)r->iterations, r->ns_per_advance, r->ns_per_value);
+	}
+	fflush(stdout);
+}
+
+//One environment holding population modulators of a single type: advance_environment and value()
+size_t bench_types(const BenchOptions *options, size_t rows) {
+	for (ModulatorType type = WAVE; type <= SHIFTREGISTER; type++) {
+		for (size_t p = 0; p < sizeof(bench_populations) / sizeof(bench_populations[0]); p++) {
+			size_t population = bench_populations[p];
+			if (population > options->max_population) {
+				break;
+			}
+			EnvId env = environment_id("bench_types");
+			Modulator **mods = bench_alloc(population * sizeof(Modulator *));
+			for (size_t k = 0; k < population; k++) {
+				mods[k] = bench_modulator(type, k);
+				add_modulator_id(env, mods[k]);
+			}
+
+			for (size_t d = 0; d < sizeof(bench_dts) / sizeof(bench_dts[0]); d++) {
+				BenchResult r = { "type", bench_dispatch, bench_type_names[type], 1, population, bench_dts[d], 1 };
+				uint64_t value_iterations;
+				double ns;
+				BENCH_TIMED(options->min_time_ns, r.iterations, ns, advance_environment_id(env, r.dt));
+				r.ns_per_advance = ns / (double)population;
+				BENCH_TIMED(options->min_time_ns, value_iterations, ns, {
+					float sum = 0.0f;
+					for (size_t k = 0; k < population; k++) {
+						sum += value(mods[k]);
+					}
+					bench_sink = sum;
+				});
+				r.ns_per_value = ns / (double)population;
+				bench_print(options, &r, rows++ == 0);
+			}
+
+			destroy_environment_id(env);
+			free(mods);
+		}
+	}
+	return rows;
+}
+
+//A population of all types interleaved in one environment, advanced and read one handle at a time in
+//insertion order so every call goes through the dispatch with a type that changes from call to call
+size_t bench_dispatch_calls(const BenchOptions *options, size_t rows) {
+	for (size_t p = 0; p < sizeof(bench_populations) / sizeof(bench_populations[0]); p++) {
+		size_t population = bench_populations[p];
+		if (population > options->max_population) {
+			break;
+		}
+		EnvId env = environment_id("bench_dispatch");
+		Modulator **mods = bench_alloc(population * sizeof(Modulator *));
+		for (size_t k = 0; k < population; k++) {
+			mods[k] = bench_modulator((ModulatorType)(k % 5), k);
+			add_modulator_id(env, mods[k]);
+		}
+
+		for (size_t d = 0; d < sizeof(bench_dts) / sizeof(bench_dts[0]); d++) {
+			BenchResult r = { "dispatch", bench_dispatch, "MIXED", 1, population, bench_dts[d], 1 };
+			uint64_t value_iterations;
+			double ns;
+			BENCH_TIMED(options->min_time_ns, r.iterations, ns, {
+				for (size_t k = 0; k < population; k++) {
+					advance(mods[k], r.dt);
+				}
+			});
+			r.ns_per_advance = ns / (double)population;
+			BENCH_TIMED(options->min_time_ns, value_iterations, ns, {
+				float sum = 0.0f;
+				for (size_t k = 0; k < population; k++) {
+					sum += value(mods[k]);
+				}
+				bench_sink = sum;
+			});
+			r.ns_per_value = ns / (double)population;
+			bench_print(options, &r, rows++ == 0);
+		}
+
+		destroy_environment_id(env);
+		free(mods);
+	}
+	return rows;
+}
+
+//A population of all types spread round robin over a number of environments, stepped with advance_all
+size_t bench_environments(const BenchOptions *options, size_t rows) {
+	size_t population = MIN(options->max_population, (size_t)1000000);
+	for (size_t e = 0; e < sizeof(bench_environment_counts) / sizeof(bench_environment_counts[0]); e++) {
+		size_t count = bench_environment_counts[e];
+		if (count > population) {
+			break;
+		}
+		EnvId *envs = bench_alloc(count * sizeof(EnvId));
+		for (size_t i = 0; i < count; i++) {
+			char name[64];
+			snprintf(name, sizeof(name), "bench_env_%zu", i);
+			envs[i] = environment_id(name);
+		}
+		for (size_t k = 0; k < population; k++) {
+			add_modulator_id(envs[k % count], bench_modulator((ModulatorType)(k / count % 5), k));
+		}
+
+		//single threaded and, if asked for, with the given number of threads
+		for (int threads = 1; threads <= options->threads; threads = threads == 1 ? MAX(2, options->threads) : threads + options->threads) {
+			for (size_t d = 0; d < sizeof(bench_dts) / sizeof(bench_dts[0]); d++) {
+				BenchResult r = { "environments", bench_dispatch, "MIXED", count, population, bench_dts[d], threads };
+				double ns;
+				BENCH_TIMED(options->min_time_ns, r.iterations, ns, advance_all(r.dt, threads));
+				r.ns_per_advance = ns / (double)population;
+				r.ns_per_value = 0.0;
+				bench_print(options, &r, rows++ == 0);
+			}
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			destroy_environment_id(envs[i]);
+		}
+		free(envs);
+	}
+	stop_step_threads();
+	return rows;
+}
+
+int main(int argc, char **argv) {
+	BenchOptions options = { false, 1000000, 50e6, 1, false };
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) {
+			options.json = true;
+		}
+		else if (strcmp(argv[i], "--max-population") == 0 && i + 1 < argc) {
+			options.max_population = (size_t)strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+			options.min_time_ns = strtod(argv[++i], NULL) * 1e6;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			options.threads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--stats") == 0) {
+			options.stats = true;
+		}
+		else {
+			fprintf(stderr, "usage: %s [--json] [--max-population N] [--min-time MS] [--threads N] [--stats]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	options.threads = MAX(1, options.threads);
+	set_default_seed(1);
+	set_simd_level(detect_simd_level());
+
+	if (options.json) {
+		printf("[");
+	}
+	else {
+		printf("kind,dispatch,type,environments,population,dt_us,threads,iterations,ns_per_advance,ns_per_value\n");
+	}
+	size_t rows = bench_types(&options, 0);
+	rows = bench_dispatch_calls(&options, rows);
+	bench_environments(&options, rows);
+	if (options.json) {
+		printf("\n]\n");
+	}
+	if (options.stats) {
+		stats_dump(stderr, options.json);
+	}
+	return 0;
+}
@@ -0,0 +1,22 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stddef.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <float.h>
+
+//
+//Unity build of the modulators library, the same translation unit as main.c without the demo.
+//Programs link it and include modulators.h; bench.c and replay.c do. The demo includes modulators.c
+//itself because its checks use the internals.
+//
+
+#include "../../i4t_lib/src/common.c"
+#include "modulators.c"
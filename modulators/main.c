@@ -18,6 +18,8 @@
 #include "../../i4t_lib/src/common.c"
 #include "modulators.c"
 
+//Unlike assert these stay on in Release builds (NDEBUG), ctest runs the demo as the test of the library
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
 
 void modulator_test() {
 	
@@ -29,6 +31,8 @@ void modulator_test() {
 	Modulator *m1 = wave_modulator("wave_1", 1, 0.5);
 	Modulator *m2 = scalar_spring("spring_1", 1, 1, 1);
 	Modulator *m3 = scalar_goal_follower("follow_1");
+	set_follower(m3, scalar_spring("follow_1_spring", 0.5, 0, 0));
+	add_region(m3, (ValueRange) { 0.0, 1.0 });
 
 	value(m1);
 	range(m2);
@@ -74,22 +78,1283 @@ void modulator_test() {
 	add_modulator("env2", m4);
 	add_modulator("env3", m5);
 
-	for (int i = 0; i < env_map.cap; i++) {
-		if (env_map.keys[i]) {
-			ModulatorEnvironment *env = ((ModulatorEnvironment*)env_map.vals[i]);
-			printf("Environment: \"%s\"\n", env->name);
-			for (int j = 0; j < env->modulator_map.cap; j++) {
-				if (env->modulator_map.keys[j]) {
-					Modulator *mod = (Modulator*)env->modulator_map.vals[j];
-					printf("	Modulator: \"%s\"\n",mod->name);
+	advance_environment("env1", 100);
+	advance_environment("env2", 100);
+	advance_environment("env3", 100);
+
+	//the goal of a lazy wave is its value at the current time, not what was cached before the step
+	Modulator *lazy_wave = wave_modulator("lazy_wave", 1, 1);
+	set_lazy(lazy_wave, true);
+	add_modulator("env1", lazy_wave);
+	value(lazy_wave);
+	advance_environment("env1", 125000);
+	float lazy_goal = goal(lazy_wave);
+	CHECK(lazy_goal == value(lazy_wave) && fabsf(lazy_goal - 0.7071f) < 1e-3f);
+
+	EnvId env;
+	for_each_environment(env) {
+		printf("Environment: \"%s\"\n", get_environment(env)->name);
+		Modulator *mod;
+		for_each_modulator(mod, env) {
+			printf("	Modulator: \"%s\"\n",mod->name);
+		}
+	}
+}
+
+//A goal follower picks its next goal only once its follower has come within the threshold of the current one:
+//never while a slow follower creeps along, every time a fast one arrives
+void goal_follower_test() {
+	EnvId env = environment_id("goal_follower_test");
+	Modulator *slow = scalar_goal_follower("slow_follower");
+	set_follower(slow, scalar_spring("slow_follower_spring", 1000.0f, 0.0f, 0.0f));
+	Modulator *fast = scalar_goal_follower("fast_follower");
+	set_follower(fast, scalar_spring("fast_follower_spring", 0.1f, 0.0f, 0.0f));
+	for (int r = 0; r < 2; r++) {
+		add_region(slow, (ValueRange){ 0.8f + 0.1f * (float)r, 0.8f + 0.1f * (float)r });
+		add_region(fast, (ValueRange){ -0.5f + (float)r, -0.5f + (float)r });
+	}
+	add_modulator_id(env, slow);
+	add_modulator_id(env, fast);
+
+	int slow_goals = 0;
+	int fast_goals = 0;
+	float slow_goal = goal(slow);
+	float fast_goal = goal(fast);
+	for (int frame = 0; frame < 600; frame++) {
+		advance_environment_id(env, 16667);
+		if (goal(slow) != slow_goal) {
+			slow_goal = goal(slow);
+			slow_goals++;
+		}
+		if (goal(fast) != fast_goal) {
+			CHECK(fabsf(value(fast) - fast_goal) <= 0.01f);
+			fast_goal = goal(fast);
+			fast_goals++;
+		}
+	}
+	printf("goal follower: %d new goals for the slow follower, %d for the fast one\n", slow_goals, fast_goals);
+	CHECK(slow_goals == 1 && fast_goals > 4);
+	destroy_environment_id(env);
+}
+
+//
+//A week of uptime at 60 frames per second, stepped frame by frame through a ModTimeBase.
+//Afterwards the time base is exactly a week in, and modulators moved by the same calls move
+//the same way as a new copy of them does.
+//
+
+#define UPTIME_FPS 60
+#define UPTIME_WEEK_US 604800000000ull
+#define UPTIME_FRAMES 600
+
+//One of each, the same for the same prefix
+void uptime_modulators(EnvId env, const char *prefix) {
+	char name[64];
+	snprintf(name, sizeof(name), "%s_wave", prefix);
+	add_modulator_id(env, wave_modulator(name, 1.0f, 0.5f));
+	snprintf(name, sizeof(name), "%s_spring", prefix);
+	add_modulator_id(env, scalar_spring(name, 0.5f, 0.0f, 0.0f));
+	snprintf(name, sizeof(name), "%s_newtonian", prefix);
+	add_modulator_id(env, newtonian(name, (ValueRange){ 0.5f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, 0.0f));
+	snprintf(name, sizeof(name), "%s_shift", prefix);
+	add_modulator_id(env, shift_register(name, 8, (ValueRange){ 0.0f, 1.0f }, 0.2f, 0.5f, QUADRATIC));
+	snprintf(name, sizeof(name), "%s_follower", prefix);
+	Modulator *follower = scalar_goal_follower(name);
+	snprintf(name, sizeof(name), "%s_follower_spring", prefix);
+	set_follower(follower, scalar_spring(name, 0.3f, 0.0f, 0.0f));
+	add_region(follower, (ValueRange){ 0.0f, 1.0f });
+	add_modulator_id(env, follower);
+}
+
+Modulator *uptime_modulator(EnvId env, const char *prefix, const char *kind) {
+	char name[64];
+	snprintf(name, sizeof(name), "%s_%s", prefix, kind);
+	return get_modulator(find_modulator(env, name));
+}
+
+//Give both copies the same goals and seeds, then step them side by side and compare
+float uptime_compare(EnvId fresh, EnvId week, ModTimeBase *fresh_time, ModTimeBase *week_time) {
+	const char *kinds[] = { "wave", "spring", "newtonian", "shift" };
+	for (int k = 1; k < 4; k++) {
+		set_seed(uptime_modulator(fresh, "fresh", kinds[k]), 42);
+		set_seed(uptime_modulator(week, "week", kinds[k]), 42);
+	}
+	jump_to(uptime_modulator(fresh, "fresh", "spring"), 0.25f);
+	jump_to(uptime_modulator(week, "week", "spring"), 0.25f);
+	set_goal(uptime_modulator(fresh, "fresh", "spring"), 1.0f);
+	set_goal(uptime_modulator(week, "week", "spring"), 1.0f);
+	reset(uptime_modulator(fresh, "fresh", "newtonian"), 0.25f);
+	reset(uptime_modulator(week, "week", "newtonian"), 0.25f);
+	set_goal(uptime_modulator(fresh, "fresh", "newtonian"), 1.0f);
+	set_goal(uptime_modulator(week, "week", "newtonian"), 1.0f);
+
+	float worst = 0.0f;
+	for (int frame = 0; frame < UPTIME_FRAMES; frame++) {
+		advance_environment_id(fresh, time_base_step(fresh_time, 1));
+		advance_environment_id(week, time_base_step(week_time, 1));
+		for (int k = 0; k < 4; k++) {
+			float a = value(uptime_modulator(fresh, "fresh", kinds[k]));
+			float b = value(uptime_modulator(week, "week", kinds[k]));
+			worst = MAX(worst, fabsf(a - b));
+		}
+	}
+	return worst;
+}
+
+void uptime_test() {
+	EnvId week = environment_id("uptime_week");
+	uptime_modulators(week, "week");
+	ModTimeBase week_time = time_base(UPTIME_FPS);
+	uint64_t rounded_us = 0;
+	for (uint64_t frame = 0; frame < UPTIME_WEEK_US / 1000000 * UPTIME_FPS; frame++) {
+		advance_environment_id(week, time_base_step(&week_time, 1));
+		rounded_us += (1000000 + UPTIME_FPS / 2) / UPTIME_FPS;
+	}
+	printf("a week of frames: time base %llu us, rounded frames %+lld us\n",
+		(unsigned long long)week_time.us, (long long)(rounded_us - UPTIME_WEEK_US));
+	CHECK(week_time.us == UPTIME_WEEK_US);
+	CHECK(elapsed_us(uptime_modulator(week, "week", "wave")) == UPTIME_WEEK_US);
+
+	//the wave is at a whole number of periods, the shift register at a whole number of loops
+	EnvId fresh = environment_id("uptime_fresh");
+	uptime_modulators(fresh, "fresh");
+	ModTimeBase fresh_time = time_base(UPTIME_FPS);
+	float worst = uptime_compare(fresh, week, &fresh_time, &week_time);
+	printf("largest difference to a new copy after a week: %g\n", worst);
+	CHECK(worst < 1e-4f);
+
+	//the goal follower has been picking goals all week, it should still move as smoothly as ever
+	Modulator *follower = uptime_modulator(week, "week", "follower");
+	float last = value(follower);
+	float largest_step = 0.0f;
+	for (int frame = 0; frame < UPTIME_FRAMES; frame++) {
+		advance_environment_id(week, time_base_step(&week_time, 1));
+		largest_step = MAX(largest_step, fabsf(value(follower) - last));
+		last = value(follower);
+	}
+	printf("largest goal follower step per frame after a week: %g\n", largest_step);
+	CHECK(isfinite(last) && largest_step < 0.1f);
+
+	destroy_environment_id(fresh);
+	destroy_environment_id(week);
+}
+
+//
+//Shift register catch up: the ages of the buckets after a large step, drawn at once, against the
+//same step visited bucket by bucket. The two histograms may only differ by sampling noise.
+//
+
+#define CATCH_UP_TRIALS 1000
+#define CATCH_UP_BUCKETS 32
+#define CATCH_UP_AGES 16
+
+//Histogram of the bucket ages after each bucket has been visited visits times
+void catch_up_ages(bool catch_up, float odds, ValueRange age_range, uint64_t visits, double *histogram) {
+	set_shift_register_catch_up(catch_up);
+	memset(histogram, 0, CATCH_UP_AGES * sizeof(double));
+	for (int trial = 0; trial < CATCH_UP_TRIALS; trial++) {
+		Modulator *m = shift_register("catch_up", CATCH_UP_BUCKETS, (ValueRange){ 0.0f, 1.0f }, odds, 1.0f, LINEAR);
+		set_seed(m, 2 * (uint64_t)trial + catch_up);
+		set_age_range(m, age_range);
+		advance(m, visits * 1000000);
+		for (size_t b = 0; b < CATCH_UP_BUCKETS; b++) {
+			histogram[MIN(POOLED(m, shift_register, value_ages)[b], CATCH_UP_AGES - 1)] += 1.0 / (CATCH_UP_TRIALS * CATCH_UP_BUCKETS);
+		}
+		remove_modulator(m);
+	}
+	set_shift_register_catch_up(false);
+}
+
+void catch_up_test() {
+	CHECK(!shift_register_catch_up); //stepping visit by visit is the default
+	struct { float odds; ValueRange age_range; uint64_t visits; } cases[] = {
+		{ 0.2f, { 0.0f, 0.0f }, 50 }, //constant odds
+		{ 0.1f, { 2.0f, 6.0f }, 3 }, //a few replacements, followed one by one
+		{ 0.1f, { 2.0f, 6.0f }, 1000 }, //settled ages
+		{ 0.0f, { 3.0f, 4.0f }, 1003 }, //replaced every 5 visits exactly, the ages are periodic
+	};
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		double visited[CATCH_UP_AGES];
+		double drawn[CATCH_UP_AGES];
+		catch_up_ages(false, cases[c].odds, cases[c].age_range, cases[c].visits, visited);
+		catch_up_ages(true, cases[c].odds, cases[c].age_range, cases[c].visits, drawn);
+		double tv = 0.0;
+		for (int a = 0; a < CATCH_UP_AGES; a++) {
+			tv += 0.5 * fabs(visited[a] - drawn[a]);
+		}
+		printf("shift register catch up, odds %g, ages %g-%g, %llu visits: total variation distance %.4f\n",
+			cases[c].odds, cases[c].age_range.min, cases[c].age_range.max, (unsigned long long)cases[c].visits, tv);
+		CHECK(tv < 0.02);
+	}
+}
+
+//Newtonian moves against a reference that sums the phases of the trapezoid in double
+typedef struct NewtonianCase {
+	const char *name;
+	float from, goal;
+	float speed_limit, acceleration, deceleration;
+}NewtonianCase;
+
+static const NewtonianCase newtonian_cases[] = {
+	{ "triangle", 0.0f, 1.0f, 10.0f, 2.0f, 2.0f },
+	{ "speed limited", 0.0f, 10.0f, 1.0f, 4.0f, 2.0f },
+	{ "downwards", 5.0f, -3.0f, 2.0f, 1.0f, 3.0f },
+	{ "zero distance", 1.0f, 1.0f, 1.0f, 1.0f, 1.0f },
+	{ "instant", 0.0f, 1.0f, 0.0f, 0.0f, 0.0f },
+	{ "no speed limit", 0.0f, 2.0f, 0.0f, 1.0f, 0.5f },
+};
+
+double newtonian_reference(const NewtonianCase *c, double t, double *duration) {
+	double x = fabs((double)c->goal - c->from);
+	double a = c->acceleration > 0.0f ? c->acceleration : NEWTONIAN_INSTANT;
+	double d = c->deceleration > 0.0f ? c->deceleration : NEWTONIAN_INSTANT;
+	double ta = sqrt(2.0 * x * d / (a * (a + d)));
+	double v = a * ta;
+	if (c->speed_limit > 0.0f && v > c->speed_limit) {
+		v = c->speed_limit;
+		ta = v / a;
+	}
+	double td = v / d;
+	double tc = v > 0.0 ? (x - v * ta / 2.0 - v * td / 2.0) / v : 0.0;
+	*duration = ta + tc + td;
+	double ts = MIN(t, *duration);
+	double moved = a * MIN(ts, ta) * MIN(ts, ta) / 2.0 + v * MAX(0.0, ts - ta);
+	if (ts > ta + tc) {
+		moved -= d * (ts - ta - tc) * (ts - ta - tc) / 2.0;
+	}
+	return c->goal >= c->from ? c->from + moved : c->from - moved;
+}
+
+Modulator *newtonian_case(const NewtonianCase *c, const char *name) {
+	Modulator *m = newtonian(name, (ValueRange){ c->speed_limit, c->speed_limit }, (ValueRange){ c->acceleration, c->acceleration },
+		(ValueRange){ c->deceleration, c->deceleration }, c->from);
+	set_goal(m, c->goal);
+	return m;
+}
+
+void newtonian_test() {
+	EnvId env = environment_id("newtonian_test");
+	uint64_t dt = 1000;
+	for (size_t k = 0; k < sizeof(newtonian_cases) / sizeof(newtonian_cases[0]); k++) {
+		const NewtonianCase *c = &newtonian_cases[k];
+		Modulator *m = newtonian_case(c, c->name);
+		add_modulator_id(env, m);
+		double duration;
+		newtonian_reference(c, 0.0, &duration);
+		float worst = 0.0f;
+		float last = value(m);
+		for (uint64_t time = dt; time < (uint64_t)(duration * 1e6) + 500000; time += dt) {
+			advance_environment_id(env, dt);
+			float v = value(m);
+			worst = MAX(worst, (float)fabs(v - newtonian_reference(c, time / 1e6, &duration)));
+			//never faster than the speed limit, never past the goal
+			CHECK(c->speed_limit <= 0.0f || fabsf(v - last) <= c->speed_limit * (dt / 1e6f) * 1.001f + 1e-6f);
+			CHECK(fabsf(v - c->from) <= fabsf(c->goal - c->from) + 1e-5f);
+			last = v;
+		}
+		printf("newtonian %s: %.3f s, largest difference to the reference %g\n", c->name, duration, worst);
+		CHECK(worst <= 1e-5f * MAX(1.0f, fabsf(c->goal - c->from)));
+		CHECK(value(m) == c->goal && modulator_asleep(m));
+		destroy_environment_id(env);
+		env = environment_id("newtonian_test");
+	}
+
+	//reversing halfway starts over from rest where it is, without a jump
+	const NewtonianCase *c = &newtonian_cases[1];
+	Modulator *m = newtonian_case(c, "reversal");
+	add_modulator_id(env, m);
+	for (int step = 0; step < 3000; step++) {
+		advance_environment_id(env, dt);
+	}
+	NewtonianCase back = { "back", value(m), c->from, c->speed_limit, c->acceleration, c->deceleration };
+	set_goal(m, back.goal);
+	double duration;
+	newtonian_reference(&back, 0.0, &duration);
+	float worst = fabsf(value(m) - back.from);
+	for (uint64_t time = dt; time < (uint64_t)(duration * 1e6) + 500000; time += dt) {
+		advance_environment_id(env, dt);
+		worst = MAX(worst, (float)fabs(value(m) - newtonian_reference(&back, time / 1e6, &duration)));
+	}
+	printf("newtonian reversal at %g: largest difference to the reference %g\n", back.from, worst);
+	CHECK(worst <= 1e-4f && value(m) == c->from);
+	destroy_environment_id(env);
+
+	//the SIMD kernels agree with the scalar one
+	EnvId envs[3];
+	for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+		char name[64];
+		snprintf(name, sizeof(name), "newtonian_simd_%d", level);
+		envs[level] = environment_id(name);
+		set_default_seed(level + 1);
+		for (int k = 0; k < 1001; k++) { //not a multiple of the lane count
+			snprintf(name, sizeof(name), "newtonian_simd_%d_%d", level, k);
+			Modulator *n = newtonian(name, (ValueRange){ 0.0f, 4.0f }, (ValueRange){ 0.0f, 8.0f }, (ValueRange){ 0.0f, 8.0f }, (float)(k % 7));
+			set_seed(n, (uint64_t)k);
+			set_goal(n, (float)(k % 13) - 6.0f);
+			set_lazy(n, k % 5 == 0);
+			set_enabled(n, k % 7 != 0);
+			add_modulator_id(envs[level], n);
+		}
+	}
+	worst = 0.0f;
+	for (int step = 0; step < 2000; step++) {
+		for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+			set_simd_level(level);
+			advance_environment_id(envs[level], 5000);
+		}
+		if (step == 500) {
+			for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+				size_t count;
+				Modulator *const *members = environment_modulators(envs[level], &count);
+				for (size_t k = 0; k < count; k += 3) {
+					set_goal(members[k], -value(members[k]));
 				}
 			}
 		}
+		float a[3][1001];
+		for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+			int k = 0;
+			Modulator *n;
+			for_each_modulator(n, envs[level]) {
+				a[level][k++] = value(n);
+			}
+		}
+		for (int k = 0; k < 1001; k++) {
+			worst = MAX(worst, MAX(fabsf(a[1][k] - a[0][k]), fabsf(a[2][k] - a[0][k])));
+		}
+	}
+	set_simd_level(detect_simd_level());
+	printf("newtonian SIMD kernels: largest difference to the scalar kernel %g\n", worst);
+	CHECK(worst <= 1e-5f);
+	for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+		destroy_environment_id(envs[level]);
+	}
+}
+
+//Springs stepped by the scalar, SSE2 and AVX2 kernels. One step from rest at 1 towards 0 gives (1 + x) * exp(-x)
+//with x = 2 / smooth * dt, so its relative difference to the scalar kernel is that of the exp approximation.
+//Then a mixed population with disabled springs and springs owned by goal followers, in pools whose awake part is
+//not a multiple of the lane count, is stepped side by side.
+#define SPRING_SIMD_COUNT 1001
+#define SPRING_SIMD_DT 16667
+
+Modulator *spring_simd_modulator(SimdLevel level, int k) {
+	char name[64];
+	snprintf(name, sizeof(name), "spring_simd_%d_%d", level, k);
+	float smooth = k % 13 == 0 ? 0.00005f : 0.02f + (float)(k % 17) * 0.1f; //some snap to their goal
+	Modulator *m = scalar_spring(name, smooth, (float)(k % 3) * 0.5f, (float)(k % 5) - 2.0f);
+	set_goal(m, (float)(k % 11) * 0.3f - 1.5f);
+	if (k % 4 != 1) {
+		set_enabled(m, k % 7 != 0);
+		return m;
+	}
+	snprintf(name, sizeof(name), "spring_simd_%d_%d_follower", level, k);
+	Modulator *follower = scalar_goal_follower(name);
+	set_seed(follower, (uint64_t)k);
+	set_follower(follower, m);
+	add_region(follower, (ValueRange){ -1.0f, 1.0f });
+	return follower;
+}
+
+void spring_simd_test() {
+	//a bare pool, so that no spring is put to sleep or snapped onto its goal
+	ScalarSpringPool pool = { 0 };
+	ModArena arena = { 0 };
+	scalar_spring_pool_grow(&pool, &arena, SPRING_SIMD_COUNT);
+	float single[3][SPRING_SIMD_COUNT];
+	for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+		for (int k = 0; k < SPRING_SIMD_COUNT; k++) {
+			float x = 87.3f * (float)k / (float)(SPRING_SIMD_COUNT - 1); //up to the clamp of the approximation
+			pool.smooth[k] = k ? 2.0f * (float)SPRING_SIMD_DT * 1e-6f / x : 1.0f;
+			pool.undamp[k] = 0.0f;
+			pool.goal[k] = 0.0f;
+			pool.value[k] = 1.0f;
+			pool.vel[k] = 0.0f;
+			pool.enabled[k] = true;
+			pool.owned[k] = false;
+		}
+		set_simd_level(level);
+		scalar_spring_advance_range(&pool, 0, SPRING_SIMD_COUNT, SPRING_SIMD_DT);
+		memcpy(single[level], pool.value, sizeof(single[level]));
+	}
+	mod_arena_free(&arena);
+	float relative = 0.0f;
+	for (int k = 0; k < SPRING_SIMD_COUNT; k++) {
+		for (SimdLevel level = SIMD_SSE2; level <= SIMD_AVX2; level++) {
+			relative = MAX(relative, fabsf(single[level][k] - single[0][k]) / single[0][k]);
+		}
 	}
+	printf("spring SIMD kernels: largest relative difference of a step to the scalar kernel %g\n", relative);
+	CHECK(relative < 2e-7f);
+
+	EnvId envs[3];
+	for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+		char name[64];
+		snprintf(name, sizeof(name), "spring_simd_%d", level);
+		envs[level] = environment_id(name);
+		set_default_seed(1);
+		for (int k = 0; k < SPRING_SIMD_COUNT; k++) {
+			add_modulator_id(envs[level], spring_simd_modulator(level, k));
+		}
+	}
+	float worst = 0.0f;
+	float disabled_moved = 0.0f;
+	size_t count = environment_modulator_count_id(envs[0]);
+	float *values = xmalloc(3 * count * sizeof(float));
+	float *disabled = xmalloc(count * sizeof(float));
+	for (int step = 0; step < 1000; step++) {
+		for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+			set_simd_level(level);
+			advance_environment_id(envs[level], step % 3 == 0 ? SPRING_SIMD_DT : 1000);
+			if (step % 200 == 100) { //wake the settled ones
+				Modulator *const *members = environment_modulators(envs[level], &count);
+				for (size_t k = 0; k < count; k += 5) {
+					if (members[k]->type == SCALARSPRING && !POOLED(members[k], scalar_spring, owned)) {
+						set_goal(members[k], -goal(members[k]));
+					}
+				}
+			}
+			size_t k = 0;
+			Modulator *m;
+			for_each_modulator(m, envs[level]) {
+				values[level * count + k] = value(m);
+				if (level == SIMD_SCALAR && step == 0) {
+					disabled[k] = value(m);
+				}
+				if (!enabled(m)) {
+					disabled_moved = MAX(disabled_moved, fabsf(value(m) - disabled[k]));
+				}
+				k++;
+			}
+		}
+		for (size_t k = 0; k < count; k++) {
+			float scale = MAX(1.0f, fabsf(values[k]));
+			worst = MAX(worst, MAX(fabsf(values[count + k] - values[k]), fabsf(values[2 * count + k] - values[k])) / scale);
+		}
+	}
+	set_simd_level(detect_simd_level());
+	printf("spring SIMD kernels: largest difference to the scalar kernel over 1000 steps %g (relative to values above 1)\n", worst);
+	CHECK(worst <= 2e-5f && disabled_moved == 0.0f); //the slow springs add up 1000 small differences
+	for (SimdLevel level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+		destroy_environment_id(envs[level]);
+	}
+	free(values);
+	free(disabled);
+}
+
+//Writers on other threads post goals for their own springs while the main thread steps the environment
+#define COMMAND_WRITERS 4
+#define COMMAND_SPRINGS 8
+#define COMMAND_POSTS 20000
+
+typedef struct CommandWriter {
+	EnvId env;
+	ModId springs[COMMAND_SPRINGS];
+	uint64_t full; //posts that found the queue full and were retried after giving up the time slice
+	volatile int64_t finished;
+}CommandWriter;
+
+//Rendering a block gives what stepping and reading the values one step at a time gives, and after the
+//first block it allocates nothing
+#define RENDER_STEPS 64
+
+void render_environment(EnvId env, int k) {
+	char name[64];
+	snprintf(name, sizeof(name), "render_%d_wave", k);
+	add_modulator_id(env, wave_modulator(name, 1.0f, 3.0f));
+	snprintf(name, sizeof(name), "render_%d_spring", k);
+	Modulator *spring = scalar_spring(name, 0.5f, 0.5f, 0.0f);
+	set_goal(spring, 1.0f);
+	add_modulator_id(env, spring);
+	snprintf(name, sizeof(name), "render_%d_newtonian", k);
+	Modulator *n = newtonian(name, (ValueRange){ 0.5f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, 0.0f);
+	set_seed(n, 3);
+	set_lazy(n, true);
+	set_goal(n, 0.5f);
+	add_modulator_id(env, n);
+}
+
+void render_test() {
+	EnvId rendered = environment_id("rendered");
+	EnvId stepped = environment_id("stepped");
+	render_environment(rendered, 0);
+	render_environment(stepped, 1);
+	size_t count;
+	Modulator *const *members = environment_modulators(stepped, &count);
+	float out[3 * RENDER_STEPS];
+	CHECK(render_environment_block_id(rendered, 10000, out, RENDER_STEPS, true) == count && count == 3);
+	const float **sources = get_environment(rendered)->pools.render_sources;
+	for (int step = 0; step < RENDER_STEPS; step++) {
+		advance_environment_id(stepped, 10000);
+		for (size_t k = 0; k < count; k++) {
+			CHECK(out[step * count + k] == value(members[k]));
+		}
+	}
+	CHECK(render_environment_block_id(rendered, 10000, out, RENDER_STEPS, false) == count);
+	CHECK(sources && get_environment(rendered)->pools.render_sources == sources);
+	for (int step = 0; step < RENDER_STEPS; step++) {
+		advance_environment_id(stepped, 10000);
+		for (size_t k = 0; k < count; k++) {
+			CHECK(out[k * RENDER_STEPS + step] == value(members[k]));
+		}
+	}
+	destroy_environment_id(rendered);
+	destroy_environment_id(stepped);
+}
+
+//Routes connected against their dependency order are scheduled in it, a cycle disables every route
+//until it is broken, and moving or removing a modulator drops its routes
+bool route_scheduled(ModulatorPools *pools, Modulator *source, Modulator *target) {
+	for (size_t k = 0; k < buf_len(pools->schedule); k++) {
+		if (pools->schedule[k].source == source && pools->schedule[k].target == target) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void route_test() {
+	EnvId env = environment_id("routed");
+	ModulatorPools *pools = &get_environment(env)->pools;
+	Modulator *w = wave_modulator("routed_wave", 1.0f, 2.0f);
+	Modulator *a = scalar_spring("routed_a", 0.5f, 0.0f, 0.0f);
+	Modulator *b = scalar_spring("routed_b", 0.5f, 0.0f, 0.0f);
+	Modulator *c = scalar_spring("routed_c", 0.5f, 0.0f, 0.0f);
+	Modulator *g = scalar_goal_follower("routed_follower");
+	Modulator *f = scalar_spring("routed_follower_spring", 0.5f, 0.0f, 0.0f);
+	set_follower(g, f);
+	add_region(g, (ValueRange){ 0.0f, 1.0f });
+	Modulator *all[] = { w, a, b, c, g };
+	for (int k = 0; k < 5; k++) {
+		add_modulator_id(env, all[k]);
+	}
+	CHECK(!connect_modulators(a, a, PARAM_GOAL, 1.0f, 0.0f) && !connect_modulators(w, a, PARAM_PERIOD, 1.0f, 0.0f));
+
+	//w -> a -> b -> c, connected back to front, and a replaced route into c
+	CHECK(connect_modulators(a, c, PARAM_GOAL, 1.0f, 0.0f));
+	CHECK(connect_modulators(b, c, PARAM_GOAL, 1.0f, 0.0f));
+	CHECK(connect_modulators(a, b, PARAM_GOAL, 1.0f, 0.0f));
+	CHECK(connect_modulators(w, a, PARAM_GOAL, 0.5f, 0.5f));
+	CHECK(compile_routes(env) && buf_len(pools->schedule) == 3 && !route_scheduled(pools, a, c));
+	CHECK(pools->schedule[0].source == w && pools->schedule[1].source == a && pools->schedule[2].source == b);
+	advance_environment_id(env, 1000);
+	CHECK(goal(a) == value(w) * 0.5f + 0.5f && goal(b) == value(a) && goal(c) == value(b));
+
+	//closing the cycle a -> b -> c -> a replaces w -> a and stops every route
+	CHECK(connect_modulators(c, a, PARAM_GOAL, 1.0f, 0.0f));
+	CHECK(!compile_routes(env) && pools->routes_cyclic && buf_len(pools->schedule) == 0);
+	set_goal(a, 0.25f);
+	set_goal(b, 0.5f);
+	set_goal(c, 0.75f);
+	advance_environment_id(env, 1000);
+	CHECK(goal(a) == 0.25f && goal(b) == 0.5f && goal(c) == 0.75f);
+	disconnect_modulator(a, PARAM_GOAL);
+	CHECK(compile_routes(env) && !pools->routes_cyclic && buf_len(pools->schedule) == 2);
+	advance_environment_id(env, 1000);
+	CHECK(goal(b) == value(a) && goal(c) == value(b));
+
+	//moving b to another environment drops a -> b and b -> c, and the routes of a follower move with it
+	CHECK(connect_modulators(w, a, PARAM_GOAL, 1.0f, 0.0f));
+	CHECK(connect_modulators(f, w, PARAM_AMPLITUDE, 1.0f, 0.0f));
+	CHECK(compile_routes(env) && buf_len(pools->schedule) == 4 && pools->schedule[0].source == f);
+	EnvId other = environment_id("routed_other");
+	add_modulator_id(other, b);
+	CHECK(compile_routes(env) && buf_len(pools->schedule) == 2 && route_scheduled(pools, w, a) && route_scheduled(pools, f, w));
+	CHECK(buf_len(b->pools->routes) == 0);
+	add_modulator_id(other, g);
+	CHECK(f->pools == b->pools && compile_routes(env) && buf_len(pools->schedule) == 1 && route_scheduled(pools, w, a));
+	CHECK(buf_len(b->pools->routes) == 0);
+
+	//removing w drops w -> a
+	remove_modulator(w);
+	CHECK(compile_routes(env) && buf_len(pools->routes) == 0 && buf_len(pools->schedule) == 0);
+	set_goal(a, 0.125f);
+	advance_environment_id(env, 1000);
+	CHECK(goal(a) == 0.125f);
+
+	//a route into the goal of a goal follower drives its follower, without a follower it drives nothing
+	Modulator *lone = scalar_goal_follower("routed_lone");
+	add_region(lone, (ValueRange){ 0.0f, 1.0f });
+	add_modulator_id(env, lone);
+	CHECK(connect_modulators(a, lone, PARAM_GOAL, 1.0f, 0.0f) && compile_routes(env));
+	advance_environment_id(env, 1000);
+	CHECK(goal(lone) == 0.0f && value(lone) == 0.0f);
+	set_follower(lone, scalar_spring("routed_lone_spring", 0.5f, 0.0f, 0.0f));
+	advance_environment_id(env, 1000);
+	CHECK(goal(lone) == value(a) && goal(POOLED(lone, scalar_goal_follower, follower)) == value(a));
+
+	destroy_environment_id(other);
+	destroy_environment_id(env);
+}
+
+void command_writer(void *arg) {
+	CommandWriter *w = arg;
+	for (int i = 1; i <= COMMAND_POSTS; i++) {
+		while (!post_set_goal(w->env, w->springs[i % COMMAND_SPRINGS], (float)i)) {
+			w->full++;
+			mod_thread_yield();
+		}
+	}
+	atomic_store_i64(&w->finished, 1);
+}
+
+void command_queue_test() {
+	EnvId env = environment_id("commands");
+	CHECK(!post_set_goal(env, 0, 1.0f)); //no queue yet
+	create_command_queue(env, 256);
+
+	CommandWriter writers[COMMAND_WRITERS] = { 0 };
+	ModThread threads[COMMAND_WRITERS];
+	for (int t = 0; t < COMMAND_WRITERS; t++) {
+		writers[t].env = env;
+		for (int k = 0; k < COMMAND_SPRINGS; k++) {
+			char name[64];
+			snprintf(name, sizeof(name), "commands_%d_%d", t, k);
+			writers[t].springs[k] = add_modulator_id(env, scalar_spring(name, 0.5f, 0.5f, 0.0f));
+		}
+	}
+	for (int t = 0; t < COMMAND_WRITERS; t++) {
+		mod_thread_create(&threads[t], command_writer, &writers[t]);
+	}
+
+	uint64_t steps = 0;
+	for (bool running = true; running; steps++) {
+		running = false;
+		for (int t = 0; t < COMMAND_WRITERS; t++) {
+			running |= !atomic_load_i64(&writers[t].finished);
+		}
+		advance_environment_id(env, 1000); //the last round drains what was posted before the writers finished
+		mod_thread_yield();
+	}
+	uint64_t full = 0;
+	for (int t = 0; t < COMMAND_WRITERS; t++) {
+		mod_thread_join(threads[t]);
+		full += writers[t].full;
+	}
+	printf("%d commands from %d threads in %llu steps, %llu posts retried on a full queue\n", COMMAND_WRITERS * COMMAND_POSTS,
+		COMMAND_WRITERS, (unsigned long long)steps, (unsigned long long)full);
+
+	//every spring ends up with the last goal its writer posted for it
+	for (int t = 0; t < COMMAND_WRITERS; t++) {
+		for (int k = 0; k < COMMAND_SPRINGS; k++) {
+			int last = COMMAND_POSTS - (COMMAND_POSTS - k) % COMMAND_SPRINGS;
+			CHECK(goal(get_modulator(writers[t].springs[k])) == (float)last);
+		}
+	}
+
+	Modulator *spring = get_modulator(writers[0].springs[0]);
+	post_jump_to(env, spring->id, -1.0f);
+	post_set_enabled(env, spring->id, false);
+	advance_environment_id(env, 1000);
+	CHECK(value(spring) == -1.0f && !enabled(spring));
+
+	destroy_environment_id(env);
+}
+
+//A reader thread samples identical copies of a wave and a shift register while the main thread steps them.
+//Values from different steps would show up as copies that disagree.
+#define PUBLISH_COPIES 16
+#define PUBLISH_STEPS 20000
+
+typedef struct PublishReader {
+	Modulator *copies[2][PUBLISH_COPIES];
+	uint64_t reads;
+	uint64_t torn;
+	volatile int64_t stop;
+}PublishReader;
+
+void publish_reader(void *arg) {
+	PublishReader *r = arg;
+	while (!atomic_load_i64(&r->stop)) {
+		for (int kind = 0; kind < 2; kind++) {
+			float values[PUBLISH_COPIES];
+			read_published(r->copies[kind], PUBLISH_COPIES, values);
+			for (int k = 1; k < PUBLISH_COPIES; k++) {
+				r->torn += values[k] != values[0];
+			}
+			r->reads++;
+		}
+		mod_thread_yield();
+	}
+}
+
+void publish_test() {
+	EnvId env = environment_id("published");
+	PublishReader reader = { 0 };
+	for (int k = 0; k < PUBLISH_COPIES; k++) {
+		char name[64];
+		snprintf(name, sizeof(name), "published_wave_%d", k);
+		reader.copies[0][k] = wave_modulator(name, 1.0f, 3.0f);
+		add_modulator_id(env, reader.copies[0][k]);
+		snprintf(name, sizeof(name), "published_shift_%d", k);
+		set_default_seed(PUBLISH_COPIES); //the same random buckets for every copy
+		reader.copies[1][k] = shift_register(name, 8, (ValueRange){ 0.0f, 1.0f }, 0.5f, 0.25f, LINEAR);
+		add_modulator_id(env, reader.copies[1][k]);
+	}
+	CHECK(read_published_values(env, NULL, 0) == 0);
+	publish_values(env);
+
+	float values[2 * PUBLISH_COPIES];
+	advance_environment_id(env, 12345);
+	CHECK(read_published_values(env, values, 2 * PUBLISH_COPIES) == 2 * PUBLISH_COPIES);
+	CHECK(values[0] == value(reader.copies[0][0]) && values[1] == value(reader.copies[1][0]));
+
+	ModThread thread;
+	mod_thread_create(&thread, publish_reader, &reader);
+	for (int step = 0; step < PUBLISH_STEPS; step++) {
+		advance_environment_id(env, 1000);
+		mod_thread_yield();
+	}
+	atomic_store_i64(&reader.stop, 1);
+	mod_thread_join(thread);
+	printf("%llu snapshots read during %d steps, %llu torn\n", (unsigned long long)reader.reads, PUBLISH_STEPS, (unsigned long long)reader.torn);
+	CHECK(reader.torn == 0);
+
+	destroy_environment_id(env);
+}
+
+//
+//Churn: half of an environment is removed and added again round after round, then environments are
+//destroyed and created. Pool slots, side buffers and ids are recycled, so nothing grows once the
+//free lists are primed, and the ids of removed modulators and destroyed environments no longer resolve.
+//
+
+#define CHURN_LIVE 2000
+#define CHURN_ROUNDS 40
+
+size_t arena_blocks(const ModArena *arena) {
+	size_t n = 0;
+	for (ModArenaBlock *block = arena->blocks; block; block = block->next) {
+		n++;
+	}
+	return n;
+}
+
+Modulator *churn_modulator(int k, int round) {
+	char name[64];
+	snprintf(name, sizeof(name), "churn_%d_%d", k, round);
+	switch (k % 5) {
+	case(0): {
+		Modulator *m = wave_modulator(name, 1.0f, 1.0f + (float)(k % 7));
+		float table[] = { 0.0f, 1.0f, 0.0f, -1.0f, 0.5f };
+		set_wave_table(m, table, 3 + k % 3);
+		return m;
+	}
+	case(1): return scalar_spring(name, 0.5f, 0.5f, 0.0f);
+	case(2): {
+		Modulator *m = scalar_goal_follower(name);
+		char follower_name[80];
+		snprintf(follower_name, sizeof(follower_name), "%s_spring", name);
+		set_follower(m, scalar_spring(follower_name, 0.1f, 0.5f, 0.0f));
+		for (int r = 0; r <= k % 6; r++) {
+			add_region(m, (ValueRange){ 0.1f * (float)r, 0.1f * (float)r + 0.05f });
+		}
+		return m;
+	}
+	case(3): return newtonian(name, (ValueRange){ 0.5f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, (ValueRange){ 0.1f, 1.0f }, 0.0f);
+	default: return shift_register(name, 4 + k % 9, (ValueRange){ 0.0f, 1.0f }, 0.2f, 0.5f, LINEAR);
+	}
+}
+
+void churn_test() {
+	EnvId env = environment_id("churn");
+	ModulatorEnvironment *e = get_environment(env);
+	ModId ids[CHURN_LIVE];
+	for (int k = 0; k < CHURN_LIVE; k++) {
+		ids[k] = add_modulator_id(env, churn_modulator(k, 0));
+	}
+	ModId removed = ids[0];
+	size_t blocks = 0;
+	size_t registry = 0;
+	for (int round = 1; round <= CHURN_ROUNDS; round++) {
+		for (int k = round % 2; k < CHURN_LIVE; k += 2) {
+			CHECK(remove_modulator_id(ids[k]));
+			ids[k] = add_modulator_id(env, churn_modulator(k, round));
+			if (k % 5 == 1) { //a route into a goal that goes with the next removal of either end
+				connect_modulators(get_modulator(ids[(k + 2) % CHURN_LIVE]), get_modulator(ids[k]), PARAM_GOAL, 0.5f, 0.5f);
+			}
+		}
+		advance_environment_id(env, 100000);
+		if (round == 3) { //the registry hands out freed ids once it has enough of them
+			blocks = arena_blocks(&e->pools.arena);
+			registry = buf_len(modulator_registry.entries);
+		}
+		else if (round > 3) {
+			CHECK(arena_blocks(&e->pools.arena) == blocks);
+			CHECK(buf_len(modulator_registry.entries) == registry);
+		}
+	}
+	printf("%d rounds of removing and adding %d modulators: %zu arena blocks, %zu ids\n", CHURN_ROUNDS, CHURN_LIVE / 2, blocks, registry);
+
+	CHECK(!remove_modulator_id(removed) && !get_modulator(removed));
+	CHECK(find_modulator(env, "churn_0_0") == INVALID_ID);
+	CHECK(environment_modulator_count_id(env) == CHURN_LIVE + CHURN_LIVE / 5); //goal followers have a spring
+	for (int k = 0; k < CHURN_LIVE; k++) {
+		Modulator *m = get_modulator(ids[k]);
+		CHECK(m && m->pools == &e->pools && find_modulator(env, m->name) == ids[k]);
+	}
+	//the members are dense and in insertion order: the ones added in the last round come last
+	ModId order[CHURN_LIVE];
+	size_t registered = 0;
+	size_t k = 0;
+	Modulator *m;
+	for_each_modulator(m, env) {
+		CHECK(m->member == k++);
+		if (m->id != INVALID_ID) { //not the spring of a goal follower
+			order[registered++] = m->id;
+		}
+	}
+	CHECK(k == environment_modulator_count_id(env) && registered == CHURN_LIVE);
+	for (int j = CHURN_ROUNDS % 2; j < CHURN_LIVE; j += 2) {
+		CHECK(order[CHURN_LIVE / 2 + j / 2] == ids[j]);
+	}
+
+	//a follower removed by itself leaves its goal follower without one, a goal follower removed while it
+	//sleeps leaves its timer behind, which neither wakes anything nor goes into a snapshot
+	Modulator *owner = get_modulator(ids[2]);
+	Modulator *follower = POOLED(owner, scalar_goal_follower, follower);
+	CHECK(follower->owner == owner);
+	remove_modulator(follower);
+	CHECK(!POOLED(owner, scalar_goal_follower, follower));
+	set_goal(owner, 0.5f);
+	CHECK(goal(owner) == 0.0f && value(owner) == 0.0f);
+	Modulator *sleeper = get_modulator(ids[7]);
+	POOLED(sleeper, scalar_goal_follower, pause_range) = (ValueRange){ 10e6f, 10e6f };
+	for (int frame = 0; frame < 600 && !modulator_asleep(sleeper); frame++) {
+		advance_environment_id(env, 16667);
+	}
+	CHECK(modulator_asleep(sleeper) && buf_len(e->pools.timers) > 0);
+	CHECK(remove_modulator_id(ids[7]));
+	size_t blob_size = snapshot_environment_id(env, NULL, 0);
+	char *blob = xmalloc(blob_size);
+	CHECK(snapshot_environment_id(env, blob, blob_size) == blob_size && buf_len(e->pools.timers) > 0);
+	CHECK(((SnapshotHeader *)blob)->timer_count == 0);
+	advance_environment_id(env, 20000000);
+	CHECK(buf_len(e->pools.timers) == 0);
+	//a blob that only turns out invalid once its pools are read leaves the environment as it is,
+	//the valid one replaces it under the same ids
+	SnapshotHeader *header = (SnapshotHeader *)blob;
+	uint64_t pool_len[5];
+	for (int t = 0; t < 5; t++) {
+		pool_len[t] = header->pools[t].len;
+	}
+	ScalarGoalFollowerPoolLayout goal_followers;
+	ScalarSpringPoolLayout springs;
+	scalar_goal_follower_pool_place(&goal_followers, (size_t)header->pools[SCALARGOALFOLLOWER].offset, (size_t)pool_len[SCALARGOALFOLLOWER]);
+	scalar_spring_pool_place(&springs, (size_t)header->pools[SCALARSPRING].offset, (size_t)pool_len[SCALARSPRING]);
+	Modulator *led = get_modulator(ids[12]);
+	Modulator *led_follower = POOLED(led, scalar_goal_follower, follower);
+	CHECK(led->type == SCALARGOALFOLLOWER && led_follower && led_follower->owner == led);
+	char *pristine = xmalloc(blob_size);
+	memcpy(pristine, blob, blob_size);
+	//the follower of a goal follower is itself, is claimed by another, is not owned, or the two follow each other
+	uint64_t index = led->member + 1;
+	memcpy(blob + goal_followers.follower + led->slot * sizeof(uint64_t), &index, sizeof(index));
+	CHECK(restore_environment(blob, blob_size) == INVALID_ID);
+	memcpy(blob, pristine, blob_size);
+	index = led_follower->member + 1;
+	memcpy(blob + goal_followers.follower + owner->slot * sizeof(uint64_t), &index, sizeof(index));
+	CHECK(restore_environment(blob, blob_size) == INVALID_ID);
+	memcpy(blob, pristine, blob_size);
+	index = get_modulator(ids[1])->member + 1;
+	memcpy(blob + goal_followers.follower + owner->slot * sizeof(uint64_t), &index, sizeof(index));
+	CHECK(restore_environment(blob, blob_size) == INVALID_ID);
+	memcpy(blob, pristine, blob_size);
+	index = led->member + 1;
+	memcpy(blob + goal_followers.follower + owner->slot * sizeof(uint64_t), &index, sizeof(index));
+	index = owner->member + 1;
+	memcpy(blob + goal_followers.follower + led->slot * sizeof(uint64_t), &index, sizeof(index));
+	blob[goal_followers.owned + owner->slot * sizeof(bool)] = true;
+	blob[goal_followers.owned + led->slot * sizeof(bool)] = true;
+	blob[springs.owned + led_follower->slot * sizeof(bool)] = false;
+	CHECK(restore_environment(blob, blob_size) == INVALID_ID);
+	memcpy(blob, pristine, blob_size);
+	free(pristine);
+	uint64_t spring_handle;
+	memcpy(&spring_handle, blob + header->pools[SCALARSPRING].offset, sizeof(spring_handle));
+	memset(blob + header->pools[SCALARSPRING].offset, 0, sizeof(spring_handle)); //the first spring slot has no handle
+	size_t live = environment_modulator_count_id(env);
+	CHECK(restore_environment(blob, blob_size) == INVALID_ID);
+	CHECK(get_environment(env) == e && find_environment("churn") == env && environment_modulator_count_id(env) == live);
+	CHECK(get_modulator(ids[1]) && find_modulator(env, get_modulator(ids[1])->name) == ids[1]);
+	memcpy(blob + header->pools[SCALARSPRING].offset, &spring_handle, sizeof(spring_handle));
+	CHECK(restore_environment(blob, blob_size) == env && environment_modulator_count_id(env) == live);
+	e = get_environment(env);
+	CHECK(get_modulator(ids[1]) && get_modulator(ids[1])->pools == &e->pools);
+	free(blob);
+
+	destroy_environment_id(env);
+	CHECK(!get_environment(env) && !get_modulator(ids[1]));
+
+	//environments come and go, a stale environment id stays stale
+	size_t environments = buf_len(environment_registry.entries);
+	for (int round = 0; round < 100; round++) {
+		EnvId other = environment_id("churn_other");
+		add_modulator_id(other, churn_modulator(round, 0));
+		destroy_environment_id(other);
+		CHECK(!get_environment(other) && find_environment("churn_other") == INVALID_ID);
+	}
+	CHECK(buf_len(environment_registry.entries) <= environments + environment_registry.min_free + 1);
+
+	//a stale id stays stale over a thousand reuses of its slot, after its last generation the slot is retired
+	IdRegistry ids_registry = { .min_free = 0 };
+	int entry;
+	uint64_t stale = registry_add(&ids_registry, &entry);
+	registry_release(&ids_registry, stale);
+	for (int round = 0; round < 1000; round++) {
+		uint64_t id = registry_add(&ids_registry, &entry);
+		CHECK(id_index(id) == 0 && registry_get(&ids_registry, id) == &entry && !registry_get(&ids_registry, stale));
+		registry_release(&ids_registry, id);
+	}
+	ids_registry.generations[0] = RETIRED_GENERATION - 1;
+	uint64_t last = registry_add(&ids_registry, &entry);
+	CHECK(id_index(last) == 0);
+	registry_release(&ids_registry, last);
+	CHECK(!registry_get(&ids_registry, last) && id_index(registry_add(&ids_registry, &entry)) == 1);
+	buf_free(ids_registry.entries);
+	buf_free(ids_registry.generations);
+	buf_free(ids_registry.free_slots);
+
+	//destroying environments out of order keeps the rest findable by name and by position
+	EnvId scattered[8];
+	ModId first[8];
+	char name[32];
+	for (int i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "churn_scattered%d", i);
+		scattered[i] = environment_id(name);
+		first[i] = add_modulator_id(scattered[i], churn_modulator(i, 0));
+	}
+	size_t count = environment_count();
+	for (int i = 0; i < 8; i += 3) {
+		destroy_environment_id(scattered[i]);
+		count--;
+	}
+	CHECK(environment_count() == count);
+	for (size_t at = 0; at < count; at++) {
+		ModulatorEnvironment *listed = get_environment(environment_at(at));
+		CHECK(listed && listed->live == at && find_environment(listed->name) == listed->id);
+	}
+	for (int i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "churn_scattered%d", i);
+		bool gone = i % 3 == 0;
+		CHECK(find_environment(name) == (gone ? INVALID_ID : scattered[i]));
+		CHECK(!get_modulator(first[i]) == gone);
+	}
+	//the handles of the destroyed modulators are reused, their old ids stay stale
+	for (int j = 0; j < 8; j++) {
+		add_modulator_id(scattered[1], churn_modulator(j, 1));
+	}
+	for (int i = 0; i < 8; i++) {
+		CHECK(!get_modulator(first[i]) == (i % 3 == 0));
+		destroy_environment_id(scattered[i]);
+	}
+
+	//an environment whose last modulator moves to another keeps its clock, queue, publication and recording
+	EnvId from = environment_id("churn_from");
+	EnvId to = environment_id("churn_to");
+	Modulator *moved = scalar_spring("churn_moved", 0.5f, 0.0f, 0.0f);
+	add_modulator_id(from, moved);
+	create_command_queue(from, 16);
+	publish_values(from);
+	CHECK(start_recording(from));
+	advance_environment_id(from, 1000);
+	add_modulator_id(to, moved);
+	ModulatorPools *pools = &get_environment(from)->pools;
+	CHECK(pools->commands && pools->publication && pools->recorder && pools->clock == 1000 && !pools->members);
+	CHECK(post_set_enabled(from, INVALID_ID, false));
+	advance_environment_id(from, 1000);
+	float published;
+	CHECK(read_published_values(from, &published, 1) == 0 && pools->clock == 2000);
+	size_t size;
+	void *trace = stop_recording(from, &size);
+	CHECK(trace && size > 0);
+	free(trace);
+	destroy_environment_id(from);
+	destroy_environment_id(to);
+}
+
+//
+//Threads: the same seeded environments are stepped with advance_all on one thread and on several. The first
+//environment has more awake modulators of every type than fit in a task, so its pools are split over the workers;
+//the values after every step must be identical, the goal followers' springs and the routes included.
+//
+
+#define THREADS_ENVIRONMENTS 5
+#define THREADS_LARGE 25000
+#define THREADS_STEPS 120
+
+//The values of all modulators of envs after every step
+float *threads_run(int threads) {
+	set_default_seed(7);
+	EnvId envs[THREADS_ENVIRONMENTS];
+	for (int e = 0; e < THREADS_ENVIRONMENTS; e++) {
+		char name[64];
+		snprintf(name, sizeof(name), "threads_%d", e);
+		envs[e] = environment_id(name);
+		int population = e == 0 ? THREADS_LARGE : 37 * e;
+		Modulator *follower = NULL;
+		for (int k = 0; k < population; k++) {
+			Modulator *m = churn_modulator(k, e);
+			set_enabled(m, k % 23 != 0);
+			add_modulator_id(envs[e], m);
+			if (m->type == SCALARGOALFOLLOWER) {
+				follower = m;
+			}
+			else if (m->type == SCALARSPRING && follower) { //the spring follows the goal follower before it
+				connect_modulators(follower, m, PARAM_GOAL, 0.5f, 0.25f);
+			}
+		}
+	}
+	float *values = NULL;
+	for (int step = 0; step < THREADS_STEPS; step++) {
+		advance_all(step % 4 == 3 ? 250000 : 16667, threads);
+		for (int e = 0; e < THREADS_ENVIRONMENTS; e++) {
+			Modulator *m;
+			for_each_modulator(m, envs[e]) {
+				buf_push(values, value(m));
+			}
+		}
+	}
+	for (int e = 0; e < THREADS_ENVIRONMENTS; e++) {
+		destroy_environment_id(envs[e]);
+	}
+	return values;
+}
+
+void threads_test() {
+	float *single = threads_run(1);
+	int thread_counts[] = { 4, 2, 3 };
+	for (int t = 0; t < 3; t++) {
+		float *values = threads_run(thread_counts[t]);
+		size_t differ = 0;
+		for (size_t k = 0; k < buf_len(single); k++) {
+			differ += values[k] != single[k];
+		}
+		printf("advance_all on %d threads: %zu of %zu values differ from one thread\n", thread_counts[t], differ, buf_len(single));
+		CHECK(buf_len(values) == buf_len(single) && differ == 0);
+		buf_free(values);
+	}
+	stop_step_threads();
+	stop_step_threads(); //nothing left to stop
+	buf_free(single);
+}
+
+//
+//Replay: a session of an environment is recorded while its values are collected, then the trace is replayed
+//in a new copy of it and must give the same values bit for bit, through modulators joining and leaving
+//and commands from the queue.
+//
+
+#define REPLAY_FRAMES 600
+
+void replay_test() {
+	EnvId env = environment_id("replayed");
+	uptime_modulators(env, "replayed");
+	create_command_queue(env, 64);
+	Modulator *spring = uptime_modulator(env, "replayed", "spring");
+	Modulator *wave = uptime_modulator(env, "replayed", "wave");
+	ModId newtonian_id = find_modulator(env, "replayed_newtonian");
+	ModId shift_id = find_modulator(env, "replayed_shift");
+	CHECK(start_recording(env));
+
+	char *live = NULL;
+	for (int frame = 0; frame < REPLAY_FRAMES; frame++) {
+		if (frame % 50 == 10) {
+			set_goal(spring, (float)(frame % 7) / 7.0f);
+			set_enabled(wave, frame % 100 != 10);
+			post_set_goal(env, newtonian_id, (float)(frame % 3));
+		}
+		if (frame == 200) {
+			remove_modulator_id(shift_id);
+			add_modulator_id(env, shift_register("replayed_shift_2", 6, (ValueRange){ -1.0f, 1.0f }, 0.5f, 0.1f, QUADRATIC));
+		}
+		if (frame == 250) {
+			jump_to(spring, -1.0f);
+			reset(get_modulator(newtonian_id), 0.5f);
+		}
+		if (frame == 300) {
+			advance(wave, 5000);
+		}
+		advance_environment_id(env, 16667);
+		collect_values(&live, env);
+	}
+	size_t trace_size;
+	void *trace = stop_recording(env, &trace_size);
+	size_t none;
+	CHECK(trace && !stop_recording(env, &none) && none == 0);
+
+	//the copy runs next to the recorded environment, which it leaves alone
+	ReplayResult result;
+	bool ok = replay_trace(trace, trace_size, true, &result);
+	CHECK(result.env != env && get_environment(env) && find_environment("replayed") == env);
+	CHECK(get_modulator(newtonian_id) && get_modulator(newtonian_id)->pools == &get_environment(env)->pools);
+	CHECK(find_modulator(result.env, "replayed_newtonian") != newtonian_id);
+	destroy_environment_id(env);
+	ValueDiff diff;
+	bool same = compare_values(live, buf_len(live), result.values, buf_len(result.values), 0.0f, &diff);
+	printf("replayed %llu steps from a %zu byte trace, largest difference %g\n", (unsigned long long)result.steps, trace_size, diff.largest);
+	CHECK(ok && result.steps == REPLAY_FRAMES && same);
+
+	//the first value of a step in the middle of the session off by 1e-3
+	size_t at = 0;
+	for (int step = 0; step < REPLAY_FRAMES / 2; step++) {
+		uint32_t count;
+		memcpy(&count, live + at, sizeof(count));
+		at += sizeof(count) + count * sizeof(float);
+	}
+	at += sizeof(uint32_t);
+	float v;
+	memcpy(&v, live + at, sizeof(v));
+	v += 1e-3f;
+	memcpy(live + at, &v, sizeof(v));
+	CHECK(!compare_values(live, buf_len(live), result.values, buf_len(result.values), 1e-4f, &diff) && diff.mismatches == 1);
+	CHECK(diff.step == REPLAY_FRAMES / 2 && diff.modulator == 0 && diff.largest > 1e-4f);
+	CHECK(compare_values(live, buf_len(live), result.values, buf_len(result.values), 1e-2f, &diff));
+	CHECK(!compare_values(live, buf_len(live) - sizeof(float), result.values, buf_len(result.values), 1e-2f, &diff));
+
+	destroy_environment_id(result.env);
+	buf_free(result.values);
+	CHECK(!replay_trace(trace, trace_size - 8, false, &result));
+	destroy_environment_id(result.env);
+	buf_free(live);
+	free(trace);
+}
+
+//
+//Loader: an error points at the line and column where it is and a document with an error builds nothing;
+//every key of every type ends up in the modulator it describes.
+//
+
+//A document with one environment of the given modulators
+const char *loader_document(char *out, size_t cap, const char *env_name, const char *modulators) {
+	snprintf(out, cap, "{\n  \"environments\": [\n    { \"name\": \"%s\", \"modulators\": [\n      %s\n    ] }\n  ]\n}\n", env_name, modulators);
+	return out;
+}
+
+//Loading text fails with the error at the first occurrence of marker
+void loader_fails_at(const char *text, const char *marker, const char *message) {
+	size_t environments = environment_count();
+	LoadError error;
+	CHECK(!load_environments(text, strlen(text), &error));
+	const char *at = strstr(text, marker);
+	int line = 1;
+	const char *line_start = text;
+	for (const char *c = text; c < at; c++) {
+		if (*c == '\n') {
+			line++;
+			line_start = c + 1;
+		}
+	}
+	if (error.line != line || error.column != (int)(at - line_start) + 1 || !strstr(error.message, message)) {
+		printf("expected \"%s\" at %d:%d, got \"%s\" at %d:%d\n", message, line, (int)(at - line_start) + 1, error.message, error.line, error.column);
+	}
+	CHECK(error.line == line && error.column == (int)(at - line_start) + 1 && strstr(error.message, message));
+	CHECK(environment_count() == environments && find_environment("loaded") == INVALID_ID);
+}
+
+void loader_test() {
+	char text[2048];
+	const char *spring = "{ \"name\": \"s\", \"type\": \"scalar_spring\", \"smooth\": 0.5, \"undamp\": 0 }";
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"s\", \"type\": \"scalar_spring\", \"smooth\": -1, \"undamp\": 0 }"),
+		"-1", "non-negative");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"b\", \"type\": \"shift_register\", \"buckets\": -3, \"value_range\": [0, 1], \"odds\": 0.5, \"period\": 1 }"),
+		"-3", "non-negative integer");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"b\", \"type\": \"shift_register\", \"buckets\": 4, \"value_range\": [0, 1], \"odds\": 1.5, \"period\": 1 }"),
+		"1.5", "odds");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"b\", \"type\": \"shift_register\", \"buckets\": 4, \"value_range\": [0, 1], \"odds\": 0.5, \"period\": 1, \"age_range\": [6, 2] }"),
+		"[6, 2]", "min first");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"g\", \"type\": \"scalar_goal_follower\", \"pause_range\": [-1, 2] }"),
+		"[-1, 2]", "non-negative");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"w\", \"type\": \"wave\", \"amplitude\": 1e39, \"frequency\": 1 }"),
+		"1e39", "out of range");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"w\", \"type\": \"wave\", \"amplitude\": 1 }"),
+		"{ \"name\": \"w\"", "wave without 'frequency'");
+	loader_fails_at(loader_document(text, sizeof(text), "loaded", "{ \"name\": \"s\", \"type\": \"scalar_spring\", \"smoth\": 0.5, \"undamp\": 0 }"),
+		"\"smoth\"", "unknown key 'smoth'");
+	//the first environment is fine, the second is not: neither is built
+	char second[512];
+	snprintf(second, sizeof(second), "{ \"environments\": [ { \"name\": \"loaded\", \"modulators\": [ %s ] },\n"
+		"{ \"name\": \"loaded_second\", \"modulators\": [ %s, %s ] } ] }", spring, spring, "{ \"name\": \"t\", \"type\": \"tone\" }");
+	loader_fails_at(second, "\"tone\"", "modulator type");
+	CHECK(find_environment("loaded_second") == INVALID_ID);
+
+	//every key of every type
+	loader_document(text, sizeof(text), "loaded",
+		"{ \"name\": \"w\", \"type\": \"wave\", \"enabled\": false, \"lazy\": true, \"amplitude\": 0.5, \"frequency\": 0e999, \"table\": [0, 0.5, 1] },\n"
+		"      { \"name\": \"v\", \"type\": \"wave\", \"amplitude\": 1, \"frequency\": 2, \"shape\": \"saw\" },\n"
+		"      { \"name\": \"s\", \"type\": \"scalar_spring\", \"smooth\": 0.25, \"undamp\": 0.5, \"initial\": 0.125, \"goal\": 0.75 },\n"
+		"      { \"name\": \"g\", \"type\": \"scalar_goal_follower\", \"seed\": 3, \"regions\": [[0, 0.5], [0.5, 1]], \"random_region\": true,\n"
+		"        \"threshold\": 0.02, \"vel_threshold\": 0.001, \"pause_range\": [1000, 2000],\n"
+		"        \"follower\": { \"name\": \"gs\", \"type\": \"scalar_spring\", \"smooth\": 0.1, \"undamp\": 0 } },\n"
+		"      { \"name\": \"n\", \"type\": \"newtonian\", \"seed\": 5, \"lazy\": true, \"speed_limit\": [0.5, 1], \"acceleration\": [0.25, 0.5],\n"
+		"        \"deceleration\": [0.125, 0.25], \"initial\": 0.5, \"goal\": 1 },\n"
+		"      { \"name\": \"r\", \"type\": \"shift_register\", \"seed\": 7, \"buckets\": 6, \"value_range\": [-1, 1], \"odds\": 0.25, \"period\": 0.5,\n"
+		"        \"interp\": \"quadratic\", \"age_range\": [2, 6] }");
+	LoadError error;
+	CHECK(load_environments(text, strlen(text), &error));
+	EnvId env = find_environment("loaded");
+	CHECK(env != INVALID_ID && environment_modulator_count_id(env) == 7);
+
+	Modulator *w = get_modulator(find_modulator(env, "w"));
+	CHECK(w && w->type == WAVE && !enabled(w) && POOLED(w, wave, lazy) && POOLED(w, wave, amplitude) == 0.5f);
+	CHECK(POOLED(w, wave, frequency) == 0.0f && POOLED(w, wave, shape) == WAVETABLE);
+	CHECK(POOLED(w, wave, table_len) == 3 && POOLED(w, wave, table)[1] == 0.5f);
+	Modulator *v = get_modulator(find_modulator(env, "v"));
+	CHECK(v && POOLED(v, wave, shape) == SAW && POOLED(v, wave, frequency) == 2.0f);
+
+	Modulator *s = get_modulator(find_modulator(env, "s"));
+	CHECK(s && POOLED(s, scalar_spring, smooth) == 0.25f && POOLED(s, scalar_spring, undamp) == 0.5f);
+	CHECK(POOLED(s, scalar_spring, value) == 0.125f && goal(s) == 0.75f);
+
+	Modulator *g = get_modulator(find_modulator(env, "g"));
+	Modulator *gs = g ? POOLED(g, scalar_goal_follower, follower) : NULL;
+	CHECK(gs && strcmp(gs->name, "gs") == 0 && gs->owner == g && POOLED(gs, scalar_spring, smooth) == 0.1f);
+	CHECK(POOLED(g, scalar_goal_follower, region_count) == 2 && POOLED(g, scalar_goal_follower, regions)[1].min == 0.5f);
+	CHECK(POOLED(g, scalar_goal_follower, random_region) && POOLED(g, scalar_goal_follower, threshold) == 0.02f);
+	CHECK(POOLED(g, scalar_goal_follower, vel_threshold) == 0.001f && POOLED(g, scalar_goal_follower, pause_range).max == 2000.0f);
+
+	Modulator *n = get_modulator(find_modulator(env, "n"));
+	CHECK(n && POOLED(n, newtonian, lazy) && POOLED(n, newtonian, speed_limit_range).min == 0.5f);
+	CHECK(POOLED(n, newtonian, acceleration_range).max == 0.5f && POOLED(n, newtonian, deceleration_range).min == 0.125f);
+	CHECK(POOLED(n, newtonian, from) == 0.5f && goal(n) == 1.0f);
+
+	Modulator *r = get_modulator(find_modulator(env, "r"));
+	CHECK(r && POOLED(r, shift_register, bucket_count) == 6 && POOLED(r, shift_register, value_range).min == -1.0f);
+	CHECK(POOLED(r, shift_register, odds) == 0.25f && POOLED(r, shift_register, period) == 0.5f);
+	CHECK(POOLED(r, shift_register, interp) == QUADRATIC && POOLED(r, shift_register, age_range).max == 6.0f);
+	Modulator *seeded = shift_register("loaded_seeded", 6, (ValueRange){ -1.0f, 1.0f }, 0.25f, 0.5f, QUADRATIC);
+	set_seed(seeded, 7);
+	CHECK(memcmp(&POOLED(seeded, shift_register, rng), &POOLED(r, shift_register, rng), sizeof(ModRng)) == 0);
+	remove_modulator(seeded);
+	destroy_environment_id(env);
+
+	//the same from a file, and a file that is not there
+	const char *path = "loader_test.json";
+	FILE *file = fopen(path, "wb");
+	CHECK(file && fwrite(text, 1, strlen(text), file) == strlen(text));
+	fclose(file);
+	CHECK(load_environments_file(path, &error) && environment_modulator_count("loaded") == 7);
+	remove(path);
+	destroy_environment_id(find_environment("loaded"));
+	CHECK(!load_environments_file(path, &error) && error.line == 0 && strstr(error.message, path));
 }
 
-void main() {
+int main(void) {
 	printf("Hello Modulators!\n");
 	modulator_test();
-	getchar();
+	goal_follower_test();
+	newtonian_test();
+	spring_simd_test();
+	uptime_test();
+	catch_up_test();
+	route_test();
+	render_test();
+	command_queue_test();
+	publish_test();
+	churn_test();
+	threads_test();
+	replay_test();
+	loader_test();
+	printf("all checks passed\n");
+	return 0;
 }
\ No newline at end of file
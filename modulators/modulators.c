@@ -1,757 +1,6138 @@
-typedef enum ModulatorType {
-	WAVE,
-	SCALARSPRING,
-	SCALARGOALFOLLOWER,
-	NEWTONIAN,
-	SHIFTREGISTER
-}ModulatorType;
-
-typedef struct ValueRange {
-	float min;
-	float max;
-}ValueRange;
+#include "modulators.h"
 
 //
-//Modulator structs
+//Platform
 //
 
-typedef struct Modulator Modulator;
-
-typedef struct ModWave {
-	float amplitude;
-	float frequency;
-	uint64_t time;
-	float  value;
-	bool enabled;
-}ModWave;
-
-typedef struct ModScalarSpring {
-	float smooth;
-	float undamp;
-	float goal;
-	float value;
-	float vel;
-	uint64_t time;
-	bool enabled;
-}ModScalarSpring;
-
-typedef struct ModScalarGoalFollower{
-	ValueRange *regions;
-	bool random_region;
-	float threshold;
-	float vel_threshold;
-	ValueRange pause_range;
-	Modulator *follower; 
-	size_t current_region;
-	uint64_t paused_left;
-	uint64_t time;
-	bool enabled;
-}ModScalarGoalFollower;
-
-typedef struct PhaseTime {
-	float acceleration;
-	float sustain;
-	float deceleration;
-}PhaseTime;
-
-typedef struct ModNewtonian {
-	ValueRange speed_limit_range;
-	ValueRange acceleration_range;
-	ValueRange deceleration_range;
-	float goal;
-	float value;
-	uint64_t time;
-	bool enabled;
-	float s;
-	float a;
-	float d;
-	float f;
-	PhaseTime phase;
-}ModNewtonian;
-
-typedef enum ShiftRegisterInterp{
-	LINEAR,
-	QUADRATIC,
-	NONE
-}ShiftRegisterInterp;
-
-typedef struct ModShiftRegister {
-	float *buckets; 
-	uint32_t *value_ages;
-	ValueRange value_range;
-	float odds;
-	ValueRange age_range;
-	float period;
-	ShiftRegisterInterp interp;
-	uint64_t time;
-	float value;
-	bool enabled;
-}ModShiftRegister;
-
-typedef struct ModulatorFunctions {
-	float(*value)(Modulator *);
-	ValueRange(*range)(Modulator *);
-	float(*goal)(Modulator *);
-	void(*set_goal)(Modulator *, float);
-	uint64_t(*elapsed_us)(Modulator *);
-	bool(*enabled)(Modulator *);
-	void(*set_enabled)(Modulator *, bool);
-	void(*advance)(Modulator *, uint64_t);
-} ModulatorFunctions;
-
-typedef struct Modulator {
-	const ModulatorFunctions * const modulator_functions;
-	const char *name;
-	ModulatorType type;
-	union {
-		ModWave wave;
-		ModScalarSpring scalar_spring;
-		ModScalarGoalFollower scalar_goal_follower;
-		ModNewtonian newtonian;
-		ModShiftRegister shift_register;
-	};
-}Modulator;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MOD_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define MOD_X86 0
+#endif
 
-//
-//public API functions that need to be implemented by all Modulator types
-//
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
 
-inline float value(Modulator *m) { return m->modulator_functions->value(m); }
-inline ValueRange range(Modulator *m) { return m->modulator_functions->range(m); }
-inline float goal(Modulator *m) { return m->modulator_functions->goal(m); }
-inline void set_goal(Modulator *m, float f) { m->modulator_functions->set_goal(m, f); }
-inline uint64_t elapsed_us(Modulator *m) { return m->modulator_functions->elapsed_us(m); }
-inline bool enabled(Modulator *m) { return m->modulator_functions->enabled(m); }
-inline void set_enabled(Modulator *m, bool enabled) { m->modulator_functions->set_enabled(m, enabled); }
-inline void advance(Modulator *m, uint64_t dt) { m->modulator_functions->advance(m, dt); }
+//--threads and atomics
 
-//
-//private implementations of the different ModulatorFunctions
-//
+#if defined(_WIN32)
+typedef HANDLE ModThread;
+typedef SRWLOCK ModMutex;
+typedef CONDITION_VARIABLE ModCond;
 
-//--wave modulator--
+typedef struct ModThreadStart {
+	void(*func)(void *);
+	void *arg;
+}ModThreadStart;
 
-float wave_val(Modulator *m) {
-	return m->wave.value;
-}
-ValueRange wave_range(Modulator *m) {
-	ValueRange r = { -m->wave.amplitude, m->wave.amplitude};
-	return r;
+DWORD WINAPI mod_thread_entry(LPVOID param) {
+	ModThreadStart start = *(ModThreadStart *)param;
+	free(param);
+	start.func(start.arg);
+	return 0;
 }
 
-float wave_goal(Modulator *m) {
-	return m->wave.value;
+void mod_thread_create(ModThread *thread, void(*func)(void *), void *arg) {
+	ModThreadStart *start = xmalloc(sizeof(ModThreadStart));
+	start->func = func;
+	start->arg = arg;
+	*thread = CreateThread(NULL, 0, mod_thread_entry, start, 0, NULL);
 }
+void mod_thread_join(ModThread thread) { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); }
+void mod_thread_yield(void) { SwitchToThread(); }
+void mod_mutex_init(ModMutex *mutex) { InitializeSRWLock(mutex); }
+void mod_mutex_destroy(ModMutex *mutex) {}
+void mod_mutex_lock(ModMutex *mutex) { AcquireSRWLockExclusive(mutex); }
+void mod_mutex_unlock(ModMutex *mutex) { ReleaseSRWLockExclusive(mutex); }
+void mod_cond_init(ModCond *cond) { InitializeConditionVariable(cond); }
+void mod_cond_destroy(ModCond *cond) {}
+void mod_cond_wait(ModCond *cond, ModMutex *mutex) { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+void mod_cond_signal(ModCond *cond) { WakeConditionVariable(cond); }
+void mod_cond_broadcast(ModCond *cond) { WakeAllConditionVariable(cond); }
+#else
+typedef pthread_t ModThread;
+typedef pthread_mutex_t ModMutex;
+typedef pthread_cond_t ModCond;
 
-void wave_set_goal(Modulator *m, float f) {
-}
+typedef struct ModThreadStart {
+	void(*func)(void *);
+	void *arg;
+}ModThreadStart;
 
-uint64_t wave_elapsed_us(Modulator *m) {
-	return m->wave.time;
+void *mod_thread_entry(void *param) {
+	ModThreadStart start = *(ModThreadStart *)param;
+	free(param);
+	start.func(start.arg);
+	return NULL;
 }
 
-bool wave_enabled(Modulator *m) {
-	return m->wave.enabled;
+void mod_thread_create(ModThread *thread, void(*func)(void *), void *arg) {
+	ModThreadStart *start = xmalloc(sizeof(ModThreadStart));
+	start->func = func;
+	start->arg = arg;
+	pthread_create(thread, NULL, mod_thread_entry, start);
 }
+void mod_thread_join(ModThread thread) { pthread_join(thread, NULL); }
+void mod_thread_yield(void) { sched_yield(); }
+void mod_mutex_init(ModMutex *mutex) { pthread_mutex_init(mutex, NULL); }
+void mod_mutex_destroy(ModMutex *mutex) { pthread_mutex_destroy(mutex); }
+void mod_mutex_lock(ModMutex *mutex) { pthread_mutex_lock(mutex); }
+void mod_mutex_unlock(ModMutex *mutex) { pthread_mutex_unlock(mutex); }
+void mod_cond_init(ModCond *cond) { pthread_cond_init(cond, NULL); }
+void mod_cond_destroy(ModCond *cond) { pthread_cond_destroy(cond); }
+void mod_cond_wait(ModCond *cond, ModMutex *mutex) { pthread_cond_wait(cond, mutex); }
+void mod_cond_signal(ModCond *cond) { pthread_cond_signal(cond); }
+void mod_cond_broadcast(ModCond *cond) { pthread_cond_broadcast(cond); }
+#endif
 
-void wave_set_enabled(Modulator *m, bool enabled) {
-	m->wave.enabled = enabled;
-}
+#if defined(__SANITIZE_THREAD__)
+#define MOD_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define MOD_TSAN 1
+#endif
+#endif
+#ifndef MOD_TSAN
+#define MOD_TSAN 0
+#endif
 
-void wave_advance(Modulator *m, uint64_t dt) {
-	m->wave.time += dt;
-	//TODO: m->wave.value = ?? (self.wave)(self, ModulatorEnv::<f32>::micros_to_secs(self.time));
+//The seqlock_ functions read and write the data a seqlock guards: relaxed, between the fences
+#if defined(_MSC_VER)
+static inline int64_t atomic_load_i64(volatile int64_t *p) { return InterlockedCompareExchange64((volatile LONG64 *)p, 0, 0); }
+static inline void atomic_store_i64(volatile int64_t *p, int64_t v) { InterlockedExchange64((volatile LONG64 *)p, v); }
+static inline bool atomic_cas_i64(volatile int64_t *p, int64_t expected, int64_t desired) {
+	return InterlockedCompareExchange64((volatile LONG64 *)p, desired, expected) == expected;
 }
+static inline void atomic_add_u64(volatile uint64_t *p, uint64_t v) { InterlockedExchangeAdd64((volatile LONG64 *)p, (LONG64)v); }
+static inline void seqlock_fence_acquire(void) { MemoryBarrier(); }
+static inline void seqlock_fence_release(void) { MemoryBarrier(); }
+static inline float seqlock_load_f32(const volatile float *p) { return *p; }
+static inline void seqlock_store_f32(volatile float *p, float v) { *p = v; }
+#else
+static inline int64_t atomic_load_i64(volatile int64_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomic_store_i64(volatile int64_t *p, int64_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline bool atomic_cas_i64(volatile int64_t *p, int64_t expected, int64_t desired) {
+	return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+static inline void atomic_add_u64(volatile uint64_t *p, uint64_t v) { __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+#if MOD_TSAN
+//ThreadSanitizer does not model fences (and warns about them), so under it the data of a seqlock is
+//itself stored with release and loaded with acquire, which orders it the same way and which it does model
+static inline void seqlock_fence_acquire(void) {}
+static inline void seqlock_fence_release(void) {}
+static inline float seqlock_load_f32(const volatile float *p) { float v; __atomic_load(p, &v, __ATOMIC_ACQUIRE); return v; }
+static inline void seqlock_store_f32(volatile float *p, float v) { __atomic_store(p, &v, __ATOMIC_RELEASE); }
+#else
+static inline void seqlock_fence_acquire(void) { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+static inline void seqlock_fence_release(void) { __atomic_thread_fence(__ATOMIC_RELEASE); }
+static inline float seqlock_load_f32(const volatile float *p) { float v; __atomic_load(p, &v, __ATOMIC_RELAXED); return v; }
+static inline void seqlock_store_f32(volatile float *p, float v) { __atomic_store(p, &v, __ATOMIC_RELAXED); }
+#endif
+#endif
 
-//--ScalarSpring
-
+//--cycle counter
 
-//Update the target the spring is moving to
-void spring_to(Modulator *m, float goal) {
-	assert(m->type == SCALARSPRING);
-	m->scalar_spring.value = goal;
+//Time stamp counter, nanoseconds where there is none
+static inline uint64_t read_cycles(void) {
+#if MOD_X86
+	return __rdtsc();
+#elif defined(_WIN32)
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)counter.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
 }
 
-//Jump immediately to the given goal, zero velocity
-void jump_to(Modulator *m, float goal) {
-	assert(m->type == SCALARSPRING);
-	m->scalar_spring.goal = goal;
-	m->scalar_spring.value = goal;
-	m->scalar_spring.vel = 0.0;
+//Index of the highest set bit plus one, 0 for 0
+static inline int bit_length(uint64_t x) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	return _BitScanReverse64(&index, x) ? (int)index + 1 : 0;
+#else
+	return x ? 64 - __builtin_clzll(x) : 0;
+#endif
 }
 
-float scalar_spring_val(Modulator *m) {
-	return m->scalar_spring.value;
-}
-ValueRange scalar_spring_range(Modulator *m) {
-	ValueRange r = {0.0, 0.0};
-	return r;
+//Highest instruction set the cpu (and os) we are running on supports
+SimdLevel detect_simd_level(void) {
+#if MOD_X86 && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	if (!(info[3] & (1 << 26))) {
+		return SIMD_SCALAR;
+	}
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) {
+			return SIMD_AVX2;
+		}
+	}
+	return SIMD_SSE2;
+#elif MOD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return SIMD_AVX2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return SIMD_SSE2;
+	}
+	return SIMD_SCALAR;
+#else
+	return SIMD_SCALAR;
+#endif
 }
 
-float scalar_spring_goal(Modulator *m) {
-	return m->scalar_spring.goal;
-}
+//
+//Arena
+//
+//Bump allocator owning the pool arrays and side buffers (regions, buckets) of a set of pools.
+//The whole arena is released at once and its blocks are kept in a cache for the next arena.
+//Side buffers of removed modulators are the only individual allocations given back: they go on a
+//free list per power of two size class and the next side buffer of that size reuses them.
+//
 
-void scalar_spring_set_goal(Modulator *m, float f) {
-	spring_to(m, f);
-}
+#define MOD_ARENA_ALIGNMENT 16
+#define MOD_ARENA_BLOCK_SIZE (64 * 1024)
+#define MOD_ARENA_CLASSES 64
 
-uint64_t scalar_spring_elapsed_us(Modulator *m) {
-	return m->scalar_spring.time;
-}
+typedef struct ModArenaBlock {
+	struct ModArenaBlock *next;
+	size_t size;
+}ModArenaBlock;
 
-bool scalar_spring_enabled(Modulator *m) {
-	return m->scalar_spring.enabled;
-}
+typedef struct ModArena {
+	char *ptr;
+	char *end;
+	ModArenaBlock *blocks;
+	void *free_buffers[MOD_ARENA_CLASSES]; //released allocations of 2^class bytes, linked through their first word
+}ModArena;
 
-void scalar_spring_set_enabled(Modulator *m, bool enabled) {
-	m->scalar_spring.enabled = enabled;
-}
+ModArenaBlock *arena_block_cache;
 
-void scalar_spring_advance(Modulator *m, uint64_t dt) {
-	m->scalar_spring.time += dt;
-	if (m->scalar_spring.smooth < 0.0001) {
-		m->scalar_spring.value = m->scalar_spring.goal;
-		m->scalar_spring.vel = 0.0;
+#define MOD_ARENA_HEADER_SIZE ((sizeof(ModArenaBlock) + MOD_ARENA_ALIGNMENT - 1) & ~(size_t)(MOD_ARENA_ALIGNMENT - 1))
+
+void mod_arena_grow(ModArena *arena, size_t min_size) {
+	ModArenaBlock *block;
+	if (min_size <= MOD_ARENA_BLOCK_SIZE && arena_block_cache) {
+		block = arena_block_cache;
+		arena_block_cache = block->next;
 	}
 	else {
-		float _dt = micros_to_secs(dt);
-		float omega = 2.0 / m->scalar_spring.smooth;
-		float x = omega * _dt;
-		float ex = 1.0 / expf(x);
-		float ud = _dt * m->scalar_spring.undamp;
-
-		float d = m->scalar_spring.value - m->scalar_spring.goal;
-		float v = m->scalar_spring.vel;
-		float t = (v + omega * d) * _dt;
-
-		m->scalar_spring.vel = (v - omega * t) * ex + v * ud;
-		m->scalar_spring.value = m->scalar_spring.goal + (d + t) * ex;
+		size_t size = MAX(MOD_ARENA_BLOCK_SIZE, min_size);
+		block = xmalloc(MOD_ARENA_HEADER_SIZE + size);
+		block->size = size;
 	}
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->ptr = (char *)block + MOD_ARENA_HEADER_SIZE;
+	arena->end = arena->ptr + block->size;
 }
 
-//--ScalarGoalFollower
-
-void set_new_goal(Modulator *m) {
-	assert(m->type == SCALARGOALFOLLOWER);
-	size_t n = buf_len(m->scalar_goal_follower.regions);
-	if (n > 0) {
-		if (m->scalar_goal_follower.random_region) {
-			m->scalar_goal_follower.current_region = RNDRNG(0, n);
-		}
-		else if (m->scalar_goal_follower.current_region + 1 < n) {
-			m->scalar_goal_follower.current_region += 1;
-		}
-		else {
-			m->scalar_goal_follower.current_region = 0;
-		}
+void *mod_arena_alloc(ModArena *arena, size_t size) {
+	size = (size + MOD_ARENA_ALIGNMENT - 1) & ~(size_t)(MOD_ARENA_ALIGNMENT - 1);
+	if (size > (size_t)(arena->end - arena->ptr)) {
+		mod_arena_grow(arena, size);
+	}
+	void *ptr = arena->ptr;
+	arena->ptr += size;
+	return ptr;
+}
 
-		ValueRange *region = &m->scalar_goal_follower.regions[m->scalar_goal_follower.current_region];
-		float goal = 0.0;
-		if (region->max > region->min) {
-			goal = RNDRNG(region->min, region->max);
+//Release everything allocated from the arena; standard sized blocks go back to the cache
+void mod_arena_free(ModArena *arena) {
+	ModArenaBlock *block = arena->blocks;
+	while (block) {
+		ModArenaBlock *next = block->next;
+		if (block->size == MOD_ARENA_BLOCK_SIZE) {
+			block->next = arena_block_cache;
+			arena_block_cache = block;
 		}
 		else {
-			goal = region->min;
+			free(block);
 		}
-		set_goal(m->scalar_goal_follower.follower, goal);
+		block = next;
 	}
+	arena->ptr = NULL;
+	arena->end = NULL;
+	arena->blocks = NULL;
+	memset(arena->free_buffers, 0, sizeof(arena->free_buffers));
 }
 
-
-
-float scalar_goal_follower_val(Modulator *m) {
-	if (m->scalar_goal_follower.follower) {
-		return value(m->scalar_goal_follower.follower);
-	}
-	else return 0.0;
-	
+static inline int mod_arena_class(size_t size) {
+	return bit_length(MAX(size, (size_t)MOD_ARENA_ALIGNMENT) - 1);
 }
 
-ValueRange scalar_goal_follower_range(Modulator *m) {
-	size_t n = buf_len(m->scalar_goal_follower.regions);
-	ValueRange r = { 0.0, 0.0 };
-	if (n > 0) {
-		r = m->scalar_goal_follower.regions[0];
-	}
-
-	for (ValueRange *it = &m->scalar_goal_follower.regions[1]; it != buf_end(m->scalar_goal_follower.regions); it++) {
-		if (it->min < r.min) {
-			r.min = it->min;
-		}
-		if (it->max > r.max) {
-			r.max = it->max;
-		}
+//size rounded up to a power of two, taken from the free list of that size if it has one
+void *mod_arena_alloc_class(ModArena *arena, size_t size) {
+	int c = mod_arena_class(size);
+	void *ptr = arena->free_buffers[c];
+	if (ptr) {
+		arena->free_buffers[c] = *(void **)ptr;
+		return ptr;
 	}
-	return r;
+	return mod_arena_alloc(arena, (size_t)1 << c);
 }
 
-float scalar_goal_follower_goal(Modulator *m) {
-	return goal(m->scalar_goal_follower.follower);
+//Give back ptr, allocated by mod_arena_alloc_class with the same size
+void mod_arena_release(ModArena *arena, void *ptr, size_t size) {
+	if (ptr) {
+		int c = mod_arena_class(size);
+		*(void **)ptr = arena->free_buffers[c];
+		arena->free_buffers[c] = ptr;
+	}
 }
 
-void scalar_goal_follower_set_goal(Modulator *m, float goal) {
-	set_goal(m->scalar_goal_follower.follower, goal);
-}
+//
+//Name interning
+//
+//Every environment and modulator name is interned: equal names share one pointer, so the
+//pointer keyed maps can be used with names coming from anywhere (not just string literals).
+//Interned strings live until the program ends. Only needed at setup, never while stepping.
+//
 
-uint64_t scalar_goal_follower_elapsed_us(Modulator *m) {
-	return m->scalar_goal_follower.time;
-}
+typedef struct NameTable {
+	const char **names;
+	uint64_t *hashes;
+	size_t len;
+	size_t cap;
+	ModArena arena;
+}NameTable;
 
-bool scalar_goal_follower_enabled(Modulator *m) {
-	return m->scalar_goal_follower.enabled;
-}
+NameTable name_table;
 
-void scalar_goal_follower_set_enabled(Modulator *m, bool enabled) {
-	m->scalar_goal_follower.enabled = enabled;
+uint64_t name_hash(const char *str, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
 }
 
-void scalar_goal_follower_advance(Modulator *m, uint64_t dt) {
-	m->scalar_goal_follower.time += dt;
-
-	if (m->scalar_goal_follower.paused_left > 0) {
-		m->scalar_goal_follower.paused_left -= (uint64_t)MIN((m->scalar_goal_follower.paused_left), dt);
-	}
-	else {
-		float p0 = value(m->scalar_goal_follower.follower);
-		advance(m->scalar_goal_follower.follower, dt);
-		float p1 = value(m->scalar_goal_follower.follower);
-		float secs = micros_to_secs(dt);
-		float vel = 0.0;
-		if (secs > FLT_MIN) {
-			vel = (p1 - p0) / secs;
-		}
-		else {
-			vel = 0.0;
+void name_table_grow(NameTable *table) {
+	NameTable old = *table;
+	table->cap = old.cap ? 2 * old.cap : 64;
+	table->names = xcalloc(table->cap, sizeof(const char *));
+	table->hashes = xcalloc(table->cap, sizeof(uint64_t));
+	for (size_t i = 0; i < old.cap; i++) {
+		if (old.names[i]) {
+			size_t j = old.hashes[i] & (table->cap - 1);
+			while (table->names[j]) {
+				j = (j + 1) & (table->cap - 1);
+			}
+			table->names[j] = old.names[i];
+			table->hashes[j] = old.hashes[i];
 		}
+	}
+	free((void *)old.names);
+	free(old.hashes);
+}
 
-		if (p1 - fabs(goal(m->scalar_goal_follower.follower)) > m->scalar_goal_follower.threshold || fabs(vel) > m->scalar_goal_follower.vel_threshold) {
-			return; //Still moving towards goal
-		}
-		if (m->scalar_goal_follower.pause_range.max > m->scalar_goal_follower.pause_range.min) {
-			m->scalar_goal_follower.paused_left = RNDRNG(m->scalar_goal_follower.pause_range.min, m->scalar_goal_follower.pause_range.max);
-		}
-		else {
-			m->scalar_goal_follower.paused_left = m->scalar_goal_follower.pause_range.min;
+//Slot of name in the table, or the empty slot it would go in
+size_t name_slot(const char *name, size_t len, uint64_t hash) {
+	size_t i = hash & (name_table.cap - 1);
+	while (name_table.names[i]) {
+		if (name_table.hashes[i] == hash && memcmp(name_table.names[i], name, len) == 0 && name_table.names[i][len] == 0) {
+			break;
 		}
+		i = (i + 1) & (name_table.cap - 1);
 	}
+	return i;
+}
 
-	if (m->scalar_goal_follower.paused_left == 0) {
-		set_new_goal(m); //done pausing, resume following
+//The interned copy of name, NULL if it was never interned
+const char *find_name(const char *name) {
+	if (!name_table.cap) {
+		return NULL;
 	}
+	size_t len = strlen(name);
+	return name_table.names[name_slot(name, len, name_hash(name, len))];
 }
 
-//--Newtonian
-
-void reset(Modulator *m, float value) {
-	assert(m->type == NEWTONIAN);
-	m->newtonian.value = value;
-	m->newtonian.goal = value;
-	m->newtonian.s = 0.0;
-	m->newtonian.a = 0.0;
-	m->newtonian.d = 0.0;
-	m->newtonian.f = value;
-	m->newtonian.phase = (PhaseTime) { 0.0, 0.0, 0.0 };
+//Intern the first len characters of name, which need not be terminated
+const char *intern_name_n(const char *name, size_t len) {
+	if (2 * name_table.len >= name_table.cap) {
+		name_table_grow(&name_table);
+	}
+	uint64_t hash = name_hash(name, len);
+	size_t i = name_slot(name, len, hash);
+	if (name_table.names[i]) {
+		return name_table.names[i];
+	}
+	char *str = mod_arena_alloc(&name_table.arena, len + 1);
+	memcpy(str, name, len);
+	str[len] = 0;
+	name_table.names[i] = str;
+	name_table.hashes[i] = hash;
+	name_table.len++;
+	return str;
 }
 
-float gen_value(ValueRange range) {
-	return RNDRNG(range.min, range.max);
+const char *intern_name(const char *name) {
+	return intern_name_n(name, strlen(name));
 }
 
-void calculate_events(Modulator *m) {
-	assert(m->type == NEWTONIAN);
-	float x = abs(m->newtonian.goal - m->newtonian.f);
-
-	float a = 0.0;
-	if (m->newtonian.a < FLT_EPSILON) {
-		a = m->newtonian.a;
-	}
-	else {
-		a = 1000000.0;
-	}
-	float d = 0.0;
-	if (m->newtonian.d > FLT_EPSILON) {
-		d = m->newtonian.d;
-	}
-	else {
-		d = 1000000.0;
-	}
-	float r = a / d;
+#define MODULATOR_TYPE_COUNT (SHIFTREGISTER + 1)
 
-	m->newtonian.phase.acceleration = sqrtf((x * 2.0 / (a * (1.0 + r))));
+//Every type with the prefix of its functions and the name of its pool in ModulatorPools
+#define MODULATOR_TYPES(X, ...) \
+	X(WAVE, wave, wave, __VA_ARGS__) \
+	X(SCALARSPRING, scalar_spring, scalar_spring, __VA_ARGS__) \
+	X(SCALARGOALFOLLOWER, scalar_goal_follower, scalar_goal_follower, __VA_ARGS__) \
+	X(NEWTONIAN, newtonian, newtonian, __VA_ARGS__) \
+	X(SHIFTREGISTER, shiftregister, shift_register, __VA_ARGS__)
 
-	float v = a * m->newtonian.phase.acceleration;
-	if (v > m->newtonian.s) {
-		v = m->newtonian.s;
-		m->newtonian.phase.acceleration = m->newtonian.s / a;
-	}
-	else {
-		m->newtonian.s = v;
-	}
+//Named after their constructors
+const char *modulator_type_names[MODULATOR_TYPE_COUNT] = { "wave", "scalar_spring", "scalar_goal_follower", "newtonian", "shift_register" };
 
-	m->newtonian.phase.deceleration = m->newtonian.phase.acceleration * r;
+//
+//Random numbers
+//
+//Every modulator that draws random numbers owns a small PCG32 generator (one 64 bit word),
+//so results are reproducible and modulators can be stepped on different threads without sharing state.
+//Unless set_seed is used, generators are seeded from default_seed in the order the modulators are created.
+//
 
-	float d0 = m->newtonian.phase.acceleration *  m->newtonian.phase.acceleration * a * 0.5;
-	float d2 = m->newtonian.phase.deceleration *  m->newtonian.phase.deceleration * d * 0.5;
+typedef struct ModRng {
+	uint64_t state;
+}ModRng;
 
-	m->newtonian.phase.sustain = (x - d0 - d2) / v;
+#define MOD_RNG_MULTIPLIER 6364136223846793005ull
+#define MOD_RNG_INCREMENT 1442695040888963407ull
 
-	if (m->newtonian.goal > m->newtonian.f) {
-		m->newtonian.a = a;
-		m->newtonian.d = -d;
-	}
-	else {
-		m->newtonian.s = -m->newtonian.s;
-		m->newtonian.a = -a;
-		m->newtonian.d = d;
-	}
+uint64_t default_seed = 0x853c49e6748fea9bull;
+uint64_t seeded_count;
 
-	m->newtonian.phase.sustain = m->newtonian.phase.acceleration + m->newtonian.phase.sustain;
-	m->newtonian.phase.deceleration = m->newtonian.phase.sustain + m->newtonian.phase.deceleration;
+static inline uint32_t rng_next(ModRng *rng) {
+	uint64_t old = rng->state;
+	rng->state = old * MOD_RNG_MULTIPLIER + MOD_RNG_INCREMENT;
+	uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+	uint32_t rot = (uint32_t)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
 }
 
-void move_to(Modulator *m, float goal) {
-	if (m->type == NEWTONIAN) {
-		m->newtonian.time = 0;
-		m->newtonian.goal = goal;
+//Uniform in [0, 1), unlike RND() it never returns 1
+static inline float rng_float(ModRng *rng) {
+	return (float)(rng_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
 
-		m->newtonian.s = gen_value(m->newtonian.speed_limit_range);
-		m->newtonian.a = gen_value(m->newtonian.acceleration_range);
-		m->newtonian.d = gen_value(m->newtonian.deceleration_range);
-		m->newtonian.f = m->newtonian.value;
+static inline float rng_range(ModRng *rng, ValueRange range) {
+	return range.min + rng_float(rng) * (range.max - range.min);
+}
 
-		calculate_events(m);
+//Fill out with n values uniform in range
+void rng_fill(ModRng *rng, float *out, size_t n, ValueRange range) {
+	uint64_t state = rng->state;
+	float scale = (range.max - range.min) * (1.0f / 16777216.0f);
+	for (size_t i = 0; i < n; i++) {
+		uint64_t old = state;
+		state = old * MOD_RNG_MULTIPLIER + MOD_RNG_INCREMENT;
+		uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rot = (uint32_t)(old >> 59);
+		uint32_t x = (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+		out[i] = range.min + (float)(x >> 8) * scale;
 	}
+	rng->state = state;
 }
 
-float accelerate(float a, float t) {
-	return a * t *t *0.5;
+ModRng rng_seeded(uint64_t seed) {
+	ModRng rng = { 0 };
+	rng_next(&rng);
+	rng.state += seed;
+	rng_next(&rng);
+	return rng;
 }
 
-float forward(float s, float t) {
-	return s * t;
+//Generator for the next modulator that is created without an explicit seed
+ModRng rng_default(void) {
+	uint64_t z = default_seed + 0x9e3779b97f4a7c15ull * ++seeded_count;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return rng_seeded(z ^ (z >> 31));
 }
 
-float newtonian_val(Modulator *m) {
-	return m->newtonian.value;
-}
-ValueRange newtonian_range(Modulator *m) {
-	ValueRange r = { 0.0, 0.0 };
-	return r;
+//Seed the generators of the modulators created from now on
+void set_default_seed(uint64_t seed) {
+	default_seed = seed;
+	seeded_count = 0;
 }
 
-float newtonian_goal(Modulator *m) {
-	return m->newtonian.goal;
+//
+//Time
+//
+//Modulators keep time as integer microseconds (uint64_t, enough for half a million years) and only
+//turn short spans into float seconds: a step's dt or the time since a newtonian started its move.
+//A ModTimeBase turns the ticks of the caller's clock into those microsecond steps without drift.
+//Rounding every 1/60 s frame to 16667 us runs 12 seconds ahead after a week, the time base hands
+//out 16666 or 16667 such that the sum is always the exact elapsed time rounded down.
+//
+
+//ticks * 1000000 / rate rounded down, without overflowing for rates up to 1.8e13
+static inline uint64_t ticks_to_us(uint64_t ticks, uint64_t rate) {
+	return ticks / rate * 1000000u + ticks % rate * 1000000u / rate;
 }
 
-void newtonian_set_goal(Modulator *m, float goal) {
-	move_to(m, goal);
+//Seconds as a double, exact to the microsecond for the next 285 years
+static inline double us_to_secs(uint64_t us) {
+	return (double)us * 1e-6;
 }
 
-uint64_t newtonian_elapsed_us(Modulator *m) {
-	return m->newtonian.time;
+ModTimeBase time_base(uint64_t ticks_per_second) {
+	assert(ticks_per_second > 0);
+	return (ModTimeBase){ ticks_per_second, 0, 0 };
 }
 
-bool newtonian_enabled(Modulator *m) {
-	return m->newtonian.enabled;
+//The dt in microseconds to advance by for the next ticks ticks
+uint64_t time_base_step(ModTimeBase *tb, uint64_t ticks) {
+	tb->ticks += ticks;
+	uint64_t us = ticks_to_us(tb->ticks, tb->rate);
+	uint64_t dt = us - tb->us;
+	tb->us = us;
+	return dt;
 }
 
-void newtonian_set_enabled(Modulator *m, bool enabled) {
-	m->newtonian.enabled = enabled;
+//The dt in microseconds to advance by when the caller's clock reads now ticks (it never goes back)
+uint64_t time_base_step_to(ModTimeBase *tb, uint64_t now) {
+	return time_base_step(tb, now > tb->ticks ? now - tb->ticks : 0);
 }
 
-void newtonian_advance(Modulator *m, uint64_t dt) {
-	
-	m->newtonian.time += dt;
-	float t = micros_to_secs(m->newtonian.time); //time to goal
-	float a = m->newtonian.phase.acceleration;
-	float d = m->newtonian.phase.deceleration;
-	float s = m->newtonian.phase.sustain;
+//
+//Modulator pools
+//
+//The state of every modulator lives in a structure-of-arrays pool for its type.
+//A Modulator is a handle into such a pool (pools + slot); all modulators of one
+//environment share the same pools so they can be advanced type by type in tight loops.
+//The pool arrays and the side buffers of the modulators are allocated from the arena of their pools.
+//
 
-	m->newtonian.value = m->newtonian.f + accelerate(m->newtonian.a, MIN(t, a));
-	if (t > a) {
-		m->newtonian.value = m->newtonian.value + forward(m->newtonian.s, MIN(t, d) - a);
-		if (t > s) {
-			m->newtonian.value = m->newtonian.value + accelerate(m->newtonian.d, MIN(t, d) - s);
-		}
-	}
-}
+//fields shared by every pool: the owning handle, whether another modulator advances this one
+//and the clock of the pools at the time the entry fell asleep
+#define POOL_COMMON_FIELDS(X) \
+	X(Modulator *, mods) \
+	X(bool, owned) \
+	X(uint64_t, slept_at)
 
-//--ShiftRegister
+#define WAVE_FIELDS(X) \
+	POOL_COMMON_FIELDS(X) \
+	X(float, amplitude) \
+	X(float, frequency) \
+	X(double, phase_offset) \
+	X(WaveShape, shape) \
+	X(float *, table) \
+	X(size_t, table_len) \
+	X(uint64_t, time) \
+	X(float, value) \
+	X(bool, enabled) \
+	X(bool, lazy) \
+	X(bool, valid)
 
-void new_buckets(float *buffer, size_t buckets, ValueRange value_range) {
-	for (int current_bucket = 0; current_bucket < buckets; current_bucket++) {
-		float x = RNDRNG(value_range.min, value_range.max);
-		buf_push(buffer, x);
-	}
-}
+#define SCALAR_SPRING_FIELDS(X) \
+	POOL_COMMON_FIELDS(X) \
+	X(float, smooth) \
+	X(float, undamp) \
+	X(float, goal) \
+	X(float, value) \
+	X(float, vel) \
+	X(uint64_t, time) \
+	X(bool, enabled)
 
-// Total time of a shift register loop (period) in microseconds
-uint64_t total_period(Modulator *m) {
-	assert(m->type == SHIFTREGISTER);
-	return (uint64_t)(m->shift_register.period * 1000000.0);
-}
+#define SCALAR_GOAL_FOLLOWER_FIELDS(X) \
+	POOL_COMMON_FIELDS(X) \
+	X(ValueRange *, regions) \
+	X(size_t, region_count) \
+	X(bool, random_region) \
+	X(float, threshold) \
+	X(float, vel_threshold) \
+	X(ValueRange, pause_range) \
+	X(Modulator *, follower) \
+	X(size_t, current_region) \
+	X(uint64_t, paused_left) \
+	X(uint64_t, time) \
+	X(bool, enabled) \
+	X(ModRng, rng)
 
-// Time spent visiting a bucket, in microseconds
-uint64_t bucket_period(Modulator *m) {
-	assert(m->type == SHIFTREGISTER);
-	size_t n = buf_len(m->shift_register.buckets);
-	if (n > 0) {
-		return (uint64_t)(total_period(m) / n);
-	}
-	else return 0;
-}
+//The move is compiled into three segments, accelerating from rest at from, cruising at speed from
+//cruise_from and decelerating from decel_from, each a quadratic in the seconds since the segment began.
+//half_accel, speed and half_decel carry the direction; accel_end and cruise_end are seconds since move_to,
+//move_end is whole microseconds since move_to so that stepping and settling compare integers.
+#define NEWTONIAN_FIELDS(X) \
+	POOL_COMMON_FIELDS(X) \
+	X(ValueRange, speed_limit_range) \
+	X(ValueRange, acceleration_range) \
+	X(ValueRange, deceleration_range) \
+	X(float, goal) \
+	X(float, value) \
+	X(uint64_t, time) \
+	X(bool, enabled) \
+	X(float, from) \
+	X(float, cruise_from) \
+	X(float, decel_from) \
+	X(float, half_accel) \
+	X(float, speed) \
+	X(float, half_decel) \
+	X(float, accel_end) \
+	X(float, cruise_end) \
+	X(uint64_t, move_end) \
+	X(bool, lazy) \
+	X(bool, valid) \
+	X(ModRng, rng)
 
-// Return the bucket index after the one we are given
-size_t next_bucket(Modulator *m, size_t index) {
-	assert(m->type == SHIFTREGISTER);
-	size_t len = buf_len(m->shift_register.buckets);
-	if (len > 0) {
-		if (index < len - 1) {
-			return index + 1;
-		}
-	}
-}
+#define SHIFT_REGISTER_FIELDS(X) \
+	POOL_COMMON_FIELDS(X) \
+	X(float *, buckets) \
+	X(uint32_t *, value_ages) \
+	X(size_t, bucket_count) \
+	X(ValueRange, value_range) \
+	X(float, odds) \
+	X(ValueRange, age_range) \
+	X(float, period) \
+	X(ShiftRegisterInterp, interp) \
+	X(uint64_t, time) \
+	X(uint64_t, loop_offset) \
+	X(float, value) \
+	X(bool, enabled) \
+	X(ModRng, rng)
 
-// Return the bucket index before the one we are given
-size_t previous_bucket(Modulator *m, size_t index, size_t n) {
-	assert(m->type == SHIFTREGISTER);
-	assert(n > 0);
-	if (index > 0 && index < n) {
-		return index - 1;
-	}
-	else return n - 1;
-}
+#define POOL_ARRAY(type, name) type *name;
 
+typedef struct WavePool {
+	size_t len;
+	size_t cap;
+	size_t active; //entries [0, active) are awake, [active, len) asleep
+	WAVE_FIELDS(POOL_ARRAY)
+}WavePool;
 
-float shiftregister_val(Modulator *m) {
-	return m->shift_register.value;
-}
-ValueRange shiftregister_range(Modulator *m) {
-	return m->shift_register.value_range;
-}
+typedef struct ScalarSpringPool {
+	size_t len;
+	size_t cap;
+	size_t active; //entries [0, active) are awake, [active, len) asleep
+	SCALAR_SPRING_FIELDS(POOL_ARRAY)
+}ScalarSpringPool;
 
-float shiftregister_goal(Modulator *m) {
-	return m->shift_register.value;
-}
+typedef struct ScalarGoalFollowerPool {
+	size_t len;
+	size_t cap;
+	size_t active; //entries [0, active) are awake, [active, len) asleep
+	SCALAR_GOAL_FOLLOWER_FIELDS(POOL_ARRAY)
+}ScalarGoalFollowerPool;
 
-void shiftregister_set_goal(Modulator *m, float f) {
-}
+typedef struct NewtonianPool {
+	size_t len;
+	size_t cap;
+	size_t active; //entries [0, active) are awake, [active, len) asleep
+	NEWTONIAN_FIELDS(POOL_ARRAY)
+}NewtonianPool;
 
-uint64_t shiftregister_elapsed_us(Modulator *m) {
-	return m->shift_register.time;
-}
+typedef struct ShiftRegisterPool {
+	size_t len;
+	size_t cap;
+	size_t active; //entries [0, active) are awake, [active, len) asleep
+	SHIFT_REGISTER_FIELDS(POOL_ARRAY)
+}ShiftRegisterPool;
 
-bool shiftregister_enabled(Modulator *m) {
-	return m->shift_register.enabled;
-}
+//A sleeping modulator that wakes up by itself once the clock of its pools reaches wake_at
+typedef struct SleepTimer {
+	uint64_t wake_at;
+	Modulator *m;
+}SleepTimer;
 
-void shiftregister_set_enabled(Modulator *m, bool enabled) {
-	m->shift_register.enabled = enabled;
-}
+//target's param = value(source) * scale + offset, after every step
+typedef struct ModRoute {
+	Modulator *source;
+	Modulator *target;
+	ModParam param;
+	float scale;
+	float offset;
+}ModRoute;
 
-void shiftregister_advance(Modulator *m, uint64_t dt) {
-	size_t n = buf_len(m->shift_register.buckets);
-	uint64_t p = total_period(m);
-	uint64_t bp = bucket_period(m);
-	if (n == 0 || p == 0 || bp == 0) {
-		return;
-	}
-	
-	uint64_t pt = m->shift_register.time % p; //convert accumulated time into period time
-	size_t bi = (size_t)(MIN((size_t)(pt / bp), n - 1)); //current bucket in period
+//
+//Instrumentation
+//
+//Built with MODULATORS_STATS=1 the dispatch functions and the pool loops count calls and cycles
+//(read_cycles) per ModulatorType and operation, both in total and per environment, with a histogram
+//of the cycles per call in power of two buckets. Cycles are inclusive: a goal follower's advance
+//contains the advance of its follower, which is not counted separately.
+//Without it the STATS_ macros are empty and nothing is recorded.
+//
 
-	uint64_t bt = pt - bp * bi; //time aready spent visiting the current bucket
-	uint64_t r = (bt + dt) / bp; //number of buckets we are going to visit
+#ifndef MODULATORS_STATS
+#define MODULATORS_STATS 0
+#endif
 
-	for (int i = 0; i < r; i++) {
-		size_t bh = previous_bucket(m, bi, n);
-		float odds = (float)(MIN(MAX(0.0, m->shift_register.odds), 1.0));
+typedef enum StatsOp {
+	STATS_VALUE,
+	STATS_RANGE,
+	STATS_GOAL,
+	STATS_SET_GOAL,
+	STATS_ELAPSED_US,
+	STATS_ENABLED,
+	STATS_SET_ENABLED,
+	STATS_ADVANCE,
+	STATS_POOL_ADVANCE, //a bulk loop over part of a pool, items is the number of entries it went over
+	STATS_OP_COUNT
+}StatsOp;
 
-		if (m->shift_register.value_ages[bh] >= m->shift_register.age_range.min && m->shift_register.age_range.min < m->shift_register.age_range.max) {
-			float t = MIN((float)(m->shift_register.value_ages[bh] - m->shift_register.age_range.min) / (m->shift_register.age_range.max - m->shift_register.age_range.min),  1.0);
-			odds = odds + (1.0 - odds) * t;
+const char *stats_op_names[STATS_OP_COUNT] = { "value", "range", "goal", "set_goal", "elapsed_us", "enabled", "set_enabled", "advance", "pool_advance" };
+
+//Bucket b counts the calls that took [2^(b-1), 2^b) cycles, the last one everything above
+#define STATS_BUCKETS 32
+
+typedef struct ModStats {
+	uint64_t calls;
+	uint64_t items;
+	uint64_t cycles;
+	uint64_t histogram[STATS_BUCKETS];
+}ModStats;
+
+typedef struct ModulatorPools {
+	WavePool wave;
+	ScalarSpringPool scalar_spring;
+	ScalarGoalFollowerPool scalar_goal_follower;
+	NewtonianPool newtonian;
+	ShiftRegisterPool shift_register;
+	ModArena arena;
+	Modulator **members; //all modulators in these pools in the order they joined, NULL where one left
+	size_t member_holes; //NULL entries in members, see unlink_modulator
+	uint64_t clock; //total time the pools have been advanced
+	SleepTimer *timers; //min-heap on wake_at
+	const float **render_sources; //scratch of render_environment_block_id, kept so rendering does not allocate
+	uint64_t layout; //changes whenever entries swap slots because they fall asleep or wake up
+	uint64_t membership; //changes whenever a modulator joins or leaves these pools
+	ModRoute *routes; //in the order they were connected
+	ModRoute *schedule; //routes in dependency order, compiled from routes when they change
+	bool routes_changed;
+	bool routes_cyclic; //the routes have a cycle, none of them are applied
+	struct CommandQueue *commands; //posted by other threads, NULL until create_command_queue
+	struct Publication *publication; //values for other threads, NULL until publish_values
+	struct Recorder *recorder; //NULL unless the environment is being recorded
+#if MODULATORS_STATS
+	ModStats stats[MODULATOR_TYPE_COUNT][STATS_OP_COUNT];
+#endif
+}ModulatorPools;
+
+#if MODULATORS_STATS
+ModStats type_stats[MODULATOR_TYPE_COUNT][STATS_OP_COUNT];
+
+//Threads step different pools at the same time, but share type_stats
+void stats_add(ModStats *stats, uint64_t items, uint64_t cycles) {
+	atomic_add_u64(&stats->calls, 1);
+	atomic_add_u64(&stats->items, items);
+	atomic_add_u64(&stats->cycles, cycles);
+	atomic_add_u64(&stats->histogram[MIN(bit_length(cycles), STATS_BUCKETS - 1)], 1);
+}
+
+void stats_record(ModulatorPools *pools, ModulatorType type, StatsOp op, uint64_t items, uint64_t cycles) {
+	stats_add(&type_stats[type][op], items, cycles);
+	stats_add(&pools->stats[type][op], items, cycles);
+}
+
+#define STATS_BEGIN() uint64_t stats_start = read_cycles()
+#define STATS_END(pools, type, op, items) stats_record(pools, type, op, items, read_cycles() - stats_start)
+#else
+#define STATS_BEGIN()
+#define STATS_END(pools, type, op, items)
+#endif
+
+//What a trace logs, see Recording and replay
+typedef enum TraceOp {
+	TRACE_SNAPSHOT,
+	TRACE_STEP,
+	TRACE_SET_GOAL,
+	TRACE_SET_ENABLED,
+	TRACE_JUMP_TO,
+	TRACE_RESET,
+	TRACE_ADVANCE,
+	TRACE_OP_COUNT
+}TraceOp;
+
+struct Recorder *record_call(Modulator *m, TraceOp op, float value, uint64_t dt);
+void record_step(ModulatorPools *pools, uint64_t dt);
+void record_end(struct Recorder *recorder);
+
+//Calls from outside on a modulator of an environment that is being recorded are logged,
+//the calls it makes in turn are not
+#define RECORD_BEGIN(m, op, value, dt) struct Recorder *recorder = (m)->pools->recorder ? record_call(m, op, value, dt) : NULL
+#define RECORD_END() if (recorder) record_end(recorder)
+#define RECORD_STEP_BEGIN(pools, dt) if ((pools)->recorder) record_step(pools, dt)
+#define RECORD_STEP_END(pools) if ((pools)->recorder) record_end((pools)->recorder)
+
+//Pools of the modulators that are not (yet) part of an environment
+ModulatorPools detached_pools;
+
+typedef struct ModulatorFunctions {
+	float(*value)(Modulator *);
+	ValueRange(*range)(Modulator *);
+	float(*goal)(Modulator *);
+	void(*set_goal)(Modulator *, float);
+	uint64_t(*elapsed_us)(Modulator *);
+	bool(*enabled)(Modulator *);
+	void(*set_enabled)(Modulator *, bool);
+	void(*advance)(Modulator *, uint64_t);
+} ModulatorFunctions;
+
+typedef struct Modulator {
+	const ModulatorFunctions * const modulator_functions;
+	const char *name;
+	ModId id;
+	ModulatorType type;
+	ModulatorPools *pools;
+	size_t slot;
+	uint32_t published; //index in the values its environment publishes
+	size_t member; //index in the members of its pools
+	Modulator *owner; //the goal follower it is the follower of, NULL if none
+	Modulator *next; //free list
+}Modulator;
+
+//Access a field of the pool entry a modulator refers to, eg. POOLED(m, scalar_spring, value)
+#define POOLED(m, pool, field) ((m)->pools->pool.field[(m)->slot])
+
+//
+//Pool management, generated for every pool from its field list
+//
+
+#define POOL_GROW(type, name) { \
+	type *grown = mod_arena_alloc(arena, new_cap * sizeof(type)); \
+	if (p->len > 0) { \
+		memcpy(grown, p->name, p->len * sizeof(type)); \
+	} \
+	p->name = grown; \
+}
+#define POOL_CLEAR(type, name) memset(&p->name[i], 0, sizeof(type));
+#define POOL_COPY(type, name) dst->name[j] = src->name[i];
+#define POOL_FILL_HOLE(type, name) p->name[i] = p->name[last];
+#define POOL_SWAP(type, name) { type tmp = p->name[i]; p->name[i] = p->name[j]; p->name[j] = tmp; }
+#define POOL_FREE(type, name) p->name = NULL;
+
+#define DEFINE_POOL(Pool, prefix, FIELDS) \
+void prefix##_pool_grow(Pool *p, ModArena *arena, size_t min_cap) { \
+	if (min_cap <= p->cap) { \
+		return; \
+	} \
+	size_t new_cap = MAX(16, MAX(2 * p->cap, min_cap)); \
+	FIELDS(POOL_GROW) \
+	p->cap = new_cap; \
+} \
+\
+/*exchange the entries in slots i and j*/ \
+void prefix##_pool_swap(Pool *p, size_t i, size_t j) { \
+	if (i != j) { \
+		FIELDS(POOL_SWAP) \
+		p->mods[i]->slot = i; \
+		p->mods[j]->slot = j; \
+	} \
+} \
+\
+/*add an awake, zeroed entry for m and return its slot*/ \
+size_t prefix##_pool_add(Pool *p, ModArena *arena, Modulator *m) { \
+	prefix##_pool_grow(p, arena, p->len + 1); \
+	size_t i = p->len++; \
+	FIELDS(POOL_CLEAR) \
+	p->mods[i] = m; \
+	prefix##_pool_swap(p, i, p->active); \
+	return p->active++; \
+} \
+\
+/*swap-remove slot i, keeping the awake entries in front*/ \
+void prefix##_pool_remove(Pool *p, size_t i) { \
+	assert(i < p->len); \
+	if (i < p->active) { \
+		prefix##_pool_swap(p, i, --p->active); \
+		i = p->active; \
+	} \
+	size_t last = --p->len; \
+	if (i != last) { \
+		FIELDS(POOL_FILL_HOLE) \
+		p->mods[i]->slot = i; \
+	} \
+} \
+\
+/*move slot i of src to the end of dst and return its new slot*/ \
+size_t prefix##_pool_move(Pool *dst, ModArena *arena, Pool *src, size_t i) { \
+	size_t j = prefix##_pool_add(dst, arena, src->mods[i]); \
+	FIELDS(POOL_COPY) \
+	prefix##_pool_remove(src, i); \
+	return j; \
+} \
+\
+/*put the awake entry i to sleep, returns its new slot*/ \
+size_t prefix##_pool_sleep(Pool *p, size_t i, uint64_t clock) { \
+	assert(i < p->active); \
+	p->slept_at[i] = clock; \
+	prefix##_pool_swap(p, i, --p->active); \
+	return p->active; \
+} \
+\
+/*wake the sleeping entry i; an enabled one gets the time it slept, which is returned*/ \
+uint64_t prefix##_pool_wake(Pool *p, size_t i, uint64_t clock) { \
+	assert(i >= p->active && i < p->len); \
+	uint64_t slept = p->enabled[i] ? clock - p->slept_at[i] : 0; \
+	p->time[i] += slept; \
+	prefix##_pool_swap(p, i, p->active++); \
+	return slept; \
+} \
+\
+/*forget the arrays, they are released with the arena they came from*/ \
+void prefix##_pool_free(Pool *p) { \
+	FIELDS(POOL_FREE) \
+	p->len = 0; \
+	p->cap = 0; \
+	p->active = 0; \
+}
+
+DEFINE_POOL(WavePool, wave, WAVE_FIELDS)
+DEFINE_POOL(ScalarSpringPool, scalar_spring, SCALAR_SPRING_FIELDS)
+DEFINE_POOL(ScalarGoalFollowerPool, scalar_goal_follower, SCALAR_GOAL_FOLLOWER_FIELDS)
+DEFINE_POOL(NewtonianPool, newtonian, NEWTONIAN_FIELDS)
+DEFINE_POOL(ShiftRegisterPool, shift_register, SHIFT_REGISTER_FIELDS)
+
+//Side buffers grow by doubling, their capacity follows from the number of elements
+static inline size_t side_buffer_cap(size_t n) {
+	size_t cap = 4;
+	while (cap < n) {
+		cap *= 2;
+	}
+	return cap;
+}
+
+void *alloc_side_buffer(ModArena *arena, size_t n, size_t elem_size) {
+	return mod_arena_alloc_class(arena, side_buffer_cap(n) * elem_size);
+}
+
+//Recycle a side buffer holding n elements; nothing to do for n == 0, those have no buffer
+void release_side_buffer(ModArena *arena, void *buffer, size_t n, size_t elem_size) {
+	if (n > 0) {
+		mod_arena_release(arena, buffer, side_buffer_cap(n) * elem_size);
+	}
+}
+
+void *copy_side_buffer(ModArena *arena, const void *buffer, size_t n, size_t elem_size) {
+	if (n == 0) {
+		return NULL;
+	}
+	void *copy = alloc_side_buffer(arena, n, elem_size);
+	memcpy(copy, buffer, n * elem_size);
+	return copy;
+}
+
+void link_modulator(ModulatorPools *pools, Modulator *m) {
+	m->member = buf_len(pools->members);
+	buf_push(pools->members, m);
+	pools->membership++;
+}
+
+static inline size_t member_count(const ModulatorPools *pools) {
+	return buf_len(pools->members) - pools->member_holes;
+}
+
+//Close the holes left in the members, the ones after a hole move up and keep their order
+void compact_members(ModulatorPools *pools) {
+	if (!pools->member_holes) {
+		return;
+	}
+	size_t n = 0;
+	for (size_t k = 0; k < buf_len(pools->members); k++) {
+		Modulator *m = pools->members[k];
+		if (m) {
+			m->member = n;
+			pools->members[n++] = m;
+		}
+	}
+	buf__hdr(pools->members)->len = n;
+	pools->member_holes = 0;
+}
+
+//m leaves a hole in the members so the ones after it keep their index; the holes are closed
+//once there are more of them than members, or when the members are read in order
+void unlink_modulator(ModulatorPools *pools, Modulator *m) {
+	Modulator **members = pools->members;
+	assert(m->member < buf_len(members) && members[m->member] == m);
+	members[m->member] = NULL;
+	pools->member_holes++;
+	while (buf_len(members) && !members[buf_len(members) - 1]) { //holes at the end go right away
+		buf__hdr(members)->len--;
+		pools->member_holes--;
+	}
+	if (pools->member_holes * 2 > buf_len(members)) {
+		compact_members(pools);
+	}
+	pools->membership++;
+}
+
+//Release the pool arrays and the arena of pools that no modulator is left in. The clock, the routes,
+//the command queue, the publication and the recorder of its environment stay.
+void pools_free_storage(ModulatorPools *pools) {
+	wave_pool_free(&pools->wave);
+	scalar_spring_pool_free(&pools->scalar_spring);
+	scalar_goal_follower_pool_free(&pools->scalar_goal_follower);
+	newtonian_pool_free(&pools->newtonian);
+	shift_register_pool_free(&pools->shift_register);
+	mod_arena_free(&pools->arena);
+	buf_free(pools->timers);
+	buf_free(pools->members);
+	buf_free(pools->render_sources);
+	pools->member_holes = 0;
+}
+
+//Release all arrays of pools at once; the modulators in it must have been taken care of
+void command_queue_free(struct CommandQueue *queue);
+void publication_free(struct Publication *publication);
+void recorder_free(struct Recorder *recorder);
+
+void pools_free(ModulatorPools *pools) {
+	pools_free_storage(pools);
+	buf_free(pools->routes);
+	buf_free(pools->schedule);
+	command_queue_free(pools->commands);
+	pools->commands = NULL;
+	publication_free(pools->publication);
+	pools->publication = NULL;
+	recorder_free(pools->recorder);
+	pools->recorder = NULL;
+	pools->routes_changed = false;
+	pools->routes_cyclic = false;
+	pools->clock = 0;
+}
+
+//Add m to the pool of its type in pools, m->slot is updated
+void pools_add(ModulatorPools *pools, Modulator *m) {
+	switch (m->type) {
+	case(WAVE): m->slot = wave_pool_add(&pools->wave, &pools->arena, m); break;
+	case(SCALARSPRING): m->slot = scalar_spring_pool_add(&pools->scalar_spring, &pools->arena, m); break;
+	case(SCALARGOALFOLLOWER): m->slot = scalar_goal_follower_pool_add(&pools->scalar_goal_follower, &pools->arena, m); break;
+	case(NEWTONIAN): m->slot = newtonian_pool_add(&pools->newtonian, &pools->arena, m); break;
+	case(SHIFTREGISTER): m->slot = shift_register_pool_add(&pools->shift_register, &pools->arena, m); break;
+	default: assert(0); break;
+	}
+	m->pools = pools;
+	link_modulator(pools, m);
+}
+
+//
+//Sleeping modulators
+//
+//Modulators whose state does not change (disabled ones, settled springs, newtonians at the end of their move)
+//or that only wait (paused goal followers) are put to sleep after a step: they move behind the awake entries
+//of their pool and the pool loops no longer visit them. Paused goal followers get a timer that wakes them
+//in the step their pause ends. Everything that changes a modulator from outside wakes it first,
+//a woken modulator gets the time it slept so elapsed_us() is the same as if it had been stepped.
+//Owned modulators never sleep, their owner advances them directly.
+//
+
+bool modulator_asleep(Modulator *m) {
+	ModulatorPools *pools = m->pools;
+	switch (m->type) {
+	case(WAVE): return m->slot >= pools->wave.active;
+	case(SCALARSPRING): return m->slot >= pools->scalar_spring.active;
+	case(SCALARGOALFOLLOWER): return m->slot >= pools->scalar_goal_follower.active;
+	case(NEWTONIAN): return m->slot >= pools->newtonian.active;
+	case(SHIFTREGISTER): return m->slot >= pools->shift_register.active;
+	default: assert(0); return false;
+	}
+}
+
+void wake_modulator(Modulator *m) {
+	if (!modulator_asleep(m)) {
+		return;
+	}
+	ModulatorPools *pools = m->pools;
+	switch (m->type) {
+	case(WAVE): wave_pool_wake(&pools->wave, m->slot, pools->clock); break;
+	case(SCALARSPRING): scalar_spring_pool_wake(&pools->scalar_spring, m->slot, pools->clock); break;
+	case(SCALARGOALFOLLOWER): {
+		uint64_t slept = scalar_goal_follower_pool_wake(&pools->scalar_goal_follower, m->slot, pools->clock);
+		uint64_t *paused_left = &POOLED(m, scalar_goal_follower, paused_left);
+		*paused_left -= MIN(*paused_left, slept);
+		break;
+	}
+	case(NEWTONIAN): newtonian_pool_wake(&pools->newtonian, m->slot, pools->clock); break;
+	case(SHIFTREGISTER): shift_register_pool_wake(&pools->shift_register, m->slot, pools->clock); break;
+	default: assert(0); break;
+	}
+	pools->layout++;
+}
+
+//Time m slept so far, not yet added to its elapsed time
+uint64_t slept_us(Modulator *m) {
+	if (!modulator_asleep(m)) {
+		return 0;
+	}
+	ModulatorPools *pools = m->pools;
+	switch (m->type) {
+	case(WAVE): return POOLED(m, wave, enabled) ? pools->clock - POOLED(m, wave, slept_at) : 0;
+	case(SCALARSPRING): return POOLED(m, scalar_spring, enabled) ? pools->clock - POOLED(m, scalar_spring, slept_at) : 0;
+	case(SCALARGOALFOLLOWER): return POOLED(m, scalar_goal_follower, enabled) ? pools->clock - POOLED(m, scalar_goal_follower, slept_at) : 0;
+	case(NEWTONIAN): return POOLED(m, newtonian, enabled) ? pools->clock - POOLED(m, newtonian, slept_at) : 0;
+	case(SHIFTREGISTER): return POOLED(m, shift_register, enabled) ? pools->clock - POOLED(m, shift_register, slept_at) : 0;
+	default: assert(0); return 0;
+	}
+}
+
+void push_timer(ModulatorPools *pools, uint64_t wake_at, Modulator *m) {
+	buf_push(pools->timers, (SleepTimer){ wake_at, m });
+	SleepTimer *heap = pools->timers;
+	size_t i = buf_len(heap) - 1;
+	while (i > 0 && heap[(i - 1) / 2].wake_at > heap[i].wake_at) {
+		SleepTimer tmp = heap[i];
+		heap[i] = heap[(i - 1) / 2];
+		heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+SleepTimer pop_timer(ModulatorPools *pools) {
+	SleepTimer *heap = pools->timers;
+	SleepTimer top = heap[0];
+	size_t n = --buf__hdr(heap)->len;
+	heap[0] = heap[n];
+	size_t i = 0;
+	for (;;) {
+		size_t smallest = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		if (l < n && heap[l].wake_at < heap[smallest].wake_at) {
+			smallest = l;
 		}
-		
-		if (RND() < odds) {
-			m->shift_register.buckets[bh] = RNDRNG(m->shift_register.age_range.min, m->shift_register.age_range.max);
-			m->shift_register.value_ages[bh] = 0;
+		if (r < n && heap[r].wake_at < heap[smallest].wake_at) {
+			smallest = r;
 		}
-		else {
-			m->shift_register.value_ages[bh] += 1;
+		if (smallest == i) {
+			break;
 		}
+		SleepTimer tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+	return top;
+}
 
-		bi = next_bucket(m, bi, n);
+void unroute_modulator(ModulatorPools *pools, Modulator *m);
+
+//Move the state of m from its current pools into dst, side buffers are copied into the arena of dst
+//and recycled in the arena of the source.
+//The follower of a goal follower moves along with it. The routes from and to m are dropped, a route
+//never crosses environments.
+void pools_move(ModulatorPools *dst, Modulator *m) {
+	ModulatorPools *src = m->pools;
+	if (src == dst) {
+		return;
+	}
+	wake_modulator(m);
+	unroute_modulator(src, m);
+	ModArena *arena = &dst->arena;
+	switch (m->type) {
+	case(WAVE): {
+		WavePool *p = &dst->wave;
+		size_t i = wave_pool_move(p, arena, &src->wave, m->slot);
+		float *table = p->table[i];
+		p->table[i] = copy_side_buffer(arena, table, p->table_len[i], sizeof(float));
+		release_side_buffer(&src->arena, table, p->table_len[i], sizeof(float));
+		m->slot = i;
+		break;
+	}
+	case(SCALARSPRING): m->slot = scalar_spring_pool_move(&dst->scalar_spring, arena, &src->scalar_spring, m->slot); break;
+	case(SCALARGOALFOLLOWER): {
+		ScalarGoalFollowerPool *p = &dst->scalar_goal_follower;
+		size_t i = scalar_goal_follower_pool_move(p, arena, &src->scalar_goal_follower, m->slot);
+		ValueRange *regions = p->regions[i];
+		p->regions[i] = copy_side_buffer(arena, regions, p->region_count[i], sizeof(ValueRange));
+		release_side_buffer(&src->arena, regions, p->region_count[i], sizeof(ValueRange));
+		m->slot = i;
+		break;
 	}
+	case(NEWTONIAN): m->slot = newtonian_pool_move(&dst->newtonian, arena, &src->newtonian, m->slot); break;
+	case(SHIFTREGISTER): {
+		ShiftRegisterPool *p = &dst->shift_register;
+		size_t i = shift_register_pool_move(p, arena, &src->shift_register, m->slot);
+		float *buckets = p->buckets[i];
+		uint32_t *value_ages = p->value_ages[i];
+		p->buckets[i] = copy_side_buffer(arena, buckets, p->bucket_count[i], sizeof(float));
+		p->value_ages[i] = copy_side_buffer(arena, value_ages, p->bucket_count[i], sizeof(uint32_t));
+		release_side_buffer(&src->arena, buckets, p->bucket_count[i], sizeof(float));
+		release_side_buffer(&src->arena, value_ages, p->bucket_count[i], sizeof(uint32_t));
+		m->slot = i;
+		break;
+	}
+	default: assert(0); break;
+	}
+	unlink_modulator(src, m);
+	m->pools = dst;
+	link_modulator(dst, m);
 
-	m->shift_register.time += dt;
-	switch (m->shift_register.interp) {
-	case(QUADRATIC): {
-		size_t bh = previous_bucket(m, bi, n);
-		size_t bj = next_bucket(m, bi, n);
+	if (m->type == SCALARGOALFOLLOWER && POOLED(m, scalar_goal_follower, follower)) {
+		pools_move(dst, POOLED(m, scalar_goal_follower, follower));
+	}
+	if (!member_count(src)) {
+		pools_free_storage(src); //nothing left, recycle the arena of src
+	}
+}
 
-		float v1 = m->shift_register.buckets[bi];
-		float v0 = (m->shift_register.buckets[bh] + v1) * 0.5;
-		float v2 = (m->shift_register.buckets[bj] + v1) * 0.5;
+//An owned modulator is advanced by its owner only, never by the pool loops
+void set_owned(Modulator *m, bool owned) {
+	wake_modulator(m);
+	switch (m->type) {
+	case(WAVE): POOLED(m, wave, owned) = owned; break;
+	case(SCALARSPRING): POOLED(m, scalar_spring, owned) = owned; break;
+	case(SCALARGOALFOLLOWER): POOLED(m, scalar_goal_follower, owned) = owned; break;
+	case(NEWTONIAN): POOLED(m, newtonian, owned) = owned; break;
+	case(SHIFTREGISTER): POOLED(m, shift_register, owned) = owned; break;
+	default: assert(0); break;
+	}
+}
 
-		uint64_t bt = (uint64_t)(m->shift_register.time % p - bp * bi);
-		float tt = (float)bt / (float)bp;
-		
-		float a0 = v0 + (v1 - v0) * tt;
-		float a1 = v1 + (v2 + v1) * tt;
+bool modulator_owned(Modulator *m) {
+	switch (m->type) {
+	case(WAVE): return POOLED(m, wave, owned);
+	case(SCALARSPRING): return POOLED(m, scalar_spring, owned);
+	case(SCALARGOALFOLLOWER): return POOLED(m, scalar_goal_follower, owned);
+	case(NEWTONIAN): return POOLED(m, newtonian, owned);
+	case(SHIFTREGISTER): return POOLED(m, shift_register, owned);
+	default: assert(0); return false;
+	}
+}
 
-		m->shift_register.value = a0 + (a1 - a0) * tt;
+//In lazy mode advance only accumulates time and value() computes the value when it is read.
+//Only the closed form modulators (WAVE and NEWTONIAN) support it.
+void set_lazy(Modulator *m, bool lazy) {
+	switch (m->type) {
+	case(WAVE):
+		POOLED(m, wave, lazy) = lazy;
+		break;
+	case(NEWTONIAN):
+		POOLED(m, newtonian, lazy) = lazy;
+		break;
+	default:
 		break;
 	}
-	case(LINEAR): {
-		float v0 = m->shift_register.buckets[bi];
-		float v1 = next_bucket(m, bi, n);
-		uint64_t bt = (uint64_t)(m->shift_register.time % p - bp * bi);
-		m->shift_register.value = v0 + (v1 - v0) * ((float)bt / (float)bp);
+}
+
+//Seed the generator of m. A shift register also draws its buckets again, so everything
+//it produces follows from the seed. Waves and springs draw no random numbers.
+void set_seed(Modulator *m, uint64_t seed) {
+	switch (m->type) {
+	case(SCALARGOALFOLLOWER):
+		POOLED(m, scalar_goal_follower, rng) = rng_seeded(seed);
+		break;
+	case(NEWTONIAN):
+		POOLED(m, newtonian, rng) = rng_seeded(seed);
+		break;
+	case(SHIFTREGISTER): {
+		ModRng *rng = &POOLED(m, shift_register, rng);
+		size_t n = POOLED(m, shift_register, bucket_count);
+		*rng = rng_seeded(seed);
+		if (n > 0) {
+			rng_fill(rng, POOLED(m, shift_register, buckets), n, POOLED(m, shift_register, value_range));
+			memset(POOLED(m, shift_register, value_ages), 0, n * sizeof(uint32_t));
+		}
 		break;
 	}
-		
-	case(NONE):
 	default:
-		m->shift_register.value = m->shift_register.buckets[bi];
 		break;
 	}
 }
 
+//
+//public API functions that need to be implemented by all Modulator types
+//
+
+//By default every call goes through the ModulatorFunctions of the modulator. Built with
+//MODULATORS_SWITCH_DISPATCH=1 it switches on the type instead and calls the implementation
+//directly, which the compiler can inline (the goal follower's calls on its follower, for one).
+
+#if MODULATORS_SWITCH_DISPATCH
+#define DECLARE_MODULATOR_FUNCTIONS(type, prefix, pool, ...) \
+	float prefix##_val(Modulator *m); \
+	ValueRange prefix##_range(Modulator *m); \
+	float prefix##_goal(Modulator *m); \
+	void prefix##_set_goal(Modulator *m, float f); \
+	uint64_t prefix##_elapsed_us(Modulator *m); \
+	bool prefix##_enabled(Modulator *m); \
+	void prefix##_set_enabled(Modulator *m, bool enabled); \
+	void prefix##_advance(Modulator *m, uint64_t dt);
+
+MODULATOR_TYPES(DECLARE_MODULATOR_FUNCTIONS)
+
+#define DISPATCH_RETURN_CASE(type, prefix, pool, function, ...) case(type): return prefix##_##function(__VA_ARGS__);
+#define DISPATCH_CALL_CASE(type, prefix, pool, function, ...) case(type): prefix##_##function(__VA_ARGS__); break;
+
+//return prefix_function(args) of the type of m, the ModulatorFunctions entry is unused
+#define DISPATCH_RETURN(m, entry, function, ...) \
+	switch ((m)->type) { \
+	MODULATOR_TYPES(DISPATCH_RETURN_CASE, function, __VA_ARGS__) \
+	default: assert(0); return m->modulator_functions->entry(__VA_ARGS__); \
+	}
+#define DISPATCH_CALL(m, entry, function, ...) \
+	switch ((m)->type) { \
+	MODULATOR_TYPES(DISPATCH_CALL_CASE, function, __VA_ARGS__) \
+	default: assert(0); m->modulator_functions->entry(__VA_ARGS__); break; \
+	}
+#else
+#define DISPATCH_RETURN(m, entry, function, ...) return (m)->modulator_functions->entry(__VA_ARGS__)
+#define DISPATCH_CALL(m, entry, function, ...) (m)->modulator_functions->entry(__VA_ARGS__)
+#endif
+
+static inline float dispatch_value(Modulator *m) { DISPATCH_RETURN(m, value, val, m); }
+static inline ValueRange dispatch_range(Modulator *m) { DISPATCH_RETURN(m, range, range, m); }
+static inline float dispatch_goal(Modulator *m) { DISPATCH_RETURN(m, goal, goal, m); }
+static inline void dispatch_set_goal(Modulator *m, float f) { DISPATCH_CALL(m, set_goal, set_goal, m, f); }
+static inline uint64_t dispatch_elapsed_us(Modulator *m) { DISPATCH_RETURN(m, elapsed_us, elapsed_us, m); }
+static inline bool dispatch_enabled(Modulator *m) { DISPATCH_RETURN(m, enabled, enabled, m); }
+static inline void dispatch_set_enabled(Modulator *m, bool enabled) { DISPATCH_CALL(m, set_enabled, set_enabled, m, enabled); }
+static inline void dispatch_advance(Modulator *m, uint64_t dt) { DISPATCH_CALL(m, advance, advance, m, dt); }
+
+#if MODULATORS_STATS
+float value(Modulator *m) {
+	STATS_BEGIN();
+	float v = dispatch_value(m);
+	STATS_END(m->pools, m->type, STATS_VALUE, 1);
+	return v;
+}
+
+ValueRange range(Modulator *m) {
+	STATS_BEGIN();
+	ValueRange r = dispatch_range(m);
+	STATS_END(m->pools, m->type, STATS_RANGE, 1);
+	return r;
+}
+
+float goal(Modulator *m) {
+	STATS_BEGIN();
+	float g = dispatch_goal(m);
+	STATS_END(m->pools, m->type, STATS_GOAL, 1);
+	return g;
+}
+
+void set_goal(Modulator *m, float f) {
+	RECORD_BEGIN(m, TRACE_SET_GOAL, f, 0);
+	wake_modulator(m);
+	STATS_BEGIN();
+	dispatch_set_goal(m, f);
+	STATS_END(m->pools, m->type, STATS_SET_GOAL, 1);
+	RECORD_END();
+}
+
+uint64_t elapsed_us(Modulator *m) {
+	STATS_BEGIN();
+	uint64_t us = dispatch_elapsed_us(m) + slept_us(m);
+	STATS_END(m->pools, m->type, STATS_ELAPSED_US, 1);
+	return us;
+}
+
+bool enabled(Modulator *m) {
+	STATS_BEGIN();
+	bool e = dispatch_enabled(m);
+	STATS_END(m->pools, m->type, STATS_ENABLED, 1);
+	return e;
+}
+
+void set_enabled(Modulator *m, bool enabled) {
+	RECORD_BEGIN(m, TRACE_SET_ENABLED, enabled, 0);
+	wake_modulator(m);
+	STATS_BEGIN();
+	dispatch_set_enabled(m, enabled);
+	STATS_END(m->pools, m->type, STATS_SET_ENABLED, 1);
+	RECORD_END();
+}
+
+void advance(Modulator *m, uint64_t dt) {
+	RECORD_BEGIN(m, TRACE_ADVANCE, 0.0f, dt);
+	wake_modulator(m);
+	STATS_BEGIN();
+	dispatch_advance(m, dt);
+	STATS_END(m->pools, m->type, STATS_ADVANCE, 1);
+	RECORD_END();
+}
+#else
+float value(Modulator *m) { return dispatch_value(m); }
+ValueRange range(Modulator *m) { return dispatch_range(m); }
+float goal(Modulator *m) { return dispatch_goal(m); }
+
+void set_goal(Modulator *m, float f) {
+	RECORD_BEGIN(m, TRACE_SET_GOAL, f, 0);
+	wake_modulator(m);
+	dispatch_set_goal(m, f);
+	RECORD_END();
+}
+
+uint64_t elapsed_us(Modulator *m) { return dispatch_elapsed_us(m) + slept_us(m); }
+bool enabled(Modulator *m) { return dispatch_enabled(m); }
+
+void set_enabled(Modulator *m, bool enabled) {
+	RECORD_BEGIN(m, TRACE_SET_ENABLED, enabled, 0);
+	wake_modulator(m);
+	dispatch_set_enabled(m, enabled);
+	RECORD_END();
+}
+
+void advance(Modulator *m, uint64_t dt) {
+	RECORD_BEGIN(m, TRACE_ADVANCE, 0.0f, dt);
+	wake_modulator(m);
+	dispatch_advance(m, dt);
+	RECORD_END();
+}
+#endif
 
 //
-//Modulator constructors
+//Bulk kernels, picked by set_simd_level
 //
 
+typedef void(*WaveKernel)(WavePool *, size_t, size_t);
+typedef void(*ScalarSpringKernel)(ScalarSpringPool *, size_t, size_t, uint64_t);
+typedef void(*NewtonianKernel)(NewtonianPool *, size_t, size_t, uint64_t);
 
-Modulator *new_modulator(const char *name, ModulatorType type, ModulatorFunctions *functions) {
-	Modulator *mod = xcalloc(1, sizeof(Modulator));
-	memcpy(&mod->modulator_functions, &functions, sizeof(functions));
-	mod->name = name;
-	mod->type = type;
-	return mod;
+SimdLevel simd_level = SIMD_SCALAR;
+WaveKernel wave_kernel = NULL;
+ScalarSpringKernel scalar_spring_kernel = NULL;
+NewtonianKernel newtonian_kernel = NULL;
+
+void set_simd_level(SimdLevel level);
+
+#if MOD_X86
+
+//4 bools as a 32 bit mask per lane
+static inline TARGET_SSE2 __m128 lane_mask_sse2(const bool *flags) {
+	int32_t f;
+	memcpy(&f, flags, sizeof(f));
+	__m128i zero = _mm_setzero_si128();
+	__m128i fm = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(f), zero), zero);
+	return _mm_castsi128_ps(_mm_cmpgt_epi32(fm, zero));
 }
 
-Modulator *wave_modulator(const char *name, float amplitude, float frequency) {
-	static const ModulatorFunctions wave_functions = {
-		wave_val, wave_range, wave_goal, wave_set_goal, wave_elapsed_us, wave_enabled, wave_set_enabled, wave_advance
-	};
-	Modulator *m = new_modulator(name, WAVE, &wave_functions);
-	m->wave.amplitude = amplitude;
-	m->wave.frequency = frequency;
-	m->wave.time = 0;
-	m->wave.value = 0.0;
-	m->wave.enabled = true;
-	return m;
+//lanes where enabled && !owned
+static inline TARGET_SSE2 __m128 active_mask_sse2(const bool *enabled, const bool *owned) {
+	return _mm_andnot_ps(lane_mask_sse2(owned), lane_mask_sse2(enabled));
 }
 
+static inline TARGET_SSE2 __m128 select_sse2(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
 
-Modulator *scalar_spring(const char *name, float smooth, float undamp, float initial) {
-	static const ModulatorFunctions scalar_spring_functions = {
-	scalar_spring_val, scalar_spring_range, scalar_spring_goal, scalar_spring_set_goal, scalar_spring_elapsed_us, scalar_spring_enabled, scalar_spring_set_enabled, scalar_spring_advance
-	};
-	Modulator *m = new_modulator(name, SCALARSPRING, &scalar_spring_functions);
-	m->scalar_spring.smooth = smooth;
-	m->scalar_spring.undamp = undamp;
-	m->scalar_spring.goal = initial;
-	m->scalar_spring.value = initial;
-	m->scalar_spring.vel = 0.0;
-	m->scalar_spring.time = 0;
-	return m;
+//8 bools as a 32 bit mask per lane
+static inline TARGET_AVX2 __m256 lane_mask_avx2(const bool *flags) {
+	__m256i fm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)flags));
+	return _mm256_castsi256_ps(_mm256_cmpgt_epi32(fm, _mm256_setzero_si256()));
 }
 
-Modulator *scalar_goal_follower(const char *name) {
-	static const ModulatorFunctions scalar_goal_follower_functions = {
-	scalar_goal_follower_val, scalar_goal_follower_range, scalar_goal_follower_goal, scalar_goal_follower_set_goal, scalar_goal_follower_elapsed_us, scalar_goal_follower_enabled, scalar_goal_follower_set_enabled, scalar_goal_follower_advance
-	};
-	Modulator *m = new_modulator(name, SCALARGOALFOLLOWER, &scalar_goal_follower_functions);
-	m->scalar_goal_follower.regions= NULL; //array of arrays
-	m->scalar_goal_follower.random_region = false;
-	m->scalar_goal_follower.threshold = 0.01;
-	m->scalar_goal_follower.vel_threshold = 0.0001;
-	m->scalar_goal_follower.pause_range.min = 0;
-	m->scalar_goal_follower.pause_range.max = 0;
-	m->scalar_goal_follower.current_region = 0;
-	m->scalar_goal_follower.paused_left = 0;
-	m->scalar_goal_follower.time = 0;
-	m->scalar_goal_follower.enabled = true;
-	return m;
+//lanes where enabled && !owned
+static inline TARGET_AVX2 __m256 active_mask_avx2(const bool *enabled, const bool *owned) {
+	return _mm256_andnot_ps(lane_mask_avx2(owned), lane_mask_avx2(enabled));
 }
 
+#endif
 
-Modulator *newtonian(const char *name, ValueRange speed_limit_range, ValueRange acceleration_range, ValueRange deceleration_range, float initial) {
-	static const ModulatorFunctions newtonian_functions = {
-	newtonian_val, newtonian_range, newtonian_goal, newtonian_set_goal, newtonian_elapsed_us, newtonian_enabled, newtonian_set_enabled, newtonian_advance
-	};
-	Modulator *m = new_modulator(name, NEWTONIAN, &newtonian_functions);
-	m->newtonian.speed_limit_range = speed_limit_range;
-	m->newtonian.acceleration_range = acceleration_range;
-	m->newtonian.deceleration_range = deceleration_range;
-	m->newtonian.goal = initial;
-	m->newtonian.value = initial;
-	m->newtonian.time = 0;
-	m->newtonian.enabled = true;
-	m->newtonian.s = 0.0;
-	m->newtonian.a = 0.0;
-	m->newtonian.d = 0.0;
-	m->newtonian.f = initial;
-	m->newtonian.phase = (PhaseTime){0.0, 0.0, 0.0};
-	return m;
+//
+//private implementations of the different ModulatorFunctions
+//
+//Each type has a step function that advances a single pool entry. The advance
+//function of the vtable and the bulk pool loop both call it, so the loop can inline it.
+//DEFINE_STEP_LOOPS generates both from prefix##_step for the types without a SIMD kernel.
+//
+
+//prefix##_advance for a single modulator, prefix##_advance_range and prefix##_pool_advance
+//for every enabled, unowned entry of a range of the pool and of all its awake entries
+#define DEFINE_STEP_LOOPS(prefix, Pool, pool) \
+	void prefix##_advance(Modulator *m, uint64_t dt) { \
+		prefix##_step(&m->pools->pool, m->slot, dt); \
+	} \
+	void prefix##_advance_range(Pool *p, size_t begin, size_t end, uint64_t dt) { \
+		for (size_t i = begin; i < end; i++) { \
+			if (p->enabled[i] && !p->owned[i]) { \
+				prefix##_step(p, i, dt); \
+			} \
+		} \
+	} \
+	void prefix##_pool_advance(Pool *p, uint64_t dt) { \
+		prefix##_advance_range(p, 0, p->active, dt); \
+	}
+
+//--wave modulator--
+
+void set_wave_shape(Modulator *m, WaveShape shape) {
+	assert(m->type == WAVE);
+	POOLED(m, wave, shape) = shape;
+	POOLED(m, wave, valid) = false;
 }
 
-Modulator *shift_register(const char *name, size_t buckets, ValueRange value_range, float odds, float period, ShiftRegisterInterp interp) {
-	static const ModulatorFunctions shift_register_functions = {
-	shiftregister_val, shiftregister_range, shiftregister_goal, shiftregister_set_goal, shiftregister_elapsed_us, shiftregister_enabled, shiftregister_set_enabled, shiftregister_advance
-	};
-	Modulator *m = new_modulator(name, SHIFTREGISTER, &shift_register_functions);
-	
-	m->shift_register.buckets = NULL; 
-	new_buckets(m->shift_register.buckets, buckets, value_range);
-	
-	float v;
-	if (buf_len(m->shift_register.buckets) > 0) {
-		 v = m->shift_register.buckets[0]; 
+//Use n samples of one period as the waveform, they are copied
+void set_wave_table(Modulator *m, const float *table, size_t n) {
+	assert(m->type == WAVE);
+	release_side_buffer(&m->pools->arena, POOLED(m, wave, table), POOLED(m, wave, table_len), sizeof(float));
+	POOLED(m, wave, table) = copy_side_buffer(&m->pools->arena, table, n, sizeof(float));
+	POOLED(m, wave, table_len) = n;
+	POOLED(m, wave, shape) = WAVETABLE;
+	POOLED(m, wave, valid) = false;
+}
+
+void set_amplitude(Modulator *m, float amplitude) {
+	assert(m->type == WAVE);
+	POOLED(m, wave, amplitude) = amplitude;
+	POOLED(m, wave, valid) = false;
+}
+
+//The wave carries on from the phase it is at, so a frequency that keeps changing sweeps smoothly
+void set_frequency(Modulator *m, float frequency) {
+	assert(m->type == WAVE);
+	double secs = us_to_secs(POOLED(m, wave, time));
+	double offset = POOLED(m, wave, phase_offset) + ((double)POOLED(m, wave, frequency) - (double)frequency) * secs;
+	POOLED(m, wave, phase_offset) = offset - floor(offset);
+	POOLED(m, wave, frequency) = frequency;
+	POOLED(m, wave, valid) = false;
+}
+
+//Position within the current period in [0, 1], in double so that hours of elapsed time keep their precision.
+//offset is the phase_offset of the wave, in periods.
+static inline float wave_phase(uint64_t time, float frequency, double offset) {
+	double cycles = (double)frequency * ((double)time / 1000000.0) + offset;
+	return (float)(cycles - floor(cycles));
+}
+
+//sin(2 * pi * x) for x in [-0.5, 0.5]. The argument is folded into a quarter period
+//and fed to a degree 11 Taylor polynomial, the absolute error is below 2e-7.
+#define SINE_TWO_PI 6.28318530717958648f
+#define SINE_C3 -1.6666666667e-1f
+#define SINE_C5 8.3333333333e-3f
+#define SINE_C7 -1.9841269841e-4f
+#define SINE_C9 2.7557319224e-6f
+#define SINE_C11 -2.5052108385e-8f
+
+//x folded into [-0.25, 0.25] such that sin(2 * pi * x) stays the same
+static inline float fold_quarter(float x) {
+	return copysignf(0.25f - fabsf(fabsf(x) - 0.25f), x);
+}
+
+static inline float sine_poly(float x) {
+	float y = SINE_TWO_PI * fold_quarter(x);
+	float y2 = y * y;
+	float s = SINE_C11;
+	s = s * y2 + SINE_C9;
+	s = s * y2 + SINE_C7;
+	s = s * y2 + SINE_C5;
+	s = s * y2 + SINE_C3;
+	return y + y * y2 * s;
+}
+
+//Optional sine wavetable instead of the polynomial: linear interpolation between
+//SINE_TABLE_SIZE samples, absolute error below 5e-6
+#define SINE_TABLE_SIZE 1024
+
+bool wave_sine_table = false;
+float sine_table[SINE_TABLE_SIZE + 1];
+
+void set_wave_sine_table(bool enabled) {
+	if (enabled && sine_table[SINE_TABLE_SIZE / 4] == 0.0f) {
+		for (int i = 0; i <= SINE_TABLE_SIZE; i++) {
+			sine_table[i] = (float)sin(2.0 * 3.14159265358979323846 * i / SINE_TABLE_SIZE);
+		}
 	}
-	else {
-		v = 0.0;
+	wave_sine_table = enabled;
+}
+
+//linear interpolation in a table holding one period, phase in [0, 1]
+static inline float table_lookup(const float *table, size_t n, float phase, bool wrap) {
+	float pos = phase * (float)n;
+	size_t i = MIN((size_t)pos, n - 1);
+	float frac = pos - (float)i;
+	float a = table[i];
+	float b = (i + 1 < n || !wrap) ? table[i + 1] : table[0];
+	return a + (b - a) * frac;
+}
+
+//Value of a waveform with amplitude 1 at the given phase
+static inline float wave_shape_value(WaveShape shape, float phase, const float *table, size_t table_len) {
+	float x = phase - floorf(phase + 0.5f); //[-0.5, 0.5), zero crossing at phase 0
+	switch (shape) {
+	case(SINE):
+		if (wave_sine_table) {
+			return table_lookup(sine_table, SINE_TABLE_SIZE, phase, false);
+		}
+		return sine_poly(x);
+	case(TRIANGLE): return 4.0f * fold_quarter(x);
+	case(SAW): return 2.0f * x;
+	case(SQUARE): return x >= 0.0f ? 1.0f : -1.0f;
+	case(WAVETABLE):
+		if (table_len == 0) {
+			return 0.0f;
+		}
+		return table_lookup(table, table_len, phase, true);
+	default: return 0.0f;
 	}
-	
-	m->shift_register.value_ages = NULL; //uninitialized buffer. will contain a age value for each bucket
-	
-	m->shift_register.value_range = value_range;
-	m->shift_register.odds = odds;
-	m->shift_register.age_range = (ValueRange){ UINT32_MAX, UINT32_MAX };  
-	m->shift_register.period = period;
-	m->shift_register.interp = interp;
-	m->shift_register.time = 0;
-	m->shift_register.value = v;
 }
 
-//
-//ModulatorEnvirnment HashMap for managing Modulators
-//
+static inline float wave_eval(WavePool *p, size_t i) {
+	float phase = wave_phase(p->time[i], p->frequency[i], p->phase_offset[i]);
+	return p->amplitude[i] * wave_shape_value(p->shape[i], phase, p->table[i], p->table_len[i]);
+}
 
-typedef struct ModulatorEnvironment {
-	const char* name;
-	Map modulator_map;
-} ModulatorEnvironment;
+float wave_val(Modulator *m) {
+	WavePool *p = &m->pools->wave;
+	size_t i = m->slot;
+	if (!p->valid[i]) {
+		p->value[i] = wave_eval(p, i);
+		p->valid[i] = true;
+	}
+	return p->value[i];
+}
+ValueRange wave_range(Modulator *m) {
+	ValueRange r = { -POOLED(m, wave, amplitude), POOLED(m, wave, amplitude)};
+	return r;
+}
+
+//A wave has no goal of its own, it is the value, evaluated first when the wave is lazy
+float wave_goal(Modulator *m) {
+	return wave_val(m);
+}
 
-Map env_map;
+void wave_set_goal(Modulator *m, float f) {
+}
 
-ModulatorEnvironment *create_environment(const char *environment_name) {
-	ModulatorEnvironment *new_env = xcalloc(1, sizeof(ModulatorEnvironment));
-	new_env->name = environment_name;
-	return new_env;
+uint64_t wave_elapsed_us(Modulator *m) {
+	return POOLED(m, wave, time);
 }
 
-void add_modulator(const char *environment_name, Modulator *modulator) {
-	ModulatorEnvironment *env = map_get(&env_map, environment_name);
-	if (env) {
-		map_put(&env->modulator_map, modulator->name, modulator);
+bool wave_enabled(Modulator *m) {
+	return POOLED(m, wave, enabled);
+}
+
+void wave_set_enabled(Modulator *m, bool enabled) {
+	POOLED(m, wave, enabled) = enabled;
+}
+
+
+static inline void wave_step(WavePool *p, size_t i, uint64_t dt) {
+	p->time[i] += dt;
+	if (p->lazy[i]) {
+		p->valid[i] = false;
 	}
 	else {
-		ModulatorEnvironment *new_env = create_environment(environment_name);
-		map_put(&env_map, new_env->name, new_env);
-		map_put(&new_env->modulator_map, modulator->name, modulator);
+		p->value[i] = wave_eval(p, i);
+	}
+}
+
+void wave_advance(Modulator *m, uint64_t dt) {
+	wave_step(&m->pools->wave, m->slot, dt);
+}
+
+//--wave bulk kernels
+//
+//Evaluate the (non lazy) waves [begin, end) of a pool at their current time. The SIMD kernels
+//compute sine, triangle, saw and square for all lanes and select per lane;
+//wavetable lanes, and every lane when the sine wavetable is on, go through wave_eval.
+//
+
+void wave_kernel_scalar(WavePool *p, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++) {
+		if (p->enabled[i] && !p->owned[i] && !p->lazy[i]) {
+			p->value[i] = wave_eval(p, i);
+		}
+	}
+}
+
+#if MOD_X86
+
+static inline TARGET_SSE2 __m128 wave_shapes_sse2(__m128 phase, __m128i shape) {
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 quarter = _mm_set1_ps(0.25f);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 x = _mm_sub_ps(phase, _mm_and_ps(_mm_cmpge_ps(phase, half), _mm_set1_ps(1.0f)));
+	__m128 fold = _mm_sub_ps(quarter, _mm_andnot_ps(sign, _mm_sub_ps(_mm_andnot_ps(sign, x), quarter)));
+	fold = _mm_or_ps(fold, _mm_and_ps(sign, x));
+
+	__m128 y = _mm_mul_ps(fold, _mm_set1_ps(SINE_TWO_PI));
+	__m128 y2 = _mm_mul_ps(y, y);
+	__m128 s = _mm_set1_ps(SINE_C11);
+	s = _mm_add_ps(_mm_mul_ps(s, y2), _mm_set1_ps(SINE_C9));
+	s = _mm_add_ps(_mm_mul_ps(s, y2), _mm_set1_ps(SINE_C7));
+	s = _mm_add_ps(_mm_mul_ps(s, y2), _mm_set1_ps(SINE_C5));
+	s = _mm_add_ps(_mm_mul_ps(s, y2), _mm_set1_ps(SINE_C3));
+	__m128 sine = _mm_add_ps(y, _mm_mul_ps(_mm_mul_ps(y, y2), s));
+
+	__m128 triangle = _mm_mul_ps(fold, _mm_set1_ps(4.0f));
+	__m128 saw = _mm_add_ps(x, x);
+	__m128 square = _mm_or_ps(_mm_set1_ps(1.0f), _mm_and_ps(sign, x));
+
+	__m128 r = sine;
+	r = select_sse2(_mm_castsi128_ps(_mm_cmpeq_epi32(shape, _mm_set1_epi32(TRIANGLE))), triangle, r);
+	r = select_sse2(_mm_castsi128_ps(_mm_cmpeq_epi32(shape, _mm_set1_epi32(SAW))), saw, r);
+	r = select_sse2(_mm_castsi128_ps(_mm_cmpeq_epi32(shape, _mm_set1_epi32(SQUARE))), square, r);
+	return r;
+}
+
+TARGET_SSE2 void wave_kernel_sse2(WavePool *p, size_t begin, size_t end) {
+	assert(sizeof(WaveShape) == sizeof(int32_t));
+	if (wave_sine_table) {
+		wave_kernel_scalar(p, begin, end);
+		return;
+	}
+	size_t i = begin;
+	for (; i + 4 <= end; i += 4) {
+		__m128 active = _mm_andnot_ps(lane_mask_sse2(&p->lazy[i]), active_mask_sse2(&p->enabled[i], &p->owned[i]));
+		if (_mm_movemask_ps(active) == 0) {
+			continue;
+		}
+		float phases[4];
+		for (size_t j = 0; j < 4; j++) {
+			phases[j] = wave_phase(p->time[i + j], p->frequency[i + j], p->phase_offset[i + j]);
+		}
+		__m128i shape = _mm_loadu_si128((const __m128i *)&p->shape[i]);
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(&p->amplitude[i]), wave_shapes_sse2(_mm_loadu_ps(phases), shape));
+		_mm_storeu_ps(&p->value[i], select_sse2(active, v, _mm_loadu_ps(&p->value[i])));
+		for (size_t j = i; j < i + 4; j++) {
+			if (p->shape[j] == WAVETABLE && p->enabled[j] && !p->owned[j] && !p->lazy[j]) {
+				p->value[j] = wave_eval(p, j);
+			}
+		}
+	}
+	wave_kernel_scalar(p, i, end);
+}
+
+static inline TARGET_AVX2 __m256 wave_shapes_avx2(__m256 phase, __m256i shape) {
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 quarter = _mm256_set1_ps(0.25f);
+	__m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 x = _mm256_sub_ps(phase, _mm256_and_ps(_mm256_cmp_ps(phase, half, _CMP_GE_OQ), _mm256_set1_ps(1.0f)));
+	__m256 fold = _mm256_sub_ps(quarter, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_andnot_ps(sign, x), quarter)));
+	fold = _mm256_or_ps(fold, _mm256_and_ps(sign, x));
+
+	__m256 y = _mm256_mul_ps(fold, _mm256_set1_ps(SINE_TWO_PI));
+	__m256 y2 = _mm256_mul_ps(y, y);
+	__m256 s = _mm256_set1_ps(SINE_C11);
+	s = _mm256_add_ps(_mm256_mul_ps(s, y2), _mm256_set1_ps(SINE_C9));
+	s = _mm256_add_ps(_mm256_mul_ps(s, y2), _mm256_set1_ps(SINE_C7));
+	s = _mm256_add_ps(_mm256_mul_ps(s, y2), _mm256_set1_ps(SINE_C5));
+	s = _mm256_add_ps(_mm256_mul_ps(s, y2), _mm256_set1_ps(SINE_C3));
+	__m256 sine = _mm256_add_ps(y, _mm256_mul_ps(_mm256_mul_ps(y, y2), s));
+
+	__m256 triangle = _mm256_mul_ps(fold, _mm256_set1_ps(4.0f));
+	__m256 saw = _mm256_add_ps(x, x);
+	__m256 square = _mm256_or_ps(_mm256_set1_ps(1.0f), _mm256_and_ps(sign, x));
+
+	__m256 r = sine;
+	r = _mm256_blendv_ps(r, triangle, _mm256_castsi256_ps(_mm256_cmpeq_epi32(shape, _mm256_set1_epi32(TRIANGLE))));
+	r = _mm256_blendv_ps(r, saw, _mm256_castsi256_ps(_mm256_cmpeq_epi32(shape, _mm256_set1_epi32(SAW))));
+	r = _mm256_blendv_ps(r, square, _mm256_castsi256_ps(_mm256_cmpeq_epi32(shape, _mm256_set1_epi32(SQUARE))));
+	return r;
+}
+
+TARGET_AVX2 void wave_kernel_avx2(WavePool *p, size_t begin, size_t end) {
+	assert(sizeof(WaveShape) == sizeof(int32_t));
+	if (wave_sine_table) {
+		wave_kernel_scalar(p, begin, end);
+		return;
+	}
+	size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 active = _mm256_andnot_ps(lane_mask_avx2(&p->lazy[i]), active_mask_avx2(&p->enabled[i], &p->owned[i]));
+		if (_mm256_movemask_ps(active) == 0) {
+			continue;
+		}
+		float phases[8];
+		for (size_t j = 0; j < 8; j++) {
+			phases[j] = wave_phase(p->time[i + j], p->frequency[i + j], p->phase_offset[i + j]);
+		}
+		__m256i shape = _mm256_loadu_si256((const __m256i *)&p->shape[i]);
+		__m256 v = _mm256_mul_ps(_mm256_loadu_ps(&p->amplitude[i]), wave_shapes_avx2(_mm256_loadu_ps(phases), shape));
+		_mm256_storeu_ps(&p->value[i], _mm256_blendv_ps(_mm256_loadu_ps(&p->value[i]), v, active));
+		for (size_t j = i; j < i + 8; j++) {
+			if (p->shape[j] == WAVETABLE && p->enabled[j] && !p->owned[j] && !p->lazy[j]) {
+				p->value[j] = wave_eval(p, j);
+			}
+		}
+	}
+	wave_kernel_scalar(p, i, end);
+}
+
+#endif
+
+//Evaluate many waves at once, without advancing them
+void wave_eval_range(WavePool *p, size_t begin, size_t end) {
+	if (!wave_kernel) {
+		set_simd_level(detect_simd_level());
+	}
+	wave_kernel(p, begin, end);
+}
+
+void wave_advance_range(WavePool *p, size_t begin, size_t end, uint64_t dt) {
+	for (size_t i = begin; i < end; i++) {
+		if (p->enabled[i] && !p->owned[i]) {
+			p->time[i] += dt;
+			p->valid[i] = !p->lazy[i];
+		}
+	}
+	wave_eval_range(p, begin, end);
+}
+
+void wave_pool_advance(WavePool *p, uint64_t dt) {
+	wave_advance_range(p, 0, p->active, dt);
+}
+
+//--ScalarSpring
+
+
+//Update the target the spring is moving to
+void spring_to(Modulator *m, float goal) {
+	assert(m->type == SCALARSPRING);
+	wake_modulator(m);
+	POOLED(m, scalar_spring, goal) = goal;
+}
+
+//Jump immediately to the given goal, zero velocity
+void jump_to(Modulator *m, float goal) {
+	assert(m->type == SCALARSPRING);
+	RECORD_BEGIN(m, TRACE_JUMP_TO, goal, 0);
+	wake_modulator(m);
+	POOLED(m, scalar_spring, goal) = goal;
+	POOLED(m, scalar_spring, value) = goal;
+	POOLED(m, scalar_spring, vel) = 0.0;
+	RECORD_END();
+}
+
+float scalar_spring_val(Modulator *m) {
+	return POOLED(m, scalar_spring, value);
+}
+ValueRange scalar_spring_range(Modulator *m) {
+	ValueRange r = {0.0, 0.0};
+	return r;
+}
+
+float scalar_spring_goal(Modulator *m) {
+	return POOLED(m, scalar_spring, goal);
+}
+
+void scalar_spring_set_goal(Modulator *m, float f) {
+	spring_to(m, f);
+}
+
+uint64_t scalar_spring_elapsed_us(Modulator *m) {
+	return POOLED(m, scalar_spring, time);
+}
+
+bool scalar_spring_enabled(Modulator *m) {
+	return POOLED(m, scalar_spring, enabled);
+}
+
+void scalar_spring_set_enabled(Modulator *m, bool enabled) {
+	POOLED(m, scalar_spring, enabled) = enabled;
+}
+
+static inline void scalar_spring_step(ScalarSpringPool *p, size_t i, uint64_t dt) {
+	p->time[i] += dt;
+	if (p->smooth[i] < 0.0001) {
+		p->value[i] = p->goal[i];
+		p->vel[i] = 0.0;
+	}
+	else {
+		float _dt = micros_to_secs(dt);
+		float omega = 2.0 / p->smooth[i];
+		float x = omega * _dt;
+		float ex = 1.0 / expf(x);
+		float ud = _dt * p->undamp[i];
+
+		float d = p->value[i] - p->goal[i];
+		float v = p->vel[i];
+		float t = (v + omega * d) * _dt;
+
+		p->vel[i] = (v - omega * t) * ex + v * ud;
+		p->value[i] = p->goal[i] + (d + t) * ex;
+	}
+}
+
+void scalar_spring_advance(Modulator *m, uint64_t dt) {
+	scalar_spring_step(&m->pools->scalar_spring, m->slot, dt);
+}
+
+//--ScalarSpring bulk kernels
+//
+//Advance the springs [begin, end) of a pool that share the same dt.
+//The SSE2 and AVX2 kernels replace 1.0 / expf(x) by an exp(-x) approximation
+//(Cephes style range reduction and a degree 5 polynomial). For x in [0, 87.3] its relative
+//error is below 1e-7 against exp() and below 2e-7 against the scalar kernel's 1.0 / expf(x).
+//Beyond that x is clamped, giving exp(-87.3) ~ 1.2e-38 instead of a denormal or zero.
+//
+
+void scalar_spring_kernel_scalar(ScalarSpringPool *p, size_t begin, size_t end, uint64_t dt) {
+	for (size_t i = begin; i < end; i++) {
+		if (p->enabled[i] && !p->owned[i]) {
+			scalar_spring_step(p, i, dt);
+		}
+	}
+}
+
+#if MOD_X86
+
+#define EXP_HI 0.0f
+#define EXP_LO -87.3f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+//exp(x) for x <= 0
+static inline TARGET_SSE2 __m128 exp_approx_sse2(__m128 x) {
+	x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(EXP_HI)), _mm_set1_ps(EXP_LO));
+	__m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(EXP_LOG2E)));
+	__m128 fn = _mm_cvtepi32_ps(n);
+	__m128 r = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(EXP_C1))), _mm_mul_ps(fn, _mm_set1_ps(EXP_C2)));
+	__m128 y = _mm_set1_ps(EXP_P0);
+	y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(EXP_P1));
+	y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(EXP_P2));
+	y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(EXP_P3));
+	y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(EXP_P4));
+	y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(EXP_P5));
+	y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(y, r), r), r), _mm_set1_ps(1.0f));
+	__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+	return _mm_mul_ps(y, scale);
+}
+
+TARGET_SSE2 void scalar_spring_kernel_sse2(ScalarSpringPool *p, size_t begin, size_t end, uint64_t dt) {
+	float secs = micros_to_secs(dt);
+	__m128 _dt = _mm_set1_ps(secs);
+	__m128 min_smooth = _mm_set1_ps(0.0001f);
+	size_t i = begin;
+	for (; i + 4 <= end; i += 4) {
+		__m128 active = active_mask_sse2(&p->enabled[i], &p->owned[i]);
+		if (_mm_movemask_ps(active) == 0) {
+			continue;
+		}
+		for (size_t j = i; j < i + 4; j++) {
+			p->time[j] += (p->enabled[j] && !p->owned[j]) ? dt : 0;
+		}
+		__m128 smooth = _mm_loadu_ps(&p->smooth[i]);
+		__m128 goal = _mm_loadu_ps(&p->goal[i]);
+		__m128 value = _mm_loadu_ps(&p->value[i]);
+		__m128 v = _mm_loadu_ps(&p->vel[i]);
+
+		__m128 omega = _mm_div_ps(_mm_set1_ps(2.0f), smooth);
+		__m128 ex = exp_approx_sse2(_mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(omega, _dt)));
+		__m128 ud = _mm_mul_ps(_dt, _mm_loadu_ps(&p->undamp[i]));
+
+		__m128 d = _mm_sub_ps(value, goal);
+		__m128 t = _mm_mul_ps(_mm_add_ps(v, _mm_mul_ps(omega, d)), _dt);
+
+		__m128 new_vel = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(v, _mm_mul_ps(omega, t)), ex), _mm_mul_ps(v, ud));
+		__m128 new_value = _mm_add_ps(goal, _mm_mul_ps(_mm_add_ps(d, t), ex));
+
+		__m128 snap = _mm_cmplt_ps(smooth, min_smooth);
+		new_vel = select_sse2(snap, _mm_setzero_ps(), new_vel);
+		new_value = select_sse2(snap, goal, new_value);
+
+		_mm_storeu_ps(&p->vel[i], select_sse2(active, new_vel, v));
+		_mm_storeu_ps(&p->value[i], select_sse2(active, new_value, value));
+	}
+	scalar_spring_kernel_scalar(p, i, end, dt);
+}
+
+//exp(x) for x <= 0
+static inline TARGET_AVX2 __m256 exp_approx_avx2(__m256 x) {
+	x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(EXP_HI)), _mm256_set1_ps(EXP_LO));
+	__m256i n = _mm256_cvtps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)));
+	__m256 fn = _mm256_cvtepi32_ps(n);
+	__m256 r = _mm256_sub_ps(_mm256_sub_ps(x, _mm256_mul_ps(fn, _mm256_set1_ps(EXP_C1))), _mm256_mul_ps(fn, _mm256_set1_ps(EXP_C2)));
+	__m256 y = _mm256_set1_ps(EXP_P0);
+	y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(EXP_P1));
+	y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(EXP_P2));
+	y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(EXP_P3));
+	y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(EXP_P4));
+	y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(EXP_P5));
+	y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(y, r), r), r), _mm256_set1_ps(1.0f));
+	__m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23));
+	return _mm256_mul_ps(y, scale);
+}
+
+TARGET_AVX2 void scalar_spring_kernel_avx2(ScalarSpringPool *p, size_t begin, size_t end, uint64_t dt) {
+	float secs = micros_to_secs(dt);
+	__m256 _dt = _mm256_set1_ps(secs);
+	__m256 min_smooth = _mm256_set1_ps(0.0001f);
+	size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 active = active_mask_avx2(&p->enabled[i], &p->owned[i]);
+		if (_mm256_movemask_ps(active) == 0) {
+			continue;
+		}
+		for (size_t j = i; j < i + 8; j++) {
+			p->time[j] += (p->enabled[j] && !p->owned[j]) ? dt : 0;
+		}
+		__m256 smooth = _mm256_loadu_ps(&p->smooth[i]);
+		__m256 goal = _mm256_loadu_ps(&p->goal[i]);
+		__m256 value = _mm256_loadu_ps(&p->value[i]);
+		__m256 v = _mm256_loadu_ps(&p->vel[i]);
+
+		__m256 omega = _mm256_div_ps(_mm256_set1_ps(2.0f), smooth);
+		__m256 ex = exp_approx_avx2(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_mul_ps(omega, _dt)));
+		__m256 ud = _mm256_mul_ps(_dt, _mm256_loadu_ps(&p->undamp[i]));
+
+		__m256 d = _mm256_sub_ps(value, goal);
+		__m256 t = _mm256_mul_ps(_mm256_add_ps(v, _mm256_mul_ps(omega, d)), _dt);
+
+		__m256 new_vel = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v, _mm256_mul_ps(omega, t)), ex), _mm256_mul_ps(v, ud));
+		__m256 new_value = _mm256_add_ps(goal, _mm256_mul_ps(_mm256_add_ps(d, t), ex));
+
+		__m256 snap = _mm256_cmp_ps(smooth, min_smooth, _CMP_LT_OQ);
+		new_vel = _mm256_blendv_ps(new_vel, _mm256_setzero_ps(), snap);
+		new_value = _mm256_blendv_ps(new_value, goal, snap);
+
+		_mm256_storeu_ps(&p->vel[i], _mm256_blendv_ps(v, new_vel, active));
+		_mm256_storeu_ps(&p->value[i], _mm256_blendv_ps(value, new_value, active));
+	}
+	scalar_spring_kernel_scalar(p, i, end, dt);
+}
+
+#endif
+
+void scalar_spring_advance_range(ScalarSpringPool *p, size_t begin, size_t end, uint64_t dt) {
+	if (!scalar_spring_kernel) {
+		set_simd_level(detect_simd_level());
+	}
+	scalar_spring_kernel(p, begin, end, dt);
+}
+
+void scalar_spring_pool_advance(ScalarSpringPool *p, uint64_t dt) {
+	scalar_spring_advance_range(p, 0, p->active, dt);
+}
+
+//--ScalarGoalFollower
+
+void set_new_goal(ScalarGoalFollowerPool *p, size_t i) {
+	size_t n = p->region_count[i];
+	if (n > 0) {
+		if (p->random_region[i]) {
+			p->current_region[i] = (size_t)(rng_float(&p->rng[i]) * n);
+		}
+		else if (p->current_region[i] + 1 < n) {
+			p->current_region[i] += 1;
+		}
+		else {
+			p->current_region[i] = 0;
+		}
+
+		ValueRange *region = &p->regions[i][p->current_region[i]];
+		float goal = 0.0;
+		if (region->max > region->min) {
+			goal = rng_range(&p->rng[i], *region);
+		}
+		else {
+			goal = region->min;
+		}
+		dispatch_set_goal(p->follower[i], goal);
+	}
+}
+
+//The follower is advanced by the goal follower only, never by the pool it lives in.
+//It is moved into the pools of the goal follower.
+void set_follower(Modulator *m, Modulator *follower) {
+	assert(m->type == SCALARGOALFOLLOWER);
+	wake_modulator(m);
+	Modulator *old = POOLED(m, scalar_goal_follower, follower);
+	if (old) {
+		set_owned(old, false);
+		old->owner = NULL;
+	}
+	POOLED(m, scalar_goal_follower, follower) = follower;
+	if (follower) {
+		if (follower->owner && follower->owner != m) {
+			POOLED(follower->owner, scalar_goal_follower, follower) = NULL;
+		}
+		follower->owner = m;
+		pools_move(m->pools, follower);
+		set_owned(follower, true);
+	}
+}
+
+//Add a region the goal follower picks its goals from
+void add_region(Modulator *m, ValueRange region) {
+	assert(m->type == SCALARGOALFOLLOWER);
+	ScalarGoalFollowerPool *p = &m->pools->scalar_goal_follower;
+	size_t i = m->slot;
+	size_t n = p->region_count[i];
+	if (n >= SIZE_MAX / sizeof(ValueRange) - 1) {
+		return; //n + 1 regions would not fit in memory
+	}
+	if (n == 0 || n == side_buffer_cap(n)) {
+		ValueRange *regions = alloc_side_buffer(&m->pools->arena, n + 1, sizeof(ValueRange));
+		if (n > 0) {
+			memcpy(regions, p->regions[i], n * sizeof(ValueRange));
+			release_side_buffer(&m->pools->arena, p->regions[i], n, sizeof(ValueRange));
+		}
+		p->regions[i] = regions;
+	}
+	p->regions[i][n] = region;
+	p->region_count[i] = n + 1;
+}
+
+float scalar_goal_follower_val(Modulator *m) {
+	if (POOLED(m, scalar_goal_follower, follower)) {
+		return dispatch_value(POOLED(m, scalar_goal_follower, follower));
+	}
+	else return 0.0;
+
+}
+
+ValueRange scalar_goal_follower_range(Modulator *m) {
+	ValueRange *regions = POOLED(m, scalar_goal_follower, regions);
+	size_t n = POOLED(m, scalar_goal_follower, region_count);
+	ValueRange r = { 0.0, 0.0 };
+	if (n > 0) {
+		r = regions[0];
+	}
+
+	for (size_t i = 1; i < n; i++) {
+		if (regions[i].min < r.min) {
+			r.min = regions[i].min;
+		}
+		if (regions[i].max > r.max) {
+			r.max = regions[i].max;
+		}
+	}
+	return r;
+}
+
+//Without a follower (not set yet, or removed) the goal is 0 and setting it does nothing, like the value
+float scalar_goal_follower_goal(Modulator *m) {
+	Modulator *follower = POOLED(m, scalar_goal_follower, follower);
+	return follower ? dispatch_goal(follower) : 0.0f;
+}
+
+void scalar_goal_follower_set_goal(Modulator *m, float goal) {
+	Modulator *follower = POOLED(m, scalar_goal_follower, follower);
+	if (follower) {
+		dispatch_set_goal(follower, goal);
+	}
+}
+
+uint64_t scalar_goal_follower_elapsed_us(Modulator *m) {
+	return POOLED(m, scalar_goal_follower, time);
+}
+
+bool scalar_goal_follower_enabled(Modulator *m) {
+	return POOLED(m, scalar_goal_follower, enabled);
+}
+
+void scalar_goal_follower_set_enabled(Modulator *m, bool enabled) {
+	POOLED(m, scalar_goal_follower, enabled) = enabled;
+}
+
+//The follower is owned, so it never sleeps and only the goal follower advances it: its implementation
+//is called directly, without the waking, recording and counting of the public functions
+static inline void scalar_goal_follower_step(ScalarGoalFollowerPool *p, size_t i, uint64_t dt) {
+	p->time[i] += dt;
+
+	Modulator *follower = p->follower[i];
+	if (!follower) {
+		return;
+	}
+
+	if (p->paused_left[i] > 0) {
+		p->paused_left[i] -= (uint64_t)MIN((p->paused_left[i]), dt);
+	}
+	else {
+		float p0 = dispatch_value(follower);
+		dispatch_advance(follower, dt);
+		float p1 = dispatch_value(follower);
+		float secs = micros_to_secs(dt);
+		float vel = 0.0;
+		if (secs > FLT_MIN) {
+			vel = (p1 - p0) / secs;
+		}
+		else {
+			vel = 0.0;
+		}
+
+		if (fabsf(p1 - dispatch_goal(follower)) > p->threshold[i] || fabsf(vel) > p->vel_threshold[i]) {
+			return; //Still moving towards goal
+		}
+		if (p->pause_range[i].max > p->pause_range[i].min) {
+			p->paused_left[i] = (uint64_t)rng_range(&p->rng[i], p->pause_range[i]);
+		}
+		else {
+			p->paused_left[i] = p->pause_range[i].min;
+		}
+	}
+
+	if (p->paused_left[i] == 0) {
+		set_new_goal(p, i); //done pausing, resume following
+	}
+}
+
+DEFINE_STEP_LOOPS(scalar_goal_follower, ScalarGoalFollowerPool, scalar_goal_follower)
+
+//--Newtonian
+//
+//move_to picks a speed limit, acceleration and deceleration and compiles the trapezoidal (or, when the
+//speed limit is not reached, triangular) profile of the move into segments once. Every tick then only
+//selects the segment the time falls in and evaluates its quadratic, without branches in the SIMD kernels.
+//A move always starts from rest; a new goal during a move starts over from the current value.
+//
+
+//Acceleration and deceleration used for 0, practically instant
+#define NEWTONIAN_INSTANT 1000000.0f
+//Longest move in us, 2^52 (over a century) so that times before the end convert to double exactly
+#define NEWTONIAN_MAX_US 4503599627370496.0
+
+//At rest at value, nothing left to move
+static inline void newtonian_rest(NewtonianPool *p, size_t i, float value) {
+	p->goal[i] = value;
+	p->from[i] = value;
+	p->cruise_from[i] = value;
+	p->decel_from[i] = value;
+	p->half_accel[i] = 0.0f;
+	p->speed[i] = 0.0f;
+	p->half_decel[i] = 0.0f;
+	p->accel_end[i] = 0.0f;
+	p->cruise_end[i] = 0.0f;
+	p->move_end[i] = 0;
+}
+
+//Compile the move from p->from to p->goal. An acceleration or deceleration of 0 is instant,
+//a speed limit of 0 is no limit.
+void newtonian_compile(NewtonianPool *p, size_t i, float speed_limit, float acceleration, float deceleration) {
+	float from = p->from[i];
+	float x = fabsf(p->goal[i] - from);
+	float a = acceleration > FLT_EPSILON ? acceleration : NEWTONIAN_INSTANT;
+	float d = deceleration > FLT_EPSILON ? deceleration : NEWTONIAN_INSTANT;
+	float r = a / d;
+
+	//accelerate for ta and decelerate for ta * r to cover x, unless the speed limit is reached first
+	float ta = sqrtf(2.0f * x / (a * (1.0f + r)));
+	float v = a * ta;
+	if (speed_limit > FLT_EPSILON && v > speed_limit) {
+		v = speed_limit;
+		ta = v / a;
+	}
+	float td = ta * r;
+	float cruise = v > 0.0f ? MAX(0.0f, (x - 0.5f * a * ta * ta - 0.5f * d * td * td) / v) : 0.0f;
+
+	float dir = p->goal[i] >= from ? 1.0f : -1.0f;
+	p->half_accel[i] = dir * 0.5f * a;
+	p->speed[i] = dir * v;
+	p->half_decel[i] = -dir * 0.5f * d;
+	p->accel_end[i] = ta;
+	p->cruise_end[i] = ta + cruise;
+	p->move_end[i] = (uint64_t)MIN(ceil(((double)ta + cruise + td) * 1e6), NEWTONIAN_MAX_US);
+	p->cruise_from[i] = from + p->half_accel[i] * ta * ta;
+	p->decel_from[i] = p->cruise_from[i] + p->speed[i] * cruise;
+}
+
+//Seconds since move_to, infinity once the move is over so the float stays small however long it waits.
+//Before the end the time fits an int64_t, which converts in one instruction where uint64_t does not.
+static inline float newtonian_clock(NewtonianPool *p, size_t i) {
+	return p->time[i] >= p->move_end[i] ? INFINITY : (float)((double)(int64_t)p->time[i] * 1e-6);
+}
+
+//Position at t seconds into the move: the quadratic of the segment t falls in, the goal once it is over
+static inline float newtonian_segment(NewtonianPool *p, size_t i, float t) {
+	bool cruising = t >= p->accel_end[i];
+	bool decelerating = t >= p->cruise_end[i];
+	bool arrived = t == INFINITY;
+	float origin = decelerating ? p->cruise_end[i] : cruising ? p->accel_end[i] : 0.0f;
+	float base = decelerating ? p->decel_from[i] : cruising ? p->cruise_from[i] : p->from[i];
+	float vel = cruising ? p->speed[i] : 0.0f;
+	float half = decelerating ? p->half_decel[i] : cruising ? 0.0f : p->half_accel[i];
+	float tau = t - origin;
+	return arrived ? p->goal[i] : base + tau * (vel + tau * half);
+}
+
+static inline float newtonian_eval(NewtonianPool *p, size_t i) {
+	return newtonian_segment(p, i, newtonian_clock(p, i));
+}
+
+//Bring the cached value of a lazy modulator up to date
+static inline float newtonian_materialize(NewtonianPool *p, size_t i) {
+	if (!p->valid[i]) {
+		p->value[i] = newtonian_eval(p, i);
+		p->valid[i] = true;
+	}
+	return p->value[i];
+}
+
+void reset(Modulator *m, float value) {
+	assert(m->type == NEWTONIAN);
+	RECORD_BEGIN(m, TRACE_RESET, value, 0);
+	wake_modulator(m);
+	POOLED(m, newtonian, value) = value;
+	POOLED(m, newtonian, valid) = true;
+	newtonian_rest(&m->pools->newtonian, m->slot, value);
+	RECORD_END();
+}
+
+void move_to(Modulator *m, float goal) {
+	if (m->type == NEWTONIAN) {
+		wake_modulator(m);
+		NewtonianPool *p = &m->pools->newtonian;
+		size_t i = m->slot;
+		newtonian_materialize(p, i);
+		p->time[i] = 0;
+		p->goal[i] = goal;
+		p->from[i] = p->value[i];
+
+		float speed_limit = rng_range(&p->rng[i], p->speed_limit_range[i]);
+		float acceleration = rng_range(&p->rng[i], p->acceleration_range[i]);
+		float deceleration = rng_range(&p->rng[i], p->deceleration_range[i]);
+		newtonian_compile(p, i, speed_limit, acceleration, deceleration);
+	}
+}
+
+float newtonian_val(Modulator *m) {
+	return newtonian_materialize(&m->pools->newtonian, m->slot);
+}
+ValueRange newtonian_range(Modulator *m) {
+	ValueRange r = { 0.0, 0.0 };
+	return r;
+}
+
+float newtonian_goal(Modulator *m) {
+	return POOLED(m, newtonian, goal);
+}
+
+void newtonian_set_goal(Modulator *m, float goal) {
+	move_to(m, goal);
+}
+
+uint64_t newtonian_elapsed_us(Modulator *m) {
+	return POOLED(m, newtonian, time);
+}
+
+bool newtonian_enabled(Modulator *m) {
+	return POOLED(m, newtonian, enabled);
+}
+
+void newtonian_set_enabled(Modulator *m, bool enabled) {
+	POOLED(m, newtonian, enabled) = enabled;
+}
+
+static inline void newtonian_step(NewtonianPool *p, size_t i, uint64_t dt) {
+	p->time[i] += dt;
+	if (p->lazy[i]) {
+		p->valid[i] = false;
+	}
+	else {
+		p->value[i] = newtonian_eval(p, i);
+	}
+}
+
+void newtonian_advance(Modulator *m, uint64_t dt) {
+	newtonian_step(&m->pools->newtonian, m->slot, dt);
+}
+
+//--Newtonian bulk kernels
+//
+//Advance the newtonians [begin, end) of a pool that share the same dt. The AVX2 kernel also vectorizes
+//the clocks: 64 bit times, the comparison with move_end and the conversion to seconds, which is exact
+//below 2^52 us (newtonian_compile keeps move_end below that). Lanes that arrived evaluate to infinity
+//or NaN before the goal is selected for them. SSE2 has no 64 bit compare, its per lane clocks were no
+//faster than the scalar kernel, which it uses.
+//
+
+void newtonian_kernel_scalar(NewtonianPool *p, size_t begin, size_t end, uint64_t dt) {
+	for (size_t i = begin; i < end; i++) {
+		if (p->enabled[i] && !p->owned[i]) {
+			newtonian_step(p, i, dt);
+		}
+	}
+}
+
+#if MOD_X86
+
+//Both 8 byte groups of bools from the same lanes: lanes where enabled && !owned are valid unless lazy, the rest keep theirs
+static inline void newtonian_lane_valid(NewtonianPool *p, size_t i) {
+	const uint64_t ones = 0x0101010101010101ull;
+	uint64_t enabled, owned, lazy, valid;
+	memcpy(&enabled, &p->enabled[i], 8);
+	memcpy(&owned, &p->owned[i], 8);
+	memcpy(&lazy, &p->lazy[i], 8);
+	memcpy(&valid, &p->valid[i], 8);
+	uint64_t active = enabled & ~owned & ones;
+	valid = (active & ~lazy & ones) | (~active & valid);
+	memcpy(&p->valid[i], &valid, 8);
+}
+
+//Advance the times of 4 lanes by dt where mask is set, their seconds into the move or infinity once it is over
+static inline TARGET_AVX2 __m128 newtonian_clocks_avx2(NewtonianPool *p, size_t i, __m128i mask, __m256i dt) {
+	__m256i time = _mm256_loadu_si256((const __m256i *)&p->time[i]);
+	time = _mm256_add_epi64(time, _mm256_and_si256(_mm256_cvtepi32_epi64(mask), dt));
+	_mm256_storeu_si256((__m256i *)&p->time[i], time);
+	__m256i running = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *)&p->move_end[i]), time);
+	//2^52 + time as the bits of a double, less 2^52
+	__m256d two52 = _mm256_set1_pd(NEWTONIAN_MAX_US);
+	__m256d us = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(time, _mm256_castpd_si256(two52))), two52);
+	__m256d secs = _mm256_blendv_pd(_mm256_set1_pd(INFINITY), _mm256_mul_pd(us, _mm256_set1_pd(1e-6)), _mm256_castsi256_pd(running));
+	return _mm256_cvtpd_ps(secs);
+}
+
+TARGET_AVX2 void newtonian_kernel_avx2(NewtonianPool *p, size_t begin, size_t end, uint64_t dt) {
+	__m256i step = _mm256_set1_epi64x((int64_t)dt);
+	size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 active = active_mask_avx2(&p->enabled[i], &p->owned[i]);
+		if (_mm256_movemask_ps(active) == 0) {
+			continue;
+		}
+		newtonian_lane_valid(p, i);
+		__m256i lanes = _mm256_castps_si256(active);
+		__m128 lo = newtonian_clocks_avx2(p, i, _mm256_castsi256_si128(lanes), step);
+		__m128 hi = newtonian_clocks_avx2(p, i + 4, _mm256_extracti128_si256(lanes, 1), step);
+		__m256 t = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+		active = _mm256_andnot_ps(lane_mask_avx2(&p->lazy[i]), active);
+
+		__m256 accel_end = _mm256_loadu_ps(&p->accel_end[i]);
+		__m256 cruise_end = _mm256_loadu_ps(&p->cruise_end[i]);
+		__m256 cruising = _mm256_cmp_ps(t, accel_end, _CMP_GE_OQ);
+		__m256 decelerating = _mm256_cmp_ps(t, cruise_end, _CMP_GE_OQ);
+		__m256 arrived = _mm256_cmp_ps(t, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ);
+
+		__m256 origin = _mm256_blendv_ps(_mm256_and_ps(cruising, accel_end), cruise_end, decelerating);
+		__m256 base = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_loadu_ps(&p->from[i]), _mm256_loadu_ps(&p->cruise_from[i]), cruising), _mm256_loadu_ps(&p->decel_from[i]), decelerating);
+		__m256 vel = _mm256_and_ps(cruising, _mm256_loadu_ps(&p->speed[i]));
+		__m256 half = _mm256_blendv_ps(_mm256_andnot_ps(cruising, _mm256_loadu_ps(&p->half_accel[i])), _mm256_loadu_ps(&p->half_decel[i]), decelerating);
+		__m256 tau = _mm256_sub_ps(t, origin);
+		__m256 v = _mm256_add_ps(base, _mm256_mul_ps(tau, _mm256_add_ps(vel, _mm256_mul_ps(tau, half))));
+		v = _mm256_blendv_ps(v, _mm256_loadu_ps(&p->goal[i]), arrived);
+		_mm256_storeu_ps(&p->value[i], _mm256_blendv_ps(_mm256_loadu_ps(&p->value[i]), v, active));
+	}
+	newtonian_kernel_scalar(p, i, end, dt);
+}
+
+#endif
+
+//Select the kernels of the given level, or of the best level the cpu supports if it is lower
+void set_simd_level(SimdLevel level) {
+	SimdLevel supported = detect_simd_level();
+	simd_level = level < supported ? level : supported;
+	switch (simd_level) {
+#if MOD_X86
+	case(SIMD_AVX2):
+		wave_kernel = wave_kernel_avx2;
+		scalar_spring_kernel = scalar_spring_kernel_avx2;
+		newtonian_kernel = newtonian_kernel_avx2;
+		break;
+	case(SIMD_SSE2):
+		wave_kernel = wave_kernel_sse2;
+		scalar_spring_kernel = scalar_spring_kernel_sse2;
+		newtonian_kernel = newtonian_kernel_scalar;
+		break;
+#endif
+	case(SIMD_SCALAR):
+	default:
+		wave_kernel = wave_kernel_scalar;
+		scalar_spring_kernel = scalar_spring_kernel_scalar;
+		newtonian_kernel = newtonian_kernel_scalar;
+		break;
+	}
+}
+
+void newtonian_advance_range(NewtonianPool *p, size_t begin, size_t end, uint64_t dt) {
+	if (!newtonian_kernel) {
+		set_simd_level(detect_simd_level());
+	}
+	newtonian_kernel(p, begin, end, dt);
+}
+
+void newtonian_pool_advance(NewtonianPool *p, uint64_t dt) {
+	newtonian_advance_range(p, 0, p->active, dt);
+}
+
+//--ShiftRegister
+
+float *new_buckets(ModArena *arena, size_t buckets, ValueRange value_range, ModRng *rng) {
+	if (buckets == 0) {
+		return NULL;
+	}
+	float *buffer = alloc_side_buffer(arena, buckets, sizeof(float));
+	rng_fill(rng, buffer, buckets, value_range);
+	return buffer;
+}
+
+// Total time of a shift register loop (period) in microseconds
+uint64_t total_period(ShiftRegisterPool *p, size_t i) {
+	return (uint64_t)(p->period[i] * 1000000.0);
+}
+
+// Time spent visiting a bucket, in microseconds
+uint64_t bucket_period(ShiftRegisterPool *p, size_t i) {
+	size_t n = p->bucket_count[i];
+	if (n > 0) {
+		return (uint64_t)(total_period(p, i) / n);
+	}
+	else return 0;
+}
+
+// Return the bucket index after the one we are given
+size_t next_bucket(size_t index, size_t n) {
+	assert(n > 0);
+	if (index < n - 1) {
+		return index + 1;
+	}
+	else return 0;
+}
+
+// Return the bucket index before the one we are given
+size_t previous_bucket(size_t index, size_t n) {
+	assert(n > 0);
+	if (index > 0 && index < n) {
+		return index - 1;
+	}
+	else return n - 1;
+}
+
+
+//Change the length of the loop in seconds, it carries on from the same fraction of the loop
+void set_period(Modulator *m, float period) {
+	assert(m->type == SHIFTREGISTER);
+	ShiftRegisterPool *p = &m->pools->shift_register;
+	size_t i = m->slot;
+	uint64_t old_tp = total_period(p, i);
+	uint64_t position = old_tp ? (p->time[i] + p->loop_offset[i]) % old_tp : 0;
+	p->period[i] = period;
+	uint64_t tp = total_period(p, i);
+	if (tp == 0) {
+		return;
+	}
+	uint64_t target = old_tp ? MIN((uint64_t)((double)position / (double)old_tp * (double)tp), tp - 1) : 0;
+	p->loop_offset[i] = (target + tp - p->time[i] % tp) % tp;
+}
+
+//Buckets older than age_range.min visits get increasingly likely to be replaced, certainly at age_range.max
+void set_age_range(Modulator *m, ValueRange age_range) {
+	assert(m->type == SHIFTREGISTER);
+	POOLED(m, shift_register, age_range) = age_range;
+}
+
+float shiftregister_val(Modulator *m) {
+	return POOLED(m, shift_register, value);
+}
+ValueRange shiftregister_range(Modulator *m) {
+	return POOLED(m, shift_register, value_range);
+}
+
+float shiftregister_goal(Modulator *m) {
+	return POOLED(m, shift_register, value);
+}
+
+void shiftregister_set_goal(Modulator *m, float f) {
+}
+
+uint64_t shiftregister_elapsed_us(Modulator *m) {
+	return POOLED(m, shift_register, time);
+}
+
+bool shiftregister_enabled(Modulator *m) {
+	return POOLED(m, shift_register, enabled);
+}
+
+void shiftregister_set_enabled(Modulator *m, bool enabled) {
+	POOLED(m, shift_register, enabled) = enabled;
+}
+
+//Odds that a bucket of the given age is replaced when it is visited; from age_range.min
+//on they rise linearly to 1 at age_range.max
+static inline float bucket_odds(float odds, uint32_t age, ValueRange age_range) {
+	if (age >= age_range.min && age_range.min < age_range.max) {
+		float t = MIN((float)(age - age_range.min) / (age_range.max - age_range.min), 1.0);
+		odds = odds + (1.0 - odds) * t;
+	}
+	return odds;
+}
+
+//Visit a bucket once: replace its value with the given odds or let it age
+static inline void visit_bucket(float *bucket, uint32_t *age, float odds, ValueRange value_range, ModRng *rng) {
+	if (rng_float(rng) < odds) {
+		*bucket = rng_range(rng, value_range);
+		*age = 0;
+	}
+	else {
+		*age += 1;
+	}
+}
+
+//Catch up with large dt: once a step visits more than SHIFT_REGISTER_CATCH_UP_PERIODS periods
+//the state of every bucket after its visits is drawn instead of visiting one by one. The values
+//come out of the random number generator in a different order than visit by visit, so this is off
+//unless set_shift_register_catch_up turns it on.
+#define SHIFT_REGISTER_CATCH_UP_PERIODS 2
+
+//Replacements followed one by one per bucket before its age is drawn from the ages it settles in
+#define SHIFT_REGISTER_CATCH_UP_JUMPS 8
+
+bool shift_register_catch_up = false;
+
+void set_shift_register_catch_up(bool enabled) {
+	shift_register_catch_up = enabled;
+}
+
+//Number of visits in a row that do not replace a bucket, when every visit replaces it with the given odds
+static inline uint64_t bucket_survivals(float odds, ModRng *rng) {
+	if (odds >= 1.0f) {
+		return 0;
+	}
+	if (odds <= 0.0f) {
+		return UINT64_MAX;
+	}
+	double g = floor(log(1.0 - rng_float(rng)) / log(1.0 - odds));
+	return g < 1e18 ? (uint64_t)g : UINT64_MAX;
+}
+
+static inline uint32_t gcd_u32(uint32_t a, uint32_t b) {
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+//The ages of the buckets of a shift register with an age range, built once per catch up and shared
+//by its buckets. survive[a] is the probability that a replaced bucket reaches age a. Replacements
+//only happen a multiple of period visits apart, so ages that settle have weight survive[a] among
+//those congruent to the visits since the last replacement; cumulative sums them per residue.
+typedef struct BucketAges {
+	double *survive; //max_age + 2 entries, the last one 0
+	double *cumulative; //max_age + 1 entries
+	uint32_t max_age;
+	uint32_t period;
+}BucketAges;
+
+static void bucket_ages_init(BucketAges *t, float odds, ValueRange age_range) {
+	uint32_t period = 0;
+	t->survive[0] = 1.0;
+	for (uint32_t a = 0; a <= t->max_age; a++) {
+		double o = a < t->max_age ? bucket_odds(odds, a, age_range) : 1.0;
+		t->survive[a + 1] = t->survive[a] * (1.0 - o);
+		if (t->survive[a + 1] < t->survive[a]) { //a replaced bucket can be replaced again after a + 1 visits
+			period = gcd_u32(period, a + 1);
+		}
+	}
+	t->period = MAX(period, 1u);
+	for (uint32_t a = 0; a <= t->max_age; a++) {
+		t->cumulative[a] = t->survive[a] + (a >= t->period ? t->cumulative[a - t->period] : 0.0);
+	}
+}
+
+//Number of visits up to and including the one that replaces a bucket of the given age
+static uint64_t bucket_replaced_after(const BucketAges *t, uint32_t age, ModRng *rng) {
+	if (age > t->max_age || t->survive[age] <= 0.0) {
+		return 1;
+	}
+	double u = (1.0 - rng_float(rng)) * t->survive[age];
+	uint32_t lo = age + 1;
+	uint32_t hi = t->max_age + 1;
+	while (lo < hi) { //first age it does not survive to
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (t->survive[mid] < u) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
+	}
+	return lo - age;
+}
+
+//Age of a bucket visits visits after a replacement, drawn from the ages it settles in
+static uint32_t settled_bucket_age(const BucketAges *t, uint64_t visits, ModRng *rng) {
+	uint32_t residue = (uint32_t)(visits % t->period);
+	uint32_t last = (uint32_t)MIN(visits, (uint64_t)t->max_age);
+	last -= (last - residue) % t->period;
+	double u = (1.0 - rng_float(rng)) * t->cumulative[last];
+	uint32_t lo = 0;
+	uint32_t hi = (last - residue) / t->period;
+	while (lo < hi) { //first age whose cumulative weight reaches u
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (t->cumulative[residue + mid * t->period] < u) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return residue + lo * t->period;
+}
+
+//Visit a bucket k times at once.
+//With constant odds (no age range) the age after k visits is the number of trailing visits that
+//did not replace it, which is geometric and drawn directly. With an age range the visits up to each
+//replacement are drawn from ages, for the first SHIFT_REGISTER_CATCH_UP_JUMPS replacements; the age
+//after the remaining visits is drawn from the ages a bucket settles in. Either way a bucket costs
+//O(log(age_range.max)), however large k is.
+static void catch_up_bucket(float *bucket, uint32_t *age, uint64_t k, float odds, const BucketAges *ages, ValueRange value_range, ModRng *rng) {
+	if (!ages) {
+		uint64_t survivals = bucket_survivals(odds, rng);
+		if (survivals < k) {
+			*bucket = rng_range(rng, value_range);
+			*age = (uint32_t)survivals;
+		}
+		else {
+			*age = (uint32_t)MIN((uint64_t)*age + k, (uint64_t)UINT32_MAX);
+		}
+		return;
+	}
+
+	uint64_t j = bucket_replaced_after(ages, *age, rng);
+	if (j > k) {
+		*age += (uint32_t)k;
+		return;
+	}
+	k -= j;
+	*bucket = rng_range(rng, value_range);
+	for (int jump = 0; jump < SHIFT_REGISTER_CATCH_UP_JUMPS; jump++) {
+		j = bucket_replaced_after(ages, 0, rng);
+		if (j > k) {
+			*age = (uint32_t)k;
+			return;
+		}
+		k -= j;
+	}
+	*age = settled_bucket_age(ages, k, rng);
+}
+
+static inline void shiftregister_step(ShiftRegisterPool *p, size_t i, uint64_t dt) {
+	float *buckets = p->buckets[i];
+	uint32_t *value_ages = p->value_ages[i];
+	size_t n = p->bucket_count[i];
+	uint64_t tp = total_period(p, i);
+	uint64_t bp = bucket_period(p, i);
+	if (n == 0 || tp == 0 || bp == 0) {
+		return;
+	}
+
+	uint64_t pt = (p->time[i] + p->loop_offset[i]) % tp; //convert accumulated time into period time
+	size_t bi = (size_t)(MIN((size_t)(pt / bp), n - 1)); //current bucket in period
+
+	uint64_t bt = pt - bp * bi; //time aready spent visiting the current bucket
+	uint64_t r = (bt + dt) / bp; //number of buckets we are going to visit
+
+	ValueRange age_range = p->age_range[i];
+	ValueRange value_range = p->value_range[i];
+	float odds = (float)(MIN(MAX(0.0, p->odds[i]), 1.0));
+	ModRng rng = p->rng[i];
+	if (shift_register_catch_up && r > SHIFT_REGISTER_CATCH_UP_PERIODS * n) {
+		BucketAges ages = { 0 };
+		double ages_on_stack[2 * 64 + 1];
+		if (age_range.min < age_range.max) {
+			ages.max_age = (uint32_t)MIN(ceil(age_range.max), (double)(UINT32_MAX - 1));
+			size_t len = 2 * (size_t)ages.max_age + 3;
+			ages.survive = len <= 2 * 64 + 1 ? ages_on_stack : xmalloc(len * sizeof(double));
+			ages.cumulative = ages.survive + ages.max_age + 2;
+			bucket_ages_init(&ages, odds, age_range);
+		}
+		//visit j goes to bucket (bi - 1 + j) % n, so the first r % n buckets from there get one extra visit
+		size_t first = previous_bucket(bi, n);
+		for (size_t j = 0; j < n; j++) {
+			size_t b = (first + j) % n;
+			uint64_t k = r / n + (j < r % n ? 1 : 0);
+			catch_up_bucket(&buckets[b], &value_ages[b], k, odds, ages.survive ? &ages : NULL, value_range, &rng);
+		}
+		if (ages.survive != ages_on_stack) {
+			free(ages.survive);
+		}
+		bi = (size_t)((bi + r) % n);
+	}
+	else {
+		for (uint64_t k = 0; k < r; k++) {
+			size_t bh = previous_bucket(bi, n);
+			visit_bucket(&buckets[bh], &value_ages[bh], bucket_odds(odds, value_ages[bh], age_range), value_range, &rng);
+			bi = next_bucket(bi, n);
+		}
+	}
+	p->rng[i] = rng;
+
+	p->time[i] += dt;
+	switch (p->interp[i]) {
+	case(QUADRATIC): {
+		size_t bh = previous_bucket(bi, n);
+		size_t bj = next_bucket(bi, n);
+
+		float v1 = buckets[bi];
+		float v0 = (buckets[bh] + v1) * 0.5;
+		float v2 = (buckets[bj] + v1) * 0.5;
+
+		uint64_t bt = (uint64_t)((p->time[i] + p->loop_offset[i]) % tp - bp * bi);
+		float tt = (float)bt / (float)bp;
+
+		float a0 = v0 + (v1 - v0) * tt;
+		float a1 = v1 + (v2 - v1) * tt;
+
+		p->value[i] = a0 + (a1 - a0) * tt;
+		break;
+	}
+	case(LINEAR): {
+		float v0 = buckets[bi];
+		float v1 = buckets[next_bucket(bi, n)];
+		uint64_t bt = (uint64_t)((p->time[i] + p->loop_offset[i]) % tp - bp * bi);
+		p->value[i] = v0 + (v1 - v0) * ((float)bt / (float)bp);
+		break;
+	}
+
+	case(NONE):
+	default:
+		p->value[i] = buckets[bi];
+		break;
+	}
+}
+
+DEFINE_STEP_LOOPS(shiftregister, ShiftRegisterPool, shift_register)
+
+//
+//Routes
+//
+//A route drives a parameter of one modulator with the value of another in the same environment.
+//The routes of an environment form a graph that is sorted into a flat schedule once, whenever they
+//change, so every route is applied after the routes into its source. Applying the schedule after the
+//pools are stepped is a single pass over an array, whatever the shape of the graph.
+//A parameter is driven by one route, connecting it again replaces the route.
+//
+
+bool param_applies(ModParam param, ModulatorType type) {
+	switch (param) {
+	case(PARAM_GOAL): return type == SCALARSPRING || type == SCALARGOALFOLLOWER || type == NEWTONIAN;
+	case(PARAM_AMPLITUDE): return type == WAVE;
+	case(PARAM_FREQUENCY): return type == WAVE;
+	case(PARAM_PERIOD): return type == SHIFTREGISTER;
+	default: return false;
+	}
+}
+
+//Drive param of target by value(source) * scale + offset. Both have to be in the same environment.
+//Returns false if they are not or param does not apply to target. A cycle is only found when the
+//routes are compiled, see compile_routes.
+bool connect_modulators(Modulator *source, Modulator *target, ModParam param, float scale, float offset) {
+	if (source == target || source->pools != target->pools || source->pools == &detached_pools || !param_applies(param, target->type)) {
+		return false;
+	}
+	ModRoute route = { source, target, param, scale, offset };
+	buf_push(source->pools->routes, route);
+	source->pools->routes_changed = true;
+	return true;
+}
+
+//Stop driving param of target
+void disconnect_modulator(Modulator *target, ModParam param) {
+	ModulatorPools *pools = target->pools;
+	size_t j = 0;
+	for (size_t i = 0; i < buf_len(pools->routes); i++) {
+		ModRoute r = pools->routes[i];
+		if (r.target != target || r.param != param) {
+			pools->routes[j++] = r;
+		}
+	}
+	if (j != buf_len(pools->routes)) {
+		buf__hdr(pools->routes)->len = j;
+		pools->routes_changed = true;
+	}
+}
+
+//Remove every route from or to m
+void unroute_modulator(ModulatorPools *pools, Modulator *m) {
+	size_t j = 0;
+	for (size_t i = 0; i < buf_len(pools->routes); i++) {
+		ModRoute r = pools->routes[i];
+		if (r.source != m && r.target != m) {
+			pools->routes[j++] = r;
+		}
+	}
+	if (j != buf_len(pools->routes)) {
+		buf__hdr(pools->routes)->len = j;
+		pools->routes_changed = true;
+	}
+}
+
+//Sort the routes into the schedule (Kahn's algorithm), dropping the ones replaced by a later route into
+//the same parameter. Returns false and leaves the schedule empty if the routes have a cycle.
+bool pools_compile_routes(ModulatorPools *pools) {
+	pools->routes_changed = false;
+	pools->routes_cyclic = false;
+	buf_clear(pools->schedule);
+	size_t route_count = buf_len(pools->routes);
+	if (route_count == 0) {
+		return true;
+	}
+
+	//number the modulators in the graph, an index + 1 is stored in the map
+	Map nodes = { 0 };
+	size_t node_count = 0;
+	uint32_t *source_node = xmalloc(route_count * sizeof(uint32_t));
+	uint32_t *target_node = xmalloc(route_count * sizeof(uint32_t));
+	for (size_t k = 0; k < route_count; k++) {
+		Modulator *ends[2] = { pools->routes[k].source, pools->routes[k].target };
+		uint32_t *index[2] = { &source_node[k], &target_node[k] };
+		for (int e = 0; e < 2; e++) {
+			uintptr_t n = (uintptr_t)map_get(&nodes, ends[e]);
+			if (!n) {
+				n = ++node_count;
+				map_put(&nodes, ends[e], (void *)n);
+			}
+			*index[e] = (uint32_t)(n - 1);
+		}
+	}
+
+	//the last route into a parameter wins
+	uint32_t *driver = xcalloc(node_count * PARAM_COUNT, sizeof(uint32_t));
+	for (size_t k = 0; k < route_count; k++) {
+		driver[target_node[k] * PARAM_COUNT + pools->routes[k].param] = (uint32_t)k + 1;
+	}
+	size_t kept = 0;
+	for (size_t k = 0; k < route_count; k++) {
+		if (driver[target_node[k] * PARAM_COUNT + pools->routes[k].param] == k + 1) {
+			pools->routes[kept] = pools->routes[k];
+			source_node[kept] = source_node[k];
+			target_node[kept] = target_node[k];
+			kept++;
+		}
+	}
+	route_count = kept;
+	buf__hdr(pools->routes)->len = kept;
+
+	//routes grouped by source node, and the number of routes into every node
+	size_t *first_out = xcalloc(node_count + 1, sizeof(size_t));
+	uint32_t *in_degree = xcalloc(node_count, sizeof(uint32_t));
+	for (size_t k = 0; k < route_count; k++) {
+		first_out[source_node[k] + 1]++;
+		in_degree[target_node[k]]++;
+	}
+	for (size_t n = 0; n < node_count; n++) {
+		first_out[n + 1] += first_out[n];
+	}
+	uint32_t *out = xmalloc(route_count * sizeof(uint32_t));
+	size_t *fill = xmalloc(node_count * sizeof(size_t));
+	memcpy(fill, first_out, node_count * sizeof(size_t));
+	for (size_t k = 0; k < route_count; k++) {
+		out[fill[source_node[k]]++] = (uint32_t)k;
+	}
+
+	//a node is ready once every route into it is scheduled, then its own routes follow
+	uint32_t *ready = xmalloc(node_count * sizeof(uint32_t));
+	size_t head = 0;
+	size_t tail = 0;
+	for (size_t n = 0; n < node_count; n++) {
+		if (in_degree[n] == 0) {
+			ready[tail++] = (uint32_t)n;
+		}
+	}
+	buf_fit(pools->schedule, route_count);
+	while (head < tail) {
+		uint32_t n = ready[head++];
+		for (size_t e = first_out[n]; e < first_out[n + 1]; e++) {
+			uint32_t k = out[e];
+			buf_push(pools->schedule, pools->routes[k]);
+			if (--in_degree[target_node[k]] == 0) {
+				ready[tail++] = target_node[k];
+			}
+		}
+	}
+	bool acyclic = buf_len(pools->schedule) == route_count;
+	if (!acyclic) {
+		buf_clear(pools->schedule);
+		pools->routes_cyclic = true;
+	}
+
+	free(nodes.keys);
+	free(nodes.vals);
+	free(source_node);
+	free(target_node);
+	free(driver);
+	free(first_out);
+	free(in_degree);
+	free(out);
+	free(fill);
+	free(ready);
+	return acyclic;
+}
+
+static inline void apply_route(const ModRoute *r) {
+	float v = value(r->source) * r->scale + r->offset;
+	Modulator *t = r->target;
+	switch (r->param) {
+	case(PARAM_GOAL):
+		if (goal(t) != v) {
+			set_goal(t, v);
+		}
+		break;
+	case(PARAM_AMPLITUDE):
+		if (POOLED(t, wave, amplitude) != v) {
+			set_amplitude(t, v);
+		}
+		break;
+	case(PARAM_FREQUENCY):
+		if (POOLED(t, wave, frequency) != v) {
+			set_frequency(t, v);
+		}
+		break;
+	case(PARAM_PERIOD):
+		if (POOLED(t, shift_register, period) != v) {
+			set_period(t, v);
+		}
+		break;
+	default:
+		assert(0);
+		break;
+	}
+}
+
+//Apply the routes in dependency order, compiling them first if they changed
+void pools_route(ModulatorPools *pools) {
+	if (pools->routes_changed) {
+		pools_compile_routes(pools);
+	}
+	size_t n = buf_len(pools->schedule);
+	for (size_t k = 0; k < n; k++) {
+		apply_route(&pools->schedule[k]);
+	}
+}
+
+//Advance every enabled, unowned modulator in pools, one type at a time.
+//Goal followers go last, they advance their (owned) followers themselves.
+//Sleepers are skipped: pools_wake_due runs before and pools_settle after the step.
+//The routes are applied after the step, before anything falls asleep.
+void pools_drain_commands(ModulatorPools *pools);
+void pools_publish(ModulatorPools *pools);
+void pools_wake_due(ModulatorPools *pools, uint64_t dt);
+void pools_settle(ModulatorPools *pools, uint64_t dt);
+
+//Advance one pool, timed as a single STATS_POOL_ADVANCE unless nothing in it is awake
+#if MODULATORS_STATS
+#define ADVANCE_POOL(pools, type, pool, advance_pool, dt) \
+	do { \
+		if ((pools)->pool.active) { \
+			STATS_BEGIN(); \
+			advance_pool(&(pools)->pool, dt); \
+			STATS_END(pools, type, STATS_POOL_ADVANCE, (pools)->pool.active); \
+		} \
+	} while (0)
+#else
+#define ADVANCE_POOL(pools, type, pool, advance_pool, dt) advance_pool(&(pools)->pool, dt)
+#endif
+
+void pools_advance(ModulatorPools *pools, uint64_t dt) {
+	pools_drain_commands(pools);
+	RECORD_STEP_BEGIN(pools, dt);
+	pools_wake_due(pools, dt);
+	ADVANCE_POOL(pools, WAVE, wave, wave_pool_advance, dt);
+	ADVANCE_POOL(pools, SCALARSPRING, scalar_spring, scalar_spring_pool_advance, dt);
+	ADVANCE_POOL(pools, NEWTONIAN, newtonian, newtonian_pool_advance, dt);
+	ADVANCE_POOL(pools, SHIFTREGISTER, shift_register, shiftregister_pool_advance, dt);
+	ADVANCE_POOL(pools, SCALARGOALFOLLOWER, scalar_goal_follower, scalar_goal_follower_pool_advance, dt);
+	pools_route(pools);
+	pools_settle(pools, dt);
+	pools_publish(pools);
+	RECORD_STEP_END(pools);
+}
+
+//false for the timers left behind by goal followers that were woken (and maybe put to sleep again),
+//moved or removed since; they stay in the heap until they are due
+static inline bool timer_current(ModulatorPools *pools, SleepTimer timer) {
+	Modulator *m = timer.m;
+	return m->pools == pools && m->type == SCALARGOALFOLLOWER && modulator_asleep(m) && POOLED(m, scalar_goal_follower, enabled) &&
+		POOLED(m, scalar_goal_follower, slept_at) + POOLED(m, scalar_goal_follower, paused_left) == timer.wake_at;
+}
+
+//Wake the goal followers whose pause ends during the coming step of dt. They get the rest of
+//their pause back, so the step ends it exactly as if they had been stepped all along.
+void pools_wake_due(ModulatorPools *pools, uint64_t dt) {
+	while (buf_len(pools->timers) && pools->timers[0].wake_at <= pools->clock + dt) {
+		SleepTimer timer = pop_timer(pools);
+		if (timer_current(pools, timer)) {
+			wake_modulator(timer.m);
+		}
+	}
+}
+
+#define SPRING_REST_EPSILON 1e-6f
+
+//A spring this close to its goal is snapped onto it and no longer moves
+static inline bool scalar_spring_settled(ScalarSpringPool *p, size_t i) {
+	float eps = SPRING_REST_EPSILON * MAX(1.0f, fabsf(p->goal[i]));
+	if (fabsf(p->value[i] - p->goal[i]) <= eps && fabsf(p->vel[i]) <= eps) {
+		p->value[i] = p->goal[i];
+		p->vel[i] = 0.0f;
+		return true;
+	}
+	return false;
+}
+
+//Past the end of its move a newtonian stays at its goal
+static inline bool newtonian_settled(NewtonianPool *p, size_t i) {
+	return p->time[i] >= p->move_end[i];
+}
+
+//Put the awake entries of a pool to sleep when they are disabled or when rested(p, i) holds
+#define SETTLE_POOL(p, prefix, rested) \
+	for (size_t i = 0; i < (p)->active;) { \
+		if (!(p)->owned[i] && (!(p)->enabled[i] || rested((p), i))) { \
+			prefix##_pool_sleep((p), i, pools->clock); \
+			pools->layout++; \
+		} \
+		else { \
+			i++; \
+		} \
+	}
+
+#define NEVER_SETTLED(p, i) false
+
+//Account for a step of dt and put the modulators that stopped changing to sleep
+void pools_settle(ModulatorPools *pools, uint64_t dt) {
+	pools->clock += dt;
+	SETTLE_POOL(&pools->wave, wave, NEVER_SETTLED)
+	SETTLE_POOL(&pools->scalar_spring, scalar_spring, scalar_spring_settled)
+	SETTLE_POOL(&pools->newtonian, newtonian, newtonian_settled)
+	SETTLE_POOL(&pools->shift_register, shift_register, NEVER_SETTLED)
+
+	ScalarGoalFollowerPool *p = &pools->scalar_goal_follower;
+	for (size_t i = 0; i < p->active;) {
+		bool idle = !p->enabled[i] || !p->follower[i];
+		if (p->owned[i] || (!idle && p->paused_left[i] == 0)) {
+			i++;
+			continue;
+		}
+		if (!idle) {
+			push_timer(pools, pools->clock + p->paused_left[i], p->mods[i]);
+		}
+		scalar_goal_follower_pool_sleep(p, i, pools->clock);
+		pools->layout++;
+	}
+}
+
+//
+//Block rendering
+//
+
+//Advance m n times by dt and write its value after every step into out.
+//Same result as alternating advance and value, with the dispatch done once per block.
+void render_block(Modulator *m, uint64_t dt, float *out, size_t n) {
+	wake_modulator(m);
+	size_t i = m->slot;
+	switch (m->type) {
+	case(WAVE): {
+		WavePool *p = &m->pools->wave;
+		for (size_t k = 0; k < n; k++) {
+			p->time[i] += dt;
+			out[k] = wave_eval(p, i);
+		}
+		if (n > 0) {
+			p->value[i] = out[n - 1];
+			p->valid[i] = true;
+		}
+		break;
+	}
+	case(SCALARSPRING): {
+		ScalarSpringPool *p = &m->pools->scalar_spring;
+		for (size_t k = 0; k < n; k++) {
+			scalar_spring_step(p, i, dt);
+			out[k] = p->value[i];
+		}
+		break;
+	}
+	case(SCALARGOALFOLLOWER): {
+		ScalarGoalFollowerPool *p = &m->pools->scalar_goal_follower;
+		for (size_t k = 0; k < n; k++) {
+			scalar_goal_follower_step(p, i, dt);
+			out[k] = p->follower[i] ? value(p->follower[i]) : 0.0f;
+		}
+		break;
+	}
+	case(NEWTONIAN): {
+		NewtonianPool *p = &m->pools->newtonian;
+		for (size_t k = 0; k < n; k++) {
+			p->time[i] += dt;
+			out[k] = newtonian_eval(p, i);
+		}
+		if (n > 0) {
+			p->value[i] = out[n - 1];
+			p->valid[i] = true;
+		}
+		break;
+	}
+	case(SHIFTREGISTER): {
+		ShiftRegisterPool *p = &m->pools->shift_register;
+		for (size_t k = 0; k < n; k++) {
+			shiftregister_step(p, i, dt);
+			out[k] = p->value[i];
+		}
+		break;
+	}
+	default: assert(0); break;
+	}
+}
+
+
+//
+//Modulator constructors
+//
+
+
+//Modulator handles are handed out from slabs and recycled through a free list (linked by next)
+
+#define MODULATOR_SLAB_SIZE 1024
+
+Modulator *free_modulators;
+
+//The member arrays of destroyed environments, their handles are reused before the free list
+Modulator ***retired_members;
+
+void release_retired_id(Modulator *m);
+
+Modulator *alloc_modulator(void) {
+	Modulator *mod = NULL;
+	while (!mod && buf_len(retired_members)) {
+		Modulator **members = retired_members[buf_len(retired_members) - 1];
+		if (buf_len(members)) {
+			mod = members[--buf__hdr(members)->len];
+			if (mod) { //else a hole, see unlink_modulator
+				release_retired_id(mod);
+			}
+		}
+		else {
+			buf_free(members);
+			buf__hdr(retired_members)->len--;
+		}
+	}
+	if (!mod) {
+		if (!free_modulators) {
+			Modulator *slab = xmalloc(MODULATOR_SLAB_SIZE * sizeof(Modulator));
+			for (size_t i = 0; i < MODULATOR_SLAB_SIZE; i++) {
+				slab[i].next = free_modulators;
+				free_modulators = &slab[i];
+			}
+		}
+		mod = free_modulators;
+		free_modulators = mod->next;
+	}
+	memset(mod, 0, sizeof(Modulator));
+	return mod;
+}
+
+//Hand all modulators of pools back at once, alloc_modulator reuses them one by one
+void retire_modulators(ModulatorPools *pools) {
+	if (pools->members) {
+		buf_push(retired_members, pools->members);
+		pools->members = NULL;
+	}
+}
+
+//Functions of every type, indexed by ModulatorType
+const ModulatorFunctions modulator_functions_of[] = {
+	{ wave_val, wave_range, wave_goal, wave_set_goal, wave_elapsed_us, wave_enabled, wave_set_enabled, wave_advance },
+	{ scalar_spring_val, scalar_spring_range, scalar_spring_goal, scalar_spring_set_goal, scalar_spring_elapsed_us, scalar_spring_enabled, scalar_spring_set_enabled, scalar_spring_advance },
+	{ scalar_goal_follower_val, scalar_goal_follower_range, scalar_goal_follower_goal, scalar_goal_follower_set_goal, scalar_goal_follower_elapsed_us, scalar_goal_follower_enabled, scalar_goal_follower_set_enabled, scalar_goal_follower_advance },
+	{ newtonian_val, newtonian_range, newtonian_goal, newtonian_set_goal, newtonian_elapsed_us, newtonian_enabled, newtonian_set_enabled, newtonian_advance },
+	{ shiftregister_val, shiftregister_range, shiftregister_goal, shiftregister_set_goal, shiftregister_elapsed_us, shiftregister_enabled, shiftregister_set_enabled, shiftregister_advance },
+};
+
+Modulator *new_modulator(const char *name, ModulatorType type, const ModulatorFunctions *functions) {
+	Modulator *mod = alloc_modulator();
+	memcpy((void *)&mod->modulator_functions, &functions, sizeof(functions));
+	mod->name = intern_name(name);
+	mod->id = INVALID_ID;
+	mod->type = type;
+	pools_add(&detached_pools, mod);
+	return mod;
+}
+
+Modulator *wave_modulator(const char *name, float amplitude, float frequency) {
+	Modulator *m = new_modulator(name, WAVE, &modulator_functions_of[WAVE]);
+	POOLED(m, wave, amplitude) = amplitude;
+	POOLED(m, wave, frequency) = frequency;
+	POOLED(m, wave, phase_offset) = 0.0;
+	POOLED(m, wave, shape) = SINE;
+	POOLED(m, wave, table) = NULL;
+	POOLED(m, wave, table_len) = 0;
+	POOLED(m, wave, time) = 0;
+	POOLED(m, wave, value) = 0.0;
+	POOLED(m, wave, enabled) = true;
+	POOLED(m, wave, lazy) = false;
+	POOLED(m, wave, valid) = true;
+	return m;
+}
+
+
+Modulator *scalar_spring(const char *name, float smooth, float undamp, float initial) {
+	Modulator *m = new_modulator(name, SCALARSPRING, &modulator_functions_of[SCALARSPRING]);
+	POOLED(m, scalar_spring, smooth) = smooth;
+	POOLED(m, scalar_spring, undamp) = undamp;
+	POOLED(m, scalar_spring, goal) = initial;
+	POOLED(m, scalar_spring, value) = initial;
+	POOLED(m, scalar_spring, vel) = 0.0;
+	POOLED(m, scalar_spring, time) = 0;
+	POOLED(m, scalar_spring, enabled) = true;
+	return m;
+}
+
+Modulator *scalar_goal_follower(const char *name) {
+	Modulator *m = new_modulator(name, SCALARGOALFOLLOWER, &modulator_functions_of[SCALARGOALFOLLOWER]);
+	POOLED(m, scalar_goal_follower, regions) = NULL;
+	POOLED(m, scalar_goal_follower, region_count) = 0;
+	POOLED(m, scalar_goal_follower, random_region) = false;
+	POOLED(m, scalar_goal_follower, threshold) = 0.01;
+	POOLED(m, scalar_goal_follower, vel_threshold) = 0.0001;
+	POOLED(m, scalar_goal_follower, pause_range) = (ValueRange){ 0, 0 };
+	POOLED(m, scalar_goal_follower, follower) = NULL;
+	POOLED(m, scalar_goal_follower, current_region) = 0;
+	POOLED(m, scalar_goal_follower, paused_left) = 0;
+	POOLED(m, scalar_goal_follower, time) = 0;
+	POOLED(m, scalar_goal_follower, enabled) = true;
+	POOLED(m, scalar_goal_follower, rng) = rng_default();
+	return m;
+}
+
+
+Modulator *newtonian(const char *name, ValueRange speed_limit_range, ValueRange acceleration_range, ValueRange deceleration_range, float initial) {
+	Modulator *m = new_modulator(name, NEWTONIAN, &modulator_functions_of[NEWTONIAN]);
+	POOLED(m, newtonian, speed_limit_range) = speed_limit_range;
+	POOLED(m, newtonian, acceleration_range) = acceleration_range;
+	POOLED(m, newtonian, deceleration_range) = deceleration_range;
+	POOLED(m, newtonian, goal) = initial;
+	POOLED(m, newtonian, value) = initial;
+	POOLED(m, newtonian, time) = 0;
+	POOLED(m, newtonian, enabled) = true;
+	newtonian_rest(&m->pools->newtonian, m->slot, initial);
+	POOLED(m, newtonian, lazy) = false;
+	POOLED(m, newtonian, valid) = true;
+	POOLED(m, newtonian, rng) = rng_default();
+	return m;
+}
+
+Modulator *shift_register(const char *name, size_t buckets, ValueRange value_range, float odds, float period, ShiftRegisterInterp interp) {
+	Modulator *m = new_modulator(name, SHIFTREGISTER, &modulator_functions_of[SHIFTREGISTER]);
+
+	POOLED(m, shift_register, rng) = rng_default();
+	float *bucket_values = new_buckets(&m->pools->arena, buckets, value_range, &POOLED(m, shift_register, rng));
+
+	float v;
+	if (buckets > 0) {
+		 v = bucket_values[0];
+	}
+	else {
+		v = 0.0;
+	}
+
+	uint32_t *value_ages = NULL; //an age value for each bucket
+	if (buckets > 0) {
+		value_ages = alloc_side_buffer(&m->pools->arena, buckets, sizeof(uint32_t));
+		memset(value_ages, 0, buckets * sizeof(uint32_t));
+	}
+
+	POOLED(m, shift_register, buckets) = bucket_values;
+	POOLED(m, shift_register, value_ages) = value_ages;
+	POOLED(m, shift_register, bucket_count) = buckets;
+	POOLED(m, shift_register, value_range) = value_range;
+	POOLED(m, shift_register, odds) = odds;
+	POOLED(m, shift_register, age_range) = (ValueRange){ UINT32_MAX, UINT32_MAX };
+	POOLED(m, shift_register, period) = period;
+	POOLED(m, shift_register, loop_offset) = 0;
+	POOLED(m, shift_register, interp) = interp;
+	POOLED(m, shift_register, time) = 0;
+	POOLED(m, shift_register, value) = v;
+	POOLED(m, shift_register, enabled) = true;
+	return m;
+}
+
+//
+//ModulatorEnvirnment HashMap for managing Modulators
+//
+
+typedef struct ModulatorEnvironment {
+	const char* name;
+	EnvId id;
+	size_t live; //index in live_environments
+	Map modulator_map; //may still hold the names of modulators that left, see forget_modulator_name
+	size_t stale_names;
+	ModulatorPools pools;
+} ModulatorEnvironment;
+
+Map env_map; //may still hold the names of destroyed environments, see forget_environment_name
+size_t stale_environment_names;
+
+//Registry of the entries ids refer to. Free slots are handed out again oldest first and only once
+//there are at least min_free of them, so a slot comes around rarely. Once it has gone through all
+//its generations it is retired for good, a stale id never resolves to a later entry.
+typedef struct IdRegistry {
+	void **entries; //NULL for free slots
+	uint32_t *generations; //RETIRED_GENERATION for slots that are not handed out again
+	uint32_t *free_slots; //queue of freed slots, from free_head on
+	size_t free_head;
+	size_t min_free;
+}IdRegistry;
+
+#define RETIRED_GENERATION UINT32_MAX
+
+static inline uint32_t id_index(uint64_t id) {
+	return (uint32_t)(id & ID_INDEX_MASK);
+}
+
+static inline uint32_t id_generation(uint64_t id) {
+	return (uint32_t)(id >> ID_INDEX_BITS);
+}
+
+static inline uint64_t make_id(uint32_t index, uint32_t generation) {
+	return (uint64_t)generation << ID_INDEX_BITS | index;
+}
+
+//NULL for INVALID_ID and for ids whose slot was freed since
+void *registry_get(const IdRegistry *r, uint64_t id) {
+	uint32_t i = id_index(id);
+	return i < buf_len(r->entries) && r->generations[i] == id_generation(id) ? r->entries[i] : NULL;
+}
+
+//Register entry under a new id, INVALID_ID once all slots are taken
+uint64_t registry_add(IdRegistry *r, void *entry) {
+	while (buf_len(r->free_slots) - r->free_head > r->min_free) {
+		uint32_t i = r->free_slots[r->free_head++];
+		if (r->free_head * 2 >= buf_len(r->free_slots)) { //the queue is half consumed, move the rest to the front
+			size_t left = buf_len(r->free_slots) - r->free_head;
+			memmove(r->free_slots, r->free_slots + r->free_head, left * sizeof(uint32_t));
+			buf__hdr(r->free_slots)->len = left;
+			r->free_head = 0;
+		}
+		if (!r->entries[i]) { //else registry_restore took it back in the meantime
+			r->entries[i] = entry;
+			return make_id(i, r->generations[i]);
+		}
+	}
+	if (buf_len(r->entries) >= ID_INDEX_MASK) {
+		return INVALID_ID;
+	}
+	buf_push(r->entries, entry);
+	buf_push(r->generations, 0);
+	return make_id((uint32_t)buf_len(r->entries) - 1, 0);
+}
+
+//Free the slot of id, it no longer resolves
+void registry_release(IdRegistry *r, uint64_t id) {
+	uint32_t i = id_index(id);
+	r->entries[i] = NULL;
+	if (++r->generations[i] != RETIRED_GENERATION) {
+		buf_push(r->free_slots, i);
+	}
+}
+
+//Register entry under id again, which works if its slot was freed and not handed out since.
+//Snapshots use it to keep the ids they were taken with.
+bool registry_restore(IdRegistry *r, uint64_t id, void *entry) {
+	uint32_t i = id_index(id);
+	if (id_generation(id) == RETIRED_GENERATION || i >= buf_len(r->entries) || r->entries[i] || r->generations[i] != id_generation(id) + 1) {
+		return false;
+	}
+	r->entries[i] = entry;
+	r->generations[i] = id_generation(id);
+	return true;
+}
+
+IdRegistry environment_registry = { .min_free = 16 };
+IdRegistry modulator_registry = { .min_free = 1024 };
+
+//The environments that exist, dense; destroying one moves the last one into its place
+ModulatorEnvironment **live_environments;
+
+//Environments are recycled rather than freed, so the handles of the modulators of a destroyed
+//environment still point to pools that can be read (see get_modulator)
+ModulatorEnvironment **free_environments;
+
+ModulatorEnvironment *alloc_environment(void) {
+	ModulatorEnvironment *env = buf_len(free_environments) ? free_environments[--buf__hdr(free_environments)->len] : xmalloc(sizeof(ModulatorEnvironment));
+	memset(env, 0, sizeof(ModulatorEnvironment));
+	return env;
+}
+
+//Make env, which has its name and id, one of the live environments
+void enter_environment(ModulatorEnvironment *env) {
+	map_put(&env_map, env->name, env);
+	env->live = buf_len(live_environments);
+	buf_push(live_environments, env);
+}
+
+ModulatorEnvironment *create_environment(const char *environment_name) {
+	ModulatorEnvironment *new_env = alloc_environment();
+	new_env->name = intern_name(environment_name);
+	new_env->id = registry_add(&environment_registry, new_env);
+	assert(new_env->id != INVALID_ID);
+	enter_environment(new_env);
+	return new_env;
+}
+
+ModulatorEnvironment *get_environment(EnvId id) {
+	return registry_get(&environment_registry, id);
+}
+
+//The modulators of a destroyed environment keep their ids until their handles are reused, so an id
+//only resolves to a modulator that is still a member of its pools
+Modulator *get_modulator(ModId id) {
+	Modulator *m = registry_get(&modulator_registry, id);
+	return m && m->pools && m->member < buf_len(m->pools->members) && m->pools->members[m->member] == m ? m : NULL;
+}
+
+//Release the id a reused handle kept when its environment was destroyed, unless a restored
+//snapshot took the id back in the meantime
+void release_retired_id(Modulator *m) {
+	if (m->id != INVALID_ID && registry_get(&modulator_registry, m->id) == m) {
+		registry_release(&modulator_registry, m->id);
+	}
+}
+
+//The environment whose pools these are, NULL for the detached pools
+ModulatorEnvironment *pools_environment(ModulatorPools *pools) {
+	return pools != &detached_pools ? (ModulatorEnvironment *)((char *)pools - offsetof(ModulatorEnvironment, pools)) : NULL;
+}
+
+//Name to id lookups, meant for setup time. INVALID_ID if there is no such environment or modulator.
+EnvId find_environment(const char *environment_name) {
+	const char *name = find_name(environment_name);
+	ModulatorEnvironment *env = name ? map_get(&env_map, name) : NULL;
+	//a stale entry points to a destroyed environment (or to its recycled struct)
+	return env && env->id != INVALID_ID && env->name == name ? env->id : INVALID_ID;
+}
+
+ModId find_modulator(EnvId env_id, const char *modulator_name) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	const char *name = find_name(modulator_name);
+	Modulator *m = env && name ? map_get(&env->modulator_map, name) : NULL;
+	//a stale entry points to a modulator that left (or to its recycled handle)
+	return m && m->pools == &env->pools && m->name == name ? m->id : INVALID_ID;
+}
+
+//Id of the environment with the given name, the environment is created if it does not exist yet
+EnvId environment_id(const char *environment_name) {
+	EnvId id = find_environment(environment_name);
+	return id != INVALID_ID ? id : create_environment(environment_name)->id;
+}
+
+//The name of env, which is being destroyed, no longer maps to it. Like forget_modulator_name the entry
+//stays until there are more stale entries than live ones, then the map is built again.
+void forget_environment_name(ModulatorEnvironment *env) {
+	if (map_get(&env_map, env->name) != env) {
+		return;
+	}
+	if (++stale_environment_names * 2 <= env_map.len) {
+		return;
+	}
+	free(env_map.keys);
+	free(env_map.vals);
+	memset(&env_map, 0, sizeof(Map));
+	stale_environment_names = 0;
+	for (size_t k = 0; k < buf_len(live_environments); k++) {
+		if (live_environments[k] != env) {
+			map_put(&env_map, live_environments[k]->name, live_environments[k]);
+		}
+	}
+}
+
+//The name of m, which leaves env, no longer maps to it. Removing it from the map would build the map
+//again, so the entry stays (find_modulator sees that m left) until there are more stale entries than
+//live ones; then the map is built again from the modulators of env.
+void forget_modulator_name(ModulatorEnvironment *env, Modulator *m) {
+	if (map_get(&env->modulator_map, m->name) != m) {
+		return;
+	}
+	if (++env->stale_names * 2 <= env->modulator_map.len) {
+		return;
+	}
+	free(env->modulator_map.keys);
+	free(env->modulator_map.vals);
+	memset(&env->modulator_map, 0, sizeof(Map));
+	env->stale_names = 0;
+	for (size_t k = 0; k < buf_len(env->pools.members); k++) {
+		Modulator *member = env->pools.members[k];
+		if (member && member != m && member->id != INVALID_ID) {
+			map_put(&env->modulator_map, member->name, member);
+		}
+	}
+}
+
+//Adding a modulator moves its state into the pools of the environment.
+//A modulator belongs to at most one environment, it keeps its id when it moves to another one.
+//INVALID_ID if there is no such environment or all ids are taken.
+ModId add_modulator_id(EnvId env_id, Modulator *modulator) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return INVALID_ID;
+	}
+	if (modulator->pools == &env->pools) {
+		return modulator->id;
+	}
+	if (modulator->id == INVALID_ID) {
+		modulator->id = registry_add(&modulator_registry, modulator);
+		if (modulator->id == INVALID_ID) {
+			return INVALID_ID;
+		}
+	}
+	else if (modulator->pools != &detached_pools) {
+		forget_modulator_name(pools_environment(modulator->pools), modulator);
+	}
+	map_put(&env->modulator_map, modulator->name, modulator);
+	pools_move(&env->pools, modulator);
+	return modulator->id;
+}
+
+ModId add_modulator(const char *environment_name, Modulator *modulator) {
+	return add_modulator_id(environment_id(environment_name), modulator);
+}
+
+//Destroy an environment and all modulators in it. Handles and ids of its modulators become invalid.
+//This does not depend on the number of modulators: their handles are handed back in one piece and their
+//ids are released when the handles are reused, the pools and side buffers go with the arena.
+void destroy_environment_id(EnvId env_id) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return;
+	}
+	registry_release(&environment_registry, env_id);
+	forget_environment_name(env);
+	ModulatorEnvironment *last = live_environments[buf_len(live_environments) - 1];
+	live_environments[env->live] = last;
+	last->live = env->live;
+	buf__hdr(live_environments)->len--;
+	retire_modulators(&env->pools);
+	pools_free(&env->pools);
+	free(env->modulator_map.keys);
+	free(env->modulator_map.vals);
+	env->id = INVALID_ID;
+	buf_push(free_environments, env);
+}
+
+void destroy_environment(const char *environment_name) {
+	destroy_environment_id(find_environment(environment_name));
+}
+
+//Remove m from its environment (or from the modulators not added to one) and recycle it: its id no
+//longer resolves, the last entry of its pool takes its slot and its side buffers are reused by the
+//next ones of their size. Routes from and to m are disconnected. The follower of a goal follower is
+//removed with it, a follower removed by itself is taken from its goal follower first. The wake up
+//timer of a sleeping goal follower stays in the heap until it is due, pools_wake_due skips it.
+//m must not be used afterwards.
+void remove_modulator(Modulator *m) {
+	ModulatorPools *pools = m->pools;
+	if (m->type == SCALARGOALFOLLOWER && POOLED(m, scalar_goal_follower, follower)) {
+		Modulator *follower = POOLED(m, scalar_goal_follower, follower);
+		POOLED(m, scalar_goal_follower, follower) = NULL;
+		follower->owner = NULL;
+		remove_modulator(follower);
+	}
+	if (m->owner) {
+		POOLED(m->owner, scalar_goal_follower, follower) = NULL;
+	}
+	unroute_modulator(pools, m);
+
+	ModArena *arena = &pools->arena;
+	switch (m->type) {
+	case(WAVE):
+		release_side_buffer(arena, POOLED(m, wave, table), POOLED(m, wave, table_len), sizeof(float));
+		wave_pool_remove(&pools->wave, m->slot);
+		break;
+	case(SCALARSPRING): scalar_spring_pool_remove(&pools->scalar_spring, m->slot); break;
+	case(SCALARGOALFOLLOWER):
+		release_side_buffer(arena, POOLED(m, scalar_goal_follower, regions), POOLED(m, scalar_goal_follower, region_count), sizeof(ValueRange));
+		scalar_goal_follower_pool_remove(&pools->scalar_goal_follower, m->slot);
+		break;
+	case(NEWTONIAN): newtonian_pool_remove(&pools->newtonian, m->slot); break;
+	case(SHIFTREGISTER):
+		release_side_buffer(arena, POOLED(m, shift_register, buckets), POOLED(m, shift_register, bucket_count), sizeof(float));
+		release_side_buffer(arena, POOLED(m, shift_register, value_ages), POOLED(m, shift_register, bucket_count), sizeof(uint32_t));
+		shift_register_pool_remove(&pools->shift_register, m->slot);
+		break;
+	default: assert(0); break;
+	}
+	pools->layout++;
+
+	ModulatorEnvironment *env = pools_environment(pools);
+	if (env && m->id != INVALID_ID) {
+		forget_modulator_name(env, m);
+	}
+	if (m->id != INVALID_ID) {
+		registry_release(&modulator_registry, m->id);
+	}
+	unlink_modulator(pools, m);
+	m->pools = NULL;
+	m->next = free_modulators;
+	free_modulators = m;
+}
+
+//false if there is no modulator with this id (any more)
+bool remove_modulator_id(ModId id) {
+	Modulator *m = get_modulator(id);
+	if (!m) {
+		return false;
+	}
+	remove_modulator(m);
+	return true;
+}
+
+//Advance all modulators of an environment, one tight loop per modulator type
+void advance_environment_id(EnvId env_id, uint64_t dt) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (env) {
+		pools_advance(&env->pools, dt);
+	}
+}
+
+//Sort the routes of an environment now rather than at its next step. Returns false if they have a cycle,
+//then none of them are applied until it is broken with disconnect_modulator.
+bool compile_routes(EnvId env_id) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return false;
+	}
+	if (env->pools.routes_changed) {
+		pools_compile_routes(&env->pools);
+	}
+	return !env->pools.routes_cyclic;
+}
+
+void advance_environment(const char *environment_name, uint64_t dt) {
+	advance_environment_id(find_environment(environment_name), dt);
+}
+
+size_t environment_modulator_count_id(EnvId env_id) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	return env ? member_count(&env->pools) : 0;
+}
+
+size_t environment_modulator_count(const char *environment_name) {
+	return environment_modulator_count_id(find_environment(environment_name));
+}
+
+//
+//Iteration
+//
+//Environments and their modulators are kept in dense arrays, the modulators in the order they were added
+//(a goal follower's follower right after it), so going over them touches nothing but live entries.
+//Destroying an environment moves the last one into its place. A removed modulator leaves a hole,
+//the holes are closed before the modulators of an environment are handed out.
+//Creating, destroying, adding or removing while iterating over the same array is not supported.
+//
+//	EnvId env;
+//	for_each_environment(env) {
+//		Modulator *m;
+//		for_each_modulator(m, env) {
+//			...
+//		}
+//	}
+//
+
+size_t environment_count(void) {
+	return buf_len(live_environments);
+}
+
+//The k-th environment, INVALID_ID past the last one
+EnvId environment_at(size_t k) {
+	return k < buf_len(live_environments) ? live_environments[k]->id : INVALID_ID;
+}
+
+//The modulators of an environment in insertion order, count is set to their number.
+//The array is valid until a modulator joins or leaves the environment.
+Modulator *const *environment_modulators(EnvId env_id, size_t *count) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		*count = 0;
+		return NULL;
+	}
+	compact_members(&env->pools);
+	*count = buf_len(env->pools.members);
+	return env->pools.members;
+}
+
+ModIterator iterate_modulators(EnvId env_id) {
+	ModIterator it = { 0 };
+	it.members = environment_modulators(env_id, &it.count);
+	return it;
+}
+
+//Where the value of m can be read without going through value(), NULL for lazy and goal followers
+const float *value_source(Modulator *m) {
+	switch (m->type) {
+	case(WAVE): return POOLED(m, wave, lazy) ? NULL : &POOLED(m, wave, value);
+	case(SCALARSPRING): return &POOLED(m, scalar_spring, value);
+	case(NEWTONIAN): return POOLED(m, newtonian, lazy) ? NULL : &POOLED(m, newtonian, value);
+	case(SHIFTREGISTER): return &POOLED(m, shift_register, value);
+	default: return NULL;
+	}
+}
+
+//Advance an environment n times by dt and write the values of all its modulators after every step,
+//in the order they were added. Planar: out[modulator * n + step], interleaved: out[step * count + modulator].
+//out must hold environment_modulator_count() * n floats; returns the number of modulators.
+size_t render_environment_block_id(EnvId env_id, uint64_t dt, float *out, size_t n, bool interleaved) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return 0;
+	}
+	compact_members(&env->pools);
+	size_t count = buf_len(env->pools.members);
+	Modulator *const *mods = env->pools.members;
+	buf_fit(env->pools.render_sources, count);
+	const float **sources = env->pools.render_sources;
+	size_t j;
+
+	size_t stride = interleaved ? 1 : n;
+	size_t step = interleaved ? count : 1;
+	uint64_t layout = env->pools.layout + 1;
+	for (size_t k = 0; k < n; k++) {
+		pools_advance(&env->pools, dt);
+		if (layout != env->pools.layout) { //modulators fell asleep or woke up, their slots moved
+			layout = env->pools.layout;
+			for (j = 0; j < count; j++) {
+				sources[j] = value_source(mods[j]);
+			}
+		}
+		float *sample = out + k * step;
+		for (j = 0; j < count; j++) {
+			sample[j * stride] = sources[j] ? *sources[j] : value(mods[j]);
+		}
+	}
+	return count;
+}
+
+size_t render_environment_block(const char *environment_name, uint64_t dt, float *out, size_t n, bool interleaved) {
+	return render_environment_block_id(find_environment(environment_name), dt, out, n, interleaved);
+}
+
+//
+//Published values
+//
+//Other threads (render, audio) do not call value() while the environment is being stepped, it reads
+//pool entries that are being written. Once publish_values is called, every step of the environment ends
+//by copying the values of all its modulators, in the order they were added, into one of two cache line
+//aligned arrays. Each array is guarded by a sequence number that is odd while it is being written
+//(a seqlock). The step writes the array that was not published last, so readers of the latest values
+//only have to retry if they are still busy with them a whole step later.
+//
+//Adding, moving or destroying modulators of a publishing environment reallocates the arrays;
+//do it while no one reads.
+//
+
+#define PUBLICATION_ALIGNMENT 64
+
+typedef struct PublishedBuffer {
+	volatile int64_t sequence; //odd while the step writes values
+	float *values;
+	char pad[PUBLICATION_ALIGNMENT - sizeof(int64_t) - sizeof(float *)]; //readers of one buffer do not share a line with the writer of the other
+}PublishedBuffer;
+
+typedef struct Publication {
+	PublishedBuffer buffers[2];
+	volatile int64_t published; //number of publications, the latest is in buffers[(published - 1) & 1]
+	size_t count;
+	void *block; //allocation of both value arrays
+	Modulator **members; //in the order they were added
+	const float **sources; //where value() of a member can be read directly, NULL to call it
+	uint64_t membership; //pools->membership when the members were collected
+	uint64_t layout; //pools->layout when the sources were collected
+}Publication;
+
+void publication_free(Publication *publication) {
+	if (publication) {
+		free(publication->block);
+		buf_free(publication->members);
+		buf_free(publication->sources);
+		free(publication);
+	}
+}
+
+//Collect the members again and size the value arrays for them
+void publication_rebuild(Publication *publication, ModulatorPools *pools) {
+	compact_members(pools);
+	buf_clear(publication->members);
+	for (size_t k = 0; k < buf_len(pools->members); k++) {
+		Modulator *m = pools->members[k];
+		m->published = (uint32_t)k;
+		buf_push(publication->members, m);
+	}
+	size_t count = buf_len(publication->members);
+	buf_fit(publication->sources, count);
+	size_t stride = (MAX(count, (size_t)1) * sizeof(float) + PUBLICATION_ALIGNMENT - 1) & ~(size_t)(PUBLICATION_ALIGNMENT - 1);
+	free(publication->block);
+	publication->block = xmalloc(2 * stride + PUBLICATION_ALIGNMENT);
+	char *base = (char *)(((uintptr_t)publication->block + PUBLICATION_ALIGNMENT - 1) & ~(uintptr_t)(PUBLICATION_ALIGNMENT - 1));
+	publication->buffers[0].values = (float *)base;
+	publication->buffers[1].values = (float *)(base + stride);
+	publication->count = count;
+	publication->membership = pools->membership;
+	publication->layout = pools->layout + 1;
+}
+
+//Write the current values into the buffer that was not published last and publish it
+void pools_publish(ModulatorPools *pools) {
+	Publication *publication = pools->publication;
+	if (!publication) {
+		return;
+	}
+	if (publication->membership != pools->membership) {
+		publication_rebuild(publication, pools);
+	}
+	size_t count = publication->count;
+	if (publication->layout != pools->layout) {
+		publication->layout = pools->layout;
+		for (size_t j = 0; j < count; j++) {
+			publication->sources[j] = value_source(publication->members[j]);
+		}
+	}
+
+	int64_t published = publication->published;
+	PublishedBuffer *buffer = &publication->buffers[published & 1];
+	int64_t sequence = buffer->sequence;
+	atomic_store_i64(&buffer->sequence, sequence + 1);
+	seqlock_fence_release();
+	float *values = buffer->values;
+	for (size_t j = 0; j < count; j++) {
+		const float *source = publication->sources[j];
+		seqlock_store_f32(&values[j], source ? *source : value(publication->members[j]));
+	}
+	atomic_store_i64(&buffer->sequence, sequence + 2);
+	atomic_store_i64(&publication->published, published + 1);
+}
+
+//Publish the values of an environment after every step from now on, starting with the current ones.
+//Returns false if there is no such environment.
+bool publish_values(EnvId env_id) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return false;
+	}
+	if (!env->pools.publication) {
+		Publication *publication = xcalloc(1, sizeof(Publication));
+		publication->membership = env->pools.membership - 1;
+		env->pools.publication = publication;
+		pools_publish(&env->pools);
+	}
+	return true;
+}
+
+//Copy values from the latest publication, retrying if the step overwrites it meanwhile.
+//The values are read and written as relaxed atomics between fences, plain loads and stores on x86.
+//indices NULL copies the first n. Returns the number of the publication the values are from.
+int64_t read_publication(Publication *publication, const uint32_t *indices, size_t n, float *out) {
+	for (;;) {
+		int64_t published = atomic_load_i64(&publication->published);
+		PublishedBuffer *buffer = &publication->buffers[(published - 1) & 1];
+		int64_t sequence = atomic_load_i64(&buffer->sequence);
+		if (sequence & 1) {
+			continue;
+		}
+		const float *values = buffer->values;
+		for (size_t j = 0; j < n; j++) {
+			out[j] = seqlock_load_f32(&values[indices ? indices[j] : j]);
+		}
+		seqlock_fence_acquire();
+		if (atomic_load_i64(&buffer->sequence) == sequence) {
+			return published;
+		}
+	}
+}
+
+//Safe to call from any thread: copy the published values of an environment, in the order its modulators
+//were added, into out (at most capacity). Returns the number of modulators, 0 if it does not publish.
+size_t read_published_values(EnvId env_id, float *out, size_t capacity) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	Publication *publication = env ? env->pools.publication : NULL;
+	if (!publication) {
+		return 0;
+	}
+	read_publication(publication, NULL, MIN(capacity, publication->count), out);
+	return publication->count;
+}
+
+//Safe to call from any thread: the published values of the given modulators, all from the same step.
+//They have to be in the same environment. Returns false if they are not or it does not publish.
+bool read_published(Modulator *const *mods, size_t n, float *out) {
+	Publication *publication = n ? mods[0]->pools->publication : NULL;
+	if (!publication) {
+		return false;
+	}
+	uint32_t indices_on_stack[64];
+	uint32_t *indices = n <= 64 ? indices_on_stack : xmalloc(n * sizeof(uint32_t));
+	bool ok = true;
+	for (size_t j = 0; j < n && ok; j++) {
+		indices[j] = mods[j]->published;
+		ok = mods[j]->pools->publication == publication && indices[j] < publication->count && publication->members[indices[j]] == mods[j];
+	}
+	if (ok) {
+		read_publication(publication, indices, n, out);
+	}
+	if (indices != indices_on_stack) {
+		free(indices);
+	}
+	return ok;
+}
+
+//Safe to call from any thread: the value of m at the end of the last step of its environment,
+//0 if the environment does not publish
+float published_value(Modulator *m) {
+	float v = 0.0f;
+	read_published(&m, 1, &v);
+	return v;
+}
+
+//
+//Command queue
+//
+//Threads that do not step an environment (game logic, network) post set_goal, set_enabled and jump_to
+//for its modulators instead of calling them. The commands go into a bounded ring per environment that
+//any number of threads can post to without locking (Vyukov's bounded queue: every cell carries a
+//sequence number that says whether it is free for the ticket of a producer or holds a command for the
+//consumer). The thread that steps the environment applies them in the order they were posted at the
+//start of the next step, advance_environment and advance_all alike.
+//
+//Posting only reads the registry of environments, so create the environments and their queues before
+//other threads start posting. Commands for modulators that were destroyed or moved to another
+//environment in the meantime are dropped.
+//
+
+typedef struct CommandCell {
+	volatile int64_t sequence; //ticket + 1 when it holds the command of that ticket, ticket when it is free for it
+	Command command;
+}CommandCell;
+
+typedef struct CommandQueue {
+	CommandCell *cells;
+	int64_t mask; //capacity - 1, the capacity is a power of two
+	char pad0[64]; //the producers hammer tail, keep it off the line of the consumer's head
+	volatile int64_t tail; //ticket of the next command posted
+	char pad1[64];
+	int64_t head; //ticket of the next command applied, only touched by the stepping thread
+}CommandQueue;
+
+void command_queue_free(CommandQueue *queue) {
+	if (queue) {
+		free(queue->cells);
+		free(queue);
+	}
+}
+
+//Give an environment a queue for up to capacity (rounded up to a power of two) commands between steps.
+//Returns false if there is no such environment. Does nothing if it already has a queue.
+bool create_command_queue(EnvId env_id, size_t capacity) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return false;
+	}
+	if (env->pools.commands) {
+		return true;
+	}
+	size_t n = 1;
+	while (n < capacity) {
+		n *= 2;
+	}
+	CommandQueue *queue = xcalloc(1, sizeof(CommandQueue));
+	queue->cells = xmalloc(n * sizeof(CommandCell));
+	for (size_t i = 0; i < n; i++) {
+		queue->cells[i].sequence = (int64_t)i;
+	}
+	queue->mask = (int64_t)n - 1;
+	env->pools.commands = queue;
+	return true;
+}
+
+//Safe to call from any thread. Returns false if the environment has no queue or it is full,
+//the command is not posted then.
+bool post_command(EnvId env_id, Command command) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	CommandQueue *queue = env ? env->pools.commands : NULL;
+	if (!queue) {
+		return false;
+	}
+	int64_t ticket = atomic_load_i64(&queue->tail);
+	CommandCell *cell;
+	for (;;) {
+		cell = &queue->cells[ticket & queue->mask];
+		int64_t diff = atomic_load_i64(&cell->sequence) - ticket;
+		if (diff == 0) {
+			if (atomic_cas_i64(&queue->tail, ticket, ticket + 1)) {
+				break;
+			}
+			ticket = atomic_load_i64(&queue->tail);
+		}
+		else if (diff < 0) { //the cell still holds the command of the previous lap
+			return false;
+		}
+		else { //another producer took the ticket
+			ticket = atomic_load_i64(&queue->tail);
+		}
+	}
+	cell->command = command;
+	atomic_store_i64(&cell->sequence, ticket + 1);
+	return true;
+}
+
+bool post_set_goal(EnvId env_id, ModId id, float goal) {
+	return post_command(env_id, (Command){ id, COMMAND_SET_GOAL, goal });
+}
+
+bool post_set_enabled(EnvId env_id, ModId id, bool enabled) {
+	return post_command(env_id, (Command){ id, COMMAND_SET_ENABLED, enabled ? 1.0f : 0.0f });
+}
+
+//Only for scalar springs, the command is dropped for other modulators
+bool post_jump_to(EnvId env_id, ModId id, float goal) {
+	return post_command(env_id, (Command){ id, COMMAND_JUMP_TO, goal });
+}
+
+//Apply the commands posted so far. At most one queue full per step, so producers that keep posting
+//cannot hold up the step.
+void pools_drain_commands(ModulatorPools *pools) {
+	CommandQueue *queue = pools->commands;
+	if (!queue) {
+		return;
+	}
+	for (int64_t n = 0; n <= queue->mask; n++) {
+		CommandCell *cell = &queue->cells[queue->head & queue->mask];
+		if (atomic_load_i64(&cell->sequence) != queue->head + 1) { //empty, or the producer is still writing it
+			break;
+		}
+		Command command = cell->command;
+		atomic_store_i64(&cell->sequence, queue->head + queue->mask + 1);
+		queue->head++;
+
+		Modulator *m = get_modulator(command.id);
+		if (!m || m->pools != pools) {
+			continue;
+		}
+		switch (command.op) {
+		case(COMMAND_SET_GOAL): set_goal(m, command.value); break;
+		case(COMMAND_SET_ENABLED): set_enabled(m, command.value != 0.0f); break;
+		case(COMMAND_JUMP_TO):
+			if (m->type == SCALARSPRING) {
+				jump_to(m, command.value);
+			}
+			break;
+		}
+	}
+}
+
+//
+//Instrumentation dump
+//
+
+#if MODULATORS_STATS
+#if MOD_X86
+#define STATS_CYCLE_UNIT "tsc"
+#elif defined(_WIN32)
+#define STATS_CYCLE_UNIT "qpc"
+#else
+#define STATS_CYCLE_UNIT "ns"
+#endif
+
+//Upper bound of the cycles of the fraction q of the fastest calls, from the histogram
+uint64_t stats_percentile(const ModStats *stats, double q) {
+	uint64_t rank = (uint64_t)ceil(q * (double)stats->calls);
+	uint64_t seen = 0;
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += stats->histogram[b];
+		if (seen >= rank && seen > 0) {
+			return b == STATS_BUCKETS - 1 ? UINT64_MAX : (1ull << b);
+		}
+	}
+	return 0;
+}
+
+void stats_dump_table(FILE *out, const char *scope, ModStats stats[MODULATOR_TYPE_COUNT][STATS_OP_COUNT], bool json, bool *first) {
+	for (int type = 0; type < MODULATOR_TYPE_COUNT; type++) {
+		for (int op = 0; op < STATS_OP_COUNT; op++) {
+			const ModStats *s = &stats[type][op];
+			if (!s->calls) {
+				continue;
+			}
+			if (json) {
+				fprintf(out, "%s\n    {\"type\": \"%s\", \"op\": \"%s\", \"calls\": %llu, \"items\": %llu, \"cycles\": %llu, \"histogram\": [",
+					*first ? "" : ",", modulator_type_names[type], stats_op_names[op], (unsigned long long)s->calls,
+					(unsigned long long)s->items, (unsigned long long)s->cycles);
+				for (int b = 0; b < STATS_BUCKETS; b++) {
+					fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)s->histogram[b]);
+				}
+				fprintf(out, "]}");
+			}
+			else {
+				fprintf(out, "%-24s %-22s %-14s %12llu %14llu %16llu %12.1f %12llu %12llu\n", scope, modulator_type_names[type], stats_op_names[op],
+					(unsigned long long)s->calls, (unsigned long long)s->items, (unsigned long long)s->cycles,
+					s->items ? (double)s->cycles / (double)s->items : 0.0,
+					(unsigned long long)stats_percentile(s, 0.5), (unsigned long long)stats_percentile(s, 0.99));
+			}
+			*first = false;
+		}
+	}
+}
+#endif
+
+//Write what the instrumentation recorded, in total and per environment, as a text table or JSON.
+//The text has the 50th and 99th percentile of the cycles per call (upper bounds of their histogram buckets).
+void stats_dump(FILE *out, bool json) {
+#if MODULATORS_STATS
+	bool first = true;
+	if (json) {
+		fprintf(out, "{\n  \"cycle_unit\": \"" STATS_CYCLE_UNIT "\",\n  \"histogram_buckets\": \"bucket b counts calls of [2^(b-1), 2^b) cycles\",\n  \"total\": [");
+		stats_dump_table(out, NULL, type_stats, true, &first);
+		fprintf(out, "\n  ],\n  \"environments\": [");
+		bool first_env = true;
+		for (size_t i = 0; i < buf_len(live_environments); i++) {
+			ModulatorEnvironment *env = live_environments[i];
+			fprintf(out, "%s\n   {\"name\": \"%s\", \"stats\": [", first_env ? "" : ",", env->name);
+			first = true;
+			stats_dump_table(out, NULL, env->pools.stats, true, &first);
+			fprintf(out, "\n   ]}");
+			first_env = false;
+		}
+		fprintf(out, "\n  ]\n}\n");
+	}
+	else {
+		fprintf(out, "%-24s %-22s %-14s %12s %14s %16s %12s %12s %12s\n", "scope", "type", "op", "calls", "items", "cycles(" STATS_CYCLE_UNIT ")", "cycles/item", "p50<=", "p99<=");
+		stats_dump_table(out, "total", type_stats, false, &first);
+		for (size_t i = 0; i < buf_len(live_environments); i++) {
+			stats_dump_table(out, live_environments[i]->name, live_environments[i]->pools.stats, false, &first);
+		}
+	}
+#else
+	fprintf(out, json ? "{\"enabled\": false}\n" : "built without MODULATORS_STATS\n");
+#endif
+}
+
+//Forget everything recorded so far
+void stats_reset(void) {
+#if MODULATORS_STATS
+	memset(type_stats, 0, sizeof(type_stats));
+	memset(detached_pools.stats, 0, sizeof(detached_pools.stats));
+	for (size_t i = 0; i < buf_len(live_environments); i++) {
+		memset(live_environments[i]->pools.stats, 0, sizeof(live_environments[i]->pools.stats));
+	}
+#endif
+}
+
+//
+//Snapshots
+//
+//snapshot_environment writes an environment into a single little-endian blob without pointers,
+//restore_environment brings it back (replacing an environment of the same name).
+//The pools are stored field by field, in the order of their field lists, so restoring is one copy
+//per field followed by fixups of the pointer fields only: handles become modulator indices,
+//side buffers become offsets into the blob. Offsets are from the start of the blob and 8 byte aligned.
+//A blob is only restored by a build with the same pool layout (SNAPSHOT_VERSION and the layout signature).
+//
+//	SnapshotHeader
+//	SnapshotModulator[modulator_count]   insertion order
+//	pools                                per type: every field array of len entries
+//	SnapshotTimer[timer_count]
+//	SnapshotRoute[route_count]
+//	side buffers and names
+//
+
+#define SNAPSHOT_MAGIC 0x53444f4du //"MODS"
+#define SNAPSHOT_VERSION 3
+
+typedef struct SnapshotPool {
+	uint64_t len;
+	uint64_t active;
+	uint64_t offset;
+}SnapshotPool;
+
+typedef struct SnapshotHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t layout; //signature of the field lists and their sizes
+	uint32_t pad;
+	uint64_t env_id;
+	uint64_t size;
+	uint64_t name; //offset of the environment name
+	uint64_t clock;
+	uint64_t modulator_count;
+	uint64_t modulators;
+	uint64_t timer_count;
+	uint64_t timers;
+	uint64_t route_count;
+	uint64_t routes;
+	SnapshotPool pools[5]; //indexed by ModulatorType
+}SnapshotHeader;
+
+typedef struct SnapshotModulator {
+	uint64_t name;
+	uint64_t id;
+	uint32_t type;
+	uint32_t pad;
+}SnapshotModulator;
+
+typedef struct SnapshotTimer {
+	uint64_t wake_at;
+	uint64_t modulator;
+}SnapshotTimer;
+
+typedef struct SnapshotRoute {
+	uint64_t source; //modulator index + 1
+	uint64_t target;
+	uint32_t param;
+	float scale;
+	float offset;
+	uint32_t pad;
+}SnapshotRoute;
+
+static inline size_t snapshot_align(size_t n) {
+	return (n + 7) & ~(size_t)7;
+}
+
+static inline bool snapshot_little_endian(void) {
+	uint32_t one = 1;
+	return *(unsigned char *)&one == 1;
+}
+
+//Pointers in the pool arrays are stored as 64 bit numbers in their place
+static inline void snapshot_put_u64(char *at, uint64_t v) {
+	memcpy(at, &v, sizeof(v));
+}
+
+static inline uint64_t snapshot_get_u64(const char *at) {
+	uint64_t v;
+	memcpy(&v, at, sizeof(v));
+	return v;
+}
+
+//Where the field arrays of a pool go, generated from its field list
+#define POOL_POSITION(type, name) size_t name;
+#define POOL_PLACE(type, name) at->name = pos; pos += snapshot_align(len * sizeof(type));
+#define POOL_SAVE(type, name) if (p->len > 0) { memcpy(base + at->name, p->name, p->len * sizeof(type)); }
+#define POOL_LOAD(type, name) if (p->len > 0) { memcpy(p->name, base + at->name, p->len * sizeof(type)); }
+#define POOL_SIGNATURE(type, name) h = (h ^ (uint32_t)name_hash(#type " " #name, strlen(#type " " #name))) * 16777619u ^ (uint32_t)sizeof(type);
+
+#define DEFINE_POOL_SNAPSHOT(Pool, prefix, FIELDS) \
+typedef struct Pool##Layout { \
+	FIELDS(POOL_POSITION) \
+}Pool##Layout; \
+\
+/*place the arrays of a pool with len entries from pos on, returns the end*/ \
+size_t prefix##_pool_place(Pool##Layout *at, size_t pos, size_t len) { \
+	FIELDS(POOL_PLACE) \
+	return pos; \
+} \
+\
+void prefix##_pool_save(const Pool *p, const Pool##Layout *at, char *base) { \
+	FIELDS(POOL_SAVE) \
+} \
+\
+void prefix##_pool_load(Pool *p, const Pool##Layout *at, const char *base) { \
+	FIELDS(POOL_LOAD) \
+} \
+\
+uint32_t prefix##_pool_signature(uint32_t h) { \
+	FIELDS(POOL_SIGNATURE) \
+	return h; \
+}
+
+DEFINE_POOL_SNAPSHOT(WavePool, wave, WAVE_FIELDS)
+DEFINE_POOL_SNAPSHOT(ScalarSpringPool, scalar_spring, SCALAR_SPRING_FIELDS)
+DEFINE_POOL_SNAPSHOT(ScalarGoalFollowerPool, scalar_goal_follower, SCALAR_GOAL_FOLLOWER_FIELDS)
+DEFINE_POOL_SNAPSHOT(NewtonianPool, newtonian, NEWTONIAN_FIELDS)
+DEFINE_POOL_SNAPSHOT(ShiftRegisterPool, shift_register, SHIFT_REGISTER_FIELDS)
+
+uint32_t snapshot_layout(void) {
+	uint32_t h = 2166136261u;
+	h = wave_pool_signature(h);
+	h = scalar_spring_pool_signature(h);
+	h = scalar_goal_follower_pool_signature(h);
+	h = newtonian_pool_signature(h);
+	h = shift_register_pool_signature(h);
+	return h;
+}
+
+//Positions of everything in a blob
+typedef struct SnapshotLayout {
+	WavePoolLayout wave;
+	ScalarSpringPoolLayout scalar_spring;
+	ScalarGoalFollowerPoolLayout scalar_goal_follower;
+	NewtonianPoolLayout newtonian;
+	ShiftRegisterPoolLayout shift_register;
+	size_t pools[5];
+	size_t pools_end;
+}SnapshotLayout;
+
+size_t snapshot_place_pools(SnapshotLayout *at, size_t pos, const uint64_t len[5]) {
+	at->pools[WAVE] = pos;
+	pos = wave_pool_place(&at->wave, pos, (size_t)len[WAVE]);
+	at->pools[SCALARSPRING] = pos;
+	pos = scalar_spring_pool_place(&at->scalar_spring, pos, (size_t)len[SCALARSPRING]);
+	at->pools[SCALARGOALFOLLOWER] = pos;
+	pos = scalar_goal_follower_pool_place(&at->scalar_goal_follower, pos, (size_t)len[SCALARGOALFOLLOWER]);
+	at->pools[NEWTONIAN] = pos;
+	pos = newtonian_pool_place(&at->newtonian, pos, (size_t)len[NEWTONIAN]);
+	at->pools[SHIFTREGISTER] = pos;
+	pos = shift_register_pool_place(&at->shift_register, pos, (size_t)len[SHIFTREGISTER]);
+	at->pools_end = pos;
+	return pos;
+}
+
+//Append n bytes to the tail of the blob (only counted when base is NULL), returns their offset + 1, 0 for none
+static uint64_t snapshot_put_tail(char *base, size_t *tail, const void *data, size_t n) {
+	if (n == 0) {
+		return 0;
+	}
+	size_t at = *tail;
+	if (base) {
+		memcpy(base + at, data, n);
+	}
+	*tail += snapshot_align(n);
+	return at + 1;
+}
+
+//Index + 1 of a modulator in insertion order, 0 for NULL
+static uint64_t snapshot_index(Modulator *m) {
+	return m ? (uint64_t)m->member + 1 : 0;
+}
+
+//Write the environment into out if it has room for it; returns the size of the blob, 0 if there is no such environment
+size_t snapshot_environment_id(EnvId env_id, void *out, size_t cap) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env || !snapshot_little_endian()) {
+		return 0;
+	}
+	ModulatorPools *pools = &env->pools;
+
+	//count and place: a modulator's index + 1 in the members is what its handle is replaced by
+	compact_members(pools);
+	uint64_t count = buf_len(pools->members);
+	size_t names = 0;
+	for (size_t k = 0; k < count; k++) {
+		names += snapshot_align(strlen(pools->members[k]->name) + 1);
+	}
+	uint64_t len[5] = { pools->wave.len, pools->scalar_spring.len, pools->scalar_goal_follower.len, pools->newtonian.len, pools->shift_register.len };
+	size_t timer_count = 0;
+	for (size_t i = 0; i < buf_len(pools->timers); i++) {
+		timer_count += timer_current(pools, pools->timers[i]);
+	}
+	size_t route_count = buf_len(pools->routes);
+
+	SnapshotLayout at;
+	size_t modulators = snapshot_align(sizeof(SnapshotHeader));
+	size_t timers = snapshot_place_pools(&at, modulators + snapshot_align(count * sizeof(SnapshotModulator)), len);
+	size_t routes = timers + snapshot_align(timer_count * sizeof(SnapshotTimer));
+	size_t tail = routes + snapshot_align(route_count * sizeof(SnapshotRoute));
+
+	//side buffers and names go to the tail, counted first
+	size_t side = 0;
+	for (size_t i = 0; i < pools->wave.len; i++) {
+		side += snapshot_align(pools->wave.table_len[i] * sizeof(float));
+	}
+	for (size_t i = 0; i < pools->scalar_goal_follower.len; i++) {
+		side += snapshot_align(pools->scalar_goal_follower.region_count[i] * sizeof(ValueRange));
+	}
+	for (size_t i = 0; i < pools->shift_register.len; i++) {
+		side += snapshot_align(pools->shift_register.bucket_count[i] * sizeof(float));
+		side += snapshot_align(pools->shift_register.bucket_count[i] * sizeof(uint32_t));
+	}
+	size_t size = tail + side + names + snapshot_align(strlen(env->name) + 1);
+	if (!out || cap < size) {
+		return size;
+	}
+
+	char *base = out;
+	memset(base, 0, size);
+	SnapshotHeader header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, snapshot_layout(), 0, env->id, size };
+	header.clock = pools->clock;
+	header.modulator_count = count;
+	header.modulators = modulators;
+	header.timer_count = timer_count;
+	header.timers = timers;
+	header.route_count = route_count;
+	header.routes = routes;
+	for (int t = 0; t < 5; t++) {
+		header.pools[t].len = len[t];
+		header.pools[t].offset = at.pools[t];
+	}
+	header.pools[WAVE].active = pools->wave.active;
+	header.pools[SCALARSPRING].active = pools->scalar_spring.active;
+	header.pools[SCALARGOALFOLLOWER].active = pools->scalar_goal_follower.active;
+	header.pools[NEWTONIAN].active = pools->newtonian.active;
+	header.pools[SHIFTREGISTER].active = pools->shift_register.active;
+	header.name = snapshot_put_tail(base, &tail, env->name, strlen(env->name) + 1) - 1;
+
+	SnapshotModulator *records = (SnapshotModulator *)(base + modulators);
+	for (size_t k = 0; k < count; k++) {
+		Modulator *m = pools->members[k];
+		records[k].name = snapshot_put_tail(base, &tail, m->name, strlen(m->name) + 1) - 1;
+		records[k].id = m->id;
+		records[k].type = m->type;
+	}
+
+	SnapshotTimer *timer_records = (SnapshotTimer *)(base + timers);
+	for (size_t i = 0, j = 0; i < buf_len(pools->timers); i++) {
+		if (timer_current(pools, pools->timers[i])) {
+			timer_records[j].wake_at = pools->timers[i].wake_at;
+			timer_records[j++].modulator = snapshot_index(pools->timers[i].m);
+		}
+	}
+
+	SnapshotRoute *route_records = (SnapshotRoute *)(base + routes);
+	for (size_t i = 0; i < route_count; i++) {
+		route_records[i].source = snapshot_index(pools->routes[i].source);
+		route_records[i].target = snapshot_index(pools->routes[i].target);
+		route_records[i].param = pools->routes[i].param;
+		route_records[i].scale = pools->routes[i].scale;
+		route_records[i].offset = pools->routes[i].offset;
+	}
+
+	//fields, then the pointer fields are overwritten by indices and offsets
+	wave_pool_save(&pools->wave, &at.wave, base);
+	scalar_spring_pool_save(&pools->scalar_spring, &at.scalar_spring, base);
+	scalar_goal_follower_pool_save(&pools->scalar_goal_follower, &at.scalar_goal_follower, base);
+	newtonian_pool_save(&pools->newtonian, &at.newtonian, base);
+	shift_register_pool_save(&pools->shift_register, &at.shift_register, base);
+
+	for (size_t i = 0; i < pools->wave.len; i++) {
+		WavePool *p = &pools->wave;
+		snapshot_put_u64(base + at.wave.mods + i * sizeof(Modulator *), snapshot_index(p->mods[i]));
+		snapshot_put_u64(base + at.wave.table + i * sizeof(float *), snapshot_put_tail(base, &tail, p->table[i], p->table_len[i] * sizeof(float)));
+	}
+	for (size_t i = 0; i < pools->scalar_spring.len; i++) {
+		snapshot_put_u64(base + at.scalar_spring.mods + i * sizeof(Modulator *), snapshot_index(pools->scalar_spring.mods[i]));
+	}
+	for (size_t i = 0; i < pools->scalar_goal_follower.len; i++) {
+		ScalarGoalFollowerPool *p = &pools->scalar_goal_follower;
+		snapshot_put_u64(base + at.scalar_goal_follower.mods + i * sizeof(Modulator *), snapshot_index(p->mods[i]));
+		snapshot_put_u64(base + at.scalar_goal_follower.follower + i * sizeof(Modulator *), snapshot_index(p->follower[i]));
+		snapshot_put_u64(base + at.scalar_goal_follower.regions + i * sizeof(ValueRange *), snapshot_put_tail(base, &tail, p->regions[i], p->region_count[i] * sizeof(ValueRange)));
+	}
+	for (size_t i = 0; i < pools->newtonian.len; i++) {
+		snapshot_put_u64(base + at.newtonian.mods + i * sizeof(Modulator *), snapshot_index(pools->newtonian.mods[i]));
+	}
+	for (size_t i = 0; i < pools->shift_register.len; i++) {
+		ShiftRegisterPool *p = &pools->shift_register;
+		snapshot_put_u64(base + at.shift_register.mods + i * sizeof(Modulator *), snapshot_index(p->mods[i]));
+		snapshot_put_u64(base + at.shift_register.buckets + i * sizeof(float *), snapshot_put_tail(base, &tail, p->buckets[i], p->bucket_count[i] * sizeof(float)));
+		snapshot_put_u64(base + at.shift_register.value_ages + i * sizeof(uint32_t *), snapshot_put_tail(base, &tail, p->value_ages[i], p->bucket_count[i] * sizeof(uint32_t)));
+	}
+	memcpy(base, &header, sizeof(header));
+	assert(tail == size);
+	return size;
+}
+
+size_t snapshot_environment(const char *environment_name, void *out, size_t cap) {
+	return snapshot_environment_id(find_environment(environment_name), out, cap);
+}
+
+//Handle of a stored modulator index + 1, NULL for 0 or anything out of range
+static inline Modulator *snapshot_modulator(Modulator **mods, uint64_t count, const char *at) {
+	uint64_t k = snapshot_get_u64(at);
+	return k > 0 && k <= count ? mods[k - 1] : NULL;
+}
+
+//Copy a side buffer stored at offset + 1 into the arena, NULL for 0
+static void *snapshot_side_buffer(ModArena *arena, const char *base, size_t size, const char *at, size_t n, size_t elem_size) {
+	uint64_t offset = snapshot_get_u64(at);
+	if (offset == 0 || n == 0 || n > size / elem_size || offset - 1 > size - n * elem_size) {
+		return NULL;
+	}
+	return copy_side_buffer(arena, base + offset - 1, n, elem_size);
+}
+
+//Recreate the environment in a blob made by snapshot_environment. An environment with the same name
+//is replaced once the whole blob has been found valid, an invalid blob leaves it as it is. The
+//environment and its modulators get their old ids back when those are still free in this process
+//(eg. when rolling back), otherwise they get new ones.
+//With a name the blob is restored as a copy under that name instead, which always gets new ids.
+//Returns the id of the environment, INVALID_ID if the blob is not a valid snapshot for this build.
+EnvId restore_environment_as(const void *blob, size_t size, const char *name) {
+	const char *base = blob;
+	SnapshotHeader header;
+	if (!snapshot_little_endian() || size < sizeof(header)) {
+		return INVALID_ID;
+	}
+	memcpy(&header, base, sizeof(header));
+	if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.layout != snapshot_layout() || header.size > size) {
+		return INVALID_ID;
+	}
+
+	uint64_t len[5];
+	uint64_t total = 0;
+	for (int t = 0; t < 5; t++) {
+		len[t] = header.pools[t].len;
+		total += len[t];
+		if (len[t] > size / sizeof(Modulator *) || header.pools[t].active > len[t]) {
+			return INVALID_ID;
+		}
+	}
+	SnapshotLayout at;
+	size_t modulators = snapshot_align(sizeof(SnapshotHeader));
+	if (header.modulator_count != total || header.modulators != modulators || header.timer_count > size / sizeof(SnapshotTimer) ||
+		header.timers != snapshot_place_pools(&at, modulators + snapshot_align(total * sizeof(SnapshotModulator)), len) ||
+		header.timers + header.timer_count * sizeof(SnapshotTimer) > size || header.route_count > size / sizeof(SnapshotRoute) ||
+		header.routes != header.timers + snapshot_align(header.timer_count * sizeof(SnapshotTimer)) ||
+		header.routes + header.route_count * sizeof(SnapshotRoute) > size || header.name >= size || memchr(base + header.name, 0, size - header.name) == NULL) {
+		return INVALID_ID;
+	}
+	const SnapshotModulator *records = (const SnapshotModulator *)(base + modulators);
+	for (uint64_t k = 0; k < total; k++) {
+		if (records[k].type > SHIFTREGISTER || records[k].name >= size || memchr(base + records[k].name, 0, size - records[k].name) == NULL) {
+			return INVALID_ID;
+		}
+	}
+
+	//the environment is built aside and only takes the place of the one with its name once it is valid
+	bool keep_ids = !name;
+	ModulatorEnvironment *env = alloc_environment();
+	env->name = intern_name(keep_ids ? base + header.name : name);
+	env->id = INVALID_ID;
+	ModulatorPools *pools = &env->pools;
+
+	//handles, they get their ids once the environment is in place
+	Modulator **mods = xmalloc((total + 1) * sizeof(Modulator *));
+	for (uint64_t k = 0; k < total; k++) {
+		Modulator *m = alloc_modulator();
+		const ModulatorFunctions *functions = &modulator_functions_of[records[k].type];
+		memcpy((void *)&m->modulator_functions, &functions, sizeof(functions));
+		m->name = intern_name(base + records[k].name);
+		m->type = (ModulatorType)records[k].type;
+		m->pools = pools;
+		m->id = INVALID_ID;
+		link_modulator(pools, m);
+		mods[k] = m;
+	}
+
+	//pools: one copy per field, then the pointer fields
+	ModArena *arena = &pools->arena;
+	wave_pool_grow(&pools->wave, arena, (size_t)len[WAVE]);
+	scalar_spring_pool_grow(&pools->scalar_spring, arena, (size_t)len[SCALARSPRING]);
+	scalar_goal_follower_pool_grow(&pools->scalar_goal_follower, arena, (size_t)len[SCALARGOALFOLLOWER]);
+	newtonian_pool_grow(&pools->newtonian, arena, (size_t)len[NEWTONIAN]);
+	shift_register_pool_grow(&pools->shift_register, arena, (size_t)len[SHIFTREGISTER]);
+	pools->wave.len = (size_t)len[WAVE];
+	pools->scalar_spring.len = (size_t)len[SCALARSPRING];
+	pools->scalar_goal_follower.len = (size_t)len[SCALARGOALFOLLOWER];
+	pools->newtonian.len = (size_t)len[NEWTONIAN];
+	pools->shift_register.len = (size_t)len[SHIFTREGISTER];
+	pools->wave.active = (size_t)header.pools[WAVE].active;
+	pools->scalar_spring.active = (size_t)header.pools[SCALARSPRING].active;
+	pools->scalar_goal_follower.active = (size_t)header.pools[SCALARGOALFOLLOWER].active;
+	pools->newtonian.active = (size_t)header.pools[NEWTONIAN].active;
+	pools->shift_register.active = (size_t)header.pools[SHIFTREGISTER].active;
+	wave_pool_load(&pools->wave, &at.wave, base);
+	scalar_spring_pool_load(&pools->scalar_spring, &at.scalar_spring, base);
+	scalar_goal_follower_pool_load(&pools->scalar_goal_follower, &at.scalar_goal_follower, base);
+	newtonian_pool_load(&pools->newtonian, &at.newtonian, base);
+	shift_register_pool_load(&pools->shift_register, &at.shift_register, base);
+
+	for (size_t i = 0; i < pools->wave.len; i++) {
+		WavePool *p = &pools->wave;
+		p->mods[i] = snapshot_modulator(mods, total, base + at.wave.mods + i * sizeof(Modulator *));
+		p->table[i] = snapshot_side_buffer(arena, base, size, base + at.wave.table + i * sizeof(float *), p->table_len[i], sizeof(float));
+		p->table_len[i] = p->table[i] ? p->table_len[i] : 0;
+	}
+	for (size_t i = 0; i < pools->scalar_spring.len; i++) {
+		pools->scalar_spring.mods[i] = snapshot_modulator(mods, total, base + at.scalar_spring.mods + i * sizeof(Modulator *));
+	}
+	for (size_t i = 0; i < pools->scalar_goal_follower.len; i++) {
+		ScalarGoalFollowerPool *p = &pools->scalar_goal_follower;
+		p->mods[i] = snapshot_modulator(mods, total, base + at.scalar_goal_follower.mods + i * sizeof(Modulator *));
+		p->follower[i] = snapshot_modulator(mods, total, base + at.scalar_goal_follower.follower + i * sizeof(Modulator *));
+		p->regions[i] = snapshot_side_buffer(arena, base, size, base + at.scalar_goal_follower.regions + i * sizeof(ValueRange *), p->region_count[i], sizeof(ValueRange));
+		p->region_count[i] = p->regions[i] ? p->region_count[i] : 0;
+	}
+	for (size_t i = 0; i < pools->newtonian.len; i++) {
+		pools->newtonian.mods[i] = snapshot_modulator(mods, total, base + at.newtonian.mods + i * sizeof(Modulator *));
+	}
+	for (size_t i = 0; i < pools->shift_register.len; i++) {
+		ShiftRegisterPool *p = &pools->shift_register;
+		p->mods[i] = snapshot_modulator(mods, total, base + at.shift_register.mods + i * sizeof(Modulator *));
+		p->buckets[i] = snapshot_side_buffer(arena, base, size, base + at.shift_register.buckets + i * sizeof(float *), p->bucket_count[i], sizeof(float));
+		p->value_ages[i] = snapshot_side_buffer(arena, base, size, base + at.shift_register.value_ages + i * sizeof(uint32_t *), p->bucket_count[i], sizeof(uint32_t));
+		if (!p->buckets[i] || !p->value_ages[i]) {
+			p->buckets[i] = NULL;
+			p->value_ages[i] = NULL;
+			p->bucket_count[i] = 0;
+		}
+	}
+
+	//every slot must belong to exactly one handle of its type
+	bool valid = true;
+	for (uint64_t k = 0; k < total; k++) {
+		mods[k]->slot = SIZE_MAX;
+	}
+#define SNAPSHOT_CLAIM_SLOTS(pool, TYPE) \
+	for (size_t i = 0; i < pools->pool.len; i++) { \
+		Modulator *m = pools->pool.mods[i]; \
+		if (!m || m->type != TYPE || m->slot != SIZE_MAX) { \
+			valid = false; \
+			break; \
+		} \
+		m->slot = i; \
+	}
+	SNAPSHOT_CLAIM_SLOTS(wave, WAVE)
+	SNAPSHOT_CLAIM_SLOTS(scalar_spring, SCALARSPRING)
+	SNAPSHOT_CLAIM_SLOTS(scalar_goal_follower, SCALARGOALFOLLOWER)
+	SNAPSHOT_CLAIM_SLOTS(newtonian, NEWTONIAN)
+	SNAPSHOT_CLAIM_SLOTS(shift_register, SHIFTREGISTER)
+#undef SNAPSHOT_CLAIM_SLOTS
+
+	for (uint64_t k = 0; k < total; k++) {
+		valid = valid && mods[k]->slot != SIZE_MAX;
+	}
+
+	//a follower is owned and follows exactly one goal follower, an owned modulator is a follower
+	for (size_t i = 0; valid && i < pools->scalar_goal_follower.len; i++) {
+		Modulator *follower = pools->scalar_goal_follower.follower[i];
+		if (follower) {
+			valid = follower->owner == NULL && follower != pools->scalar_goal_follower.mods[i];
+			follower->owner = pools->scalar_goal_follower.mods[i];
+		}
+	}
+	for (uint64_t k = 0; valid && k < total; k++) {
+		valid = modulator_owned(mods[k]) == (mods[k]->owner != NULL);
+	}
+	//and goal followers do not follow each other round in a cycle, which would step and read them forever.
+	//Each walk goes down the followers until it reaches a modulator an earlier walk went through.
+	uint64_t *walked = valid ? xcalloc(total, sizeof(uint64_t)) : NULL;
+	for (uint64_t k = 0; valid && k < total; k++) {
+		Modulator *m = mods[k];
+		while (m && !walked[m->member]) {
+			walked[m->member] = k + 1;
+			m = m->type == SCALARGOALFOLLOWER ? POOLED(m, scalar_goal_follower, follower) : NULL;
+		}
+		valid = !m || walked[m->member] != k + 1;
+	}
+	free(walked);
+	if (!valid) {
+		free(mods);
+		retire_modulators(pools);
+		pools_free(pools);
+		buf_push(free_environments, env);
+		return INVALID_ID;
+	}
+
+	//replace the environment with the same name, under the old id if that was not handed out again
+	destroy_environment(env->name);
+	if (!keep_ids || !registry_restore(&environment_registry, header.env_id, env)) {
+		env->id = registry_add(&environment_registry, env);
+		assert(env->id != INVALID_ID);
+	}
+	else {
+		env->id = header.env_id;
+	}
+	enter_environment(env);
+	for (uint64_t k = 0; k < total; k++) {
+		Modulator *m = mods[k];
+		ModId id = records[k].id;
+		if (keep_ids && id != INVALID_ID && registry_get(&modulator_registry, id) && !get_modulator(id)) {
+			registry_release(&modulator_registry, id); //kept by a modulator of a destroyed environment
+		}
+		if (id != INVALID_ID) {
+			m->id = keep_ids && registry_restore(&modulator_registry, id, m) ? id : registry_add(&modulator_registry, m);
+			map_put(&env->modulator_map, m->name, m);
+		}
+	}
+
+	pools->clock = header.clock;
+	const SnapshotTimer *timer_records = (const SnapshotTimer *)(base + header.timers);
+	for (uint64_t i = 0; i < header.timer_count; i++) {
+		uint64_t k = timer_records[i].modulator;
+		if (k > 0 && k <= total) {
+			push_timer(pools, timer_records[i].wake_at, mods[k - 1]);
+		}
+	}
+	const SnapshotRoute *route_records = (const SnapshotRoute *)(base + header.routes);
+	for (uint64_t i = 0; i < header.route_count; i++) {
+		SnapshotRoute r = route_records[i];
+		if (r.source > 0 && r.source <= total && r.target > 0 && r.target <= total && r.param < PARAM_COUNT) {
+			connect_modulators(mods[r.source - 1], mods[r.target - 1], (ModParam)r.param, r.scale, r.offset);
+		}
+	}
+	free(mods);
+	return env->id;
+}
+
+EnvId restore_environment(const void *blob, size_t size) {
+	return restore_environment_as(blob, size, NULL);
+}
+
+//
+//Recording and replay
+//
+//start_recording logs what drives an environment from outside into a trace: its steps and the calls
+//of set_goal, set_enabled, jump_to, reset and advance on its modulators, including the ones posted as
+//commands. The trace starts with a snapshot of the environment, and another one is taken whenever
+//modulators joined or left it. The generators of the modulators are in the snapshots, so a replay goes
+//through the same states as the recorded session. Changes to the setup (shapes, regions, seeds, routes)
+//are not logged; record_snapshot after them. Calls the modulators make themselves (goal followers
+//setting the goals of their followers, routes) are not logged either, the replay makes them again.
+//
+//A trace is a TraceHeader followed by 16 byte TraceEvents, each TRACE_SNAPSHOT event followed by the
+//snapshot padded to 8 bytes, in the byte order of the machine like the snapshots. replay_trace runs it
+//and can collect the values of all modulators after every step, compare_values diffs two collections
+//within a tolerance. The values are the same bit for bit when the replay runs with the SIMD level of the
+//recording, which is in the header. The replay tool (replay.c) does this on files, and measures how
+//fast the trace is stepped.
+//
+
+#define TRACE_MAGIC 0x52544f4du //"MOTR"
+#define TRACE_VERSION 1
+
+typedef struct TraceHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t simd_level;
+	uint32_t pad;
+}TraceHeader;
+
+typedef struct TraceEvent {
+	uint32_t op; //TraceOp
+	uint32_t member; //index of the modulator in the members of the environment
+	union {
+		uint64_t dt; //TRACE_STEP, TRACE_ADVANCE
+		uint64_t size; //TRACE_SNAPSHOT
+		float value; //TRACE_SET_GOAL, TRACE_SET_ENABLED (0 or 1), TRACE_JUMP_TO, TRACE_RESET
+	};
+}TraceEvent;
+
+typedef struct Recorder {
+	char *trace;
+	uint64_t membership; //of the pools at the last snapshot
+	bool busy; //in a logged call or step, what happens in it is not logged
+}Recorder;
+
+void recorder_free(Recorder *recorder) {
+	if (recorder) {
+		buf_free(recorder->trace);
+		free(recorder);
+	}
+}
+
+//Room for size more bytes at the end of the trace, returns where they go
+char *trace_extend(Recorder *recorder, size_t size) {
+	size_t at = buf_len(recorder->trace);
+	buf_fit(recorder->trace, at + size);
+	buf__hdr(recorder->trace)->len = at + size;
+	return recorder->trace + at;
+}
+
+void trace_event(Recorder *recorder, TraceEvent event) {
+	memcpy(trace_extend(recorder, sizeof(event)), &event, sizeof(event));
+}
+
+void trace_snapshot(ModulatorPools *pools) {
+	Recorder *recorder = pools->recorder;
+	EnvId env_id = pools_environment(pools)->id;
+	size_t size = snapshot_environment_id(env_id, NULL, 0);
+	trace_event(recorder, (TraceEvent){ TRACE_SNAPSHOT, 0, .size = size });
+	char *blob = trace_extend(recorder, snapshot_align(size));
+	snapshot_environment_id(env_id, blob, size);
+	memset(blob + size, 0, snapshot_align(size) - size);
+	recorder->membership = pools->membership;
+}
+
+Recorder *record_call(Modulator *m, TraceOp op, float value, uint64_t dt) {
+	Recorder *recorder = m->pools->recorder;
+	if (recorder->busy) {
+		return NULL;
+	}
+	if (recorder->membership != m->pools->membership) {
+		trace_snapshot(m->pools);
+	}
+	TraceEvent event = { op, (uint32_t)m->member };
+	if (op == TRACE_ADVANCE) {
+		event.dt = dt;
+	}
+	else {
+		event.value = value;
+	}
+	trace_event(recorder, event);
+	recorder->busy = true;
+	return recorder;
+}
+
+void record_step(ModulatorPools *pools, uint64_t dt) {
+	Recorder *recorder = pools->recorder;
+	if (recorder->membership != pools->membership) {
+		trace_snapshot(pools);
+	}
+	trace_event(recorder, (TraceEvent){ TRACE_STEP, 0, .dt = dt });
+	recorder->busy = true;
+}
+
+void record_end(Recorder *recorder) {
+	recorder->busy = false;
+}
+
+//Start logging the environment into a new trace, a recording in progress is discarded
+bool start_recording(EnvId env_id) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (!env) {
+		return false;
+	}
+	recorder_free(env->pools.recorder);
+	Recorder *recorder = xcalloc(1, sizeof(Recorder));
+	TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, (uint32_t)simd_level, 0 };
+	memcpy(trace_extend(recorder, sizeof(header)), &header, sizeof(header));
+	env->pools.recorder = recorder;
+	trace_snapshot(&env->pools);
+	return true;
+}
+
+//Resynchronize the trace after changing the setup of the environment
+void record_snapshot(EnvId env_id) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	if (env && env->pools.recorder) {
+		trace_snapshot(&env->pools);
+	}
+}
+
+//End the recording and hand over the trace, to be released with free(). NULL if nothing was recorded.
+void *stop_recording(EnvId env_id, size_t *size) {
+	ModulatorEnvironment *env = get_environment(env_id);
+	Recorder *recorder = env ? env->pools.recorder : NULL;
+	*size = 0;
+	if (!recorder) {
+		return NULL;
+	}
+	*size = buf_len(recorder->trace);
+	void *trace = xmalloc(*size);
+	memcpy(trace, recorder->trace, *size);
+	recorder_free(recorder);
+	env->pools.recorder = NULL;
+	return trace;
+}
+
+//Append the values of all modulators of env to a collection
+void collect_values(char **values, EnvId env_id) {
+	size_t count;
+	Modulator *const *members = environment_modulators(env_id, &count);
+	size_t at = buf_len(*values);
+	buf_fit(*values, at + sizeof(uint32_t) + count * sizeof(float));
+	buf__hdr(*values)->len = at + sizeof(uint32_t) + count * sizeof(float);
+	uint32_t n = (uint32_t)count;
+	memcpy(*values + at, &n, sizeof(n));
+	float *out = (float *)(*values + at + sizeof(uint32_t));
+	for (size_t k = 0; k < count; k++) {
+		float v = value(members[k]);
+		memcpy(out + k, &v, sizeof(v));
+	}
+}
+
+//A name no environment has, for the copy a trace is replayed in
+const char *replay_environment_name(void) {
+	char name[32];
+	uint64_t k = 0;
+	do {
+		snprintf(name, sizeof(name), "replay_%llu", (unsigned long long)++k);
+	} while (find_environment(name) != INVALID_ID);
+	return intern_name(name);
+}
+
+//Run a trace in a new copy of the recorded environment, with the SIMD level it was recorded with if this
+//machine has it. The copy gets a name of its own (see replay_environment_name) and new ids, so the recorded
+//environment, if it is still around, is left alone. Collects the values after every step into
+//result->values (values_size bytes, free with replay_result_free) if asked to. False if the trace is damaged or does not come from a
+//build with the same snapshot layout.
+bool replay_trace(const void *trace, size_t size, bool collect, ReplayResult *result) {
+	memset(result, 0, sizeof(*result));
+	result->env = INVALID_ID;
+	const char *base = trace;
+	TraceHeader header;
+	if (size < sizeof(header) || ((uintptr_t)trace & 7)) {
+		return false;
+	}
+	memcpy(&header, base, sizeof(header));
+	if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+		return false;
+	}
+	SimdLevel previous_level = simd_level;
+	set_simd_level((SimdLevel)header.simd_level);
+
+	bool ok = true;
+	size_t pos = sizeof(header);
+	while (ok && pos + sizeof(TraceEvent) <= size) {
+		TraceEvent event;
+		memcpy(&event, base + pos, sizeof(event));
+		pos += sizeof(event);
+		if (event.op == TRACE_SNAPSHOT) {
+			ok = event.size <= size - pos;
+			//later snapshots replace the copy made from the first one
+			const char *name = result->env != INVALID_ID ? get_environment(result->env)->name : replay_environment_name();
+			result->env = ok ? restore_environment_as(base + pos, (size_t)event.size, name) : INVALID_ID;
+			ok = result->env != INVALID_ID;
+			pos += ok ? snapshot_align((size_t)event.size) : 0;
+			continue;
+		}
+		size_t count;
+		Modulator *const *members = environment_modulators(result->env, &count);
+		if (event.op == TRACE_STEP) {
+			advance_environment_id(result->env, event.dt);
+			result->steps++;
+			result->modulator_steps += count;
+			if (collect) {
+				collect_values(&result->values, result->env);
+			}
+			continue;
+		}
+		if (event.op >= TRACE_OP_COUNT || event.member >= count) {
+			ok = false;
+			break;
+		}
+		Modulator *m = members[event.member];
+		switch (event.op) {
+		case(TRACE_SET_GOAL): set_goal(m, event.value); break;
+		case(TRACE_SET_ENABLED): set_enabled(m, event.value != 0.0f); break;
+		case(TRACE_JUMP_TO): ok = m->type == SCALARSPRING; if (ok) jump_to(m, event.value); break;
+		case(TRACE_RESET): ok = m->type == NEWTONIAN; if (ok) reset(m, event.value); break;
+		case(TRACE_ADVANCE): advance(m, event.dt); break;
+		default: break;
+		}
+	}
+	set_simd_level(previous_level);
+	result->values_size = buf_len(result->values);
+	return ok && pos == size;
+}
+
+void replay_result_free(ReplayResult *result) {
+	buf_free(result->values);
+	result->values_size = 0;
+}
+
+//Compare two collections of values, true if they have the same steps and modulators and no value differs
+//by more than tolerance. NaNs only match NaNs.
+bool compare_values(const char *expected, size_t expected_size, const char *actual, size_t actual_size, float tolerance, ValueDiff *diff) {
+	memset(diff, 0, sizeof(*diff));
+	size_t pos = 0;
+	for (uint64_t step = 0; pos < expected_size; step++) {
+		uint32_t count;
+		uint32_t actual_count;
+		if (pos + sizeof(count) > expected_size || pos + sizeof(count) > actual_size) {
+			return false;
+		}
+		memcpy(&count, expected + pos, sizeof(count));
+		memcpy(&actual_count, actual + pos, sizeof(actual_count));
+		pos += sizeof(count);
+		if (count != actual_count || count > (expected_size - pos) / sizeof(float) || count > (actual_size - pos) / sizeof(float)) {
+			return false;
+		}
+		for (uint32_t k = 0; k < count; k++, pos += sizeof(float)) {
+			float e;
+			float a;
+			memcpy(&e, expected + pos, sizeof(e));
+			memcpy(&a, actual + pos, sizeof(a));
+			float d = isnan(e) || isnan(a) ? (isnan(e) && isnan(a) ? 0.0f : INFINITY) : fabsf(e - a);
+			diff->largest = MAX(diff->largest, d);
+			if (d > tolerance) {
+				if (diff->mismatches++ == 0) {
+					diff->step = step;
+					diff->modulator = k;
+					diff->expected = e;
+					diff->actual = a;
+				}
+			}
+		}
+	}
+	return pos == actual_size && diff->mismatches == 0;
+}
+
+//
+//Environment loader
+//
+//load_environments builds environments from a JSON description:
+//
+//	{
+//	  "environments": [
+//	    {
+//	      "name": "ambience",
+//	      "modulators": [
+//	        { "name": "wind", "type": "wave", "amplitude": 1, "frequency": 0.25, "shape": "triangle" },
+//	        { "name": "gust", "type": "scalar_goal_follower", "regions": [[0, 0.5], [0.5, 1]], "pause_range": [0.5, 2],
+//	          "follower": { "name": "gust_spring", "type": "scalar_spring", "smooth": 0.3, "undamp": 0.5 } },
+//	        { "name": "birds", "type": "shift_register", "buckets": 8, "value_range": [0, 1], "odds": 0.2, "period": 0.5, "seed": 7 }
+//	      ]
+//	    }
+//	  ]
+//	}
+//
+//The types are named after their constructors, whose arguments are the required keys (see CONFIG_KEYS).
+//A ValueRange is a [min, max] pair. Modulators are added to an existing environment of the same name.
+//Rates, thresholds, durations, speeds and ages can't be negative (their ranges go min first), odds go
+//from 0 to 1 and numbers too large for a float are an error.
+//
+//The parser streams over the text without building a tree and without copying: strings point into
+//the text until their names are interned. It runs twice, the first pass only validates, so a file
+//with an error changes nothing. The error has the line and column (in bytes, from 1) it was found at.
+//This is a subset of JSON: strings have no escapes. // comments are allowed.
+//
+
+#define CONFIG_MAX_DEPTH 16
+
+#define TYPE_BIT(type) (1u << (type))
+#define ANY_TYPE (TYPE_BIT(WAVE) | TYPE_BIT(SCALARSPRING) | TYPE_BIT(SCALARGOALFOLLOWER) | TYPE_BIT(NEWTONIAN) | TYPE_BIT(SHIFTREGISTER))
+
+//key, types it applies to, types that require it
+#define CONFIG_KEYS \
+	X(name, ANY_TYPE, ANY_TYPE) \
+	X(type, ANY_TYPE, ANY_TYPE) \
+	X(enabled, ANY_TYPE, 0) \
+	X(lazy, TYPE_BIT(WAVE) | TYPE_BIT(NEWTONIAN), 0) \
+	X(seed, TYPE_BIT(SCALARGOALFOLLOWER) | TYPE_BIT(NEWTONIAN) | TYPE_BIT(SHIFTREGISTER), 0) \
+	X(amplitude, TYPE_BIT(WAVE), TYPE_BIT(WAVE)) \
+	X(frequency, TYPE_BIT(WAVE), TYPE_BIT(WAVE)) \
+	X(shape, TYPE_BIT(WAVE), 0) \
+	X(table, TYPE_BIT(WAVE), 0) \
+	X(smooth, TYPE_BIT(SCALARSPRING), TYPE_BIT(SCALARSPRING)) \
+	X(undamp, TYPE_BIT(SCALARSPRING), TYPE_BIT(SCALARSPRING)) \
+	X(initial, TYPE_BIT(SCALARSPRING) | TYPE_BIT(NEWTONIAN), 0) \
+	X(goal, TYPE_BIT(SCALARSPRING) | TYPE_BIT(NEWTONIAN), 0) \
+	X(regions, TYPE_BIT(SCALARGOALFOLLOWER), 0) \
+	X(random_region, TYPE_BIT(SCALARGOALFOLLOWER), 0) \
+	X(threshold, TYPE_BIT(SCALARGOALFOLLOWER), 0) \
+	X(vel_threshold, TYPE_BIT(SCALARGOALFOLLOWER), 0) \
+	X(pause_range, TYPE_BIT(SCALARGOALFOLLOWER), 0) \
+	X(follower, TYPE_BIT(SCALARGOALFOLLOWER), 0) \
+	X(speed_limit, TYPE_BIT(NEWTONIAN), TYPE_BIT(NEWTONIAN)) \
+	X(acceleration, TYPE_BIT(NEWTONIAN), TYPE_BIT(NEWTONIAN)) \
+	X(deceleration, TYPE_BIT(NEWTONIAN), TYPE_BIT(NEWTONIAN)) \
+	X(buckets, TYPE_BIT(SHIFTREGISTER), TYPE_BIT(SHIFTREGISTER)) \
+	X(value_range, TYPE_BIT(SHIFTREGISTER), TYPE_BIT(SHIFTREGISTER)) \
+	X(odds, TYPE_BIT(SHIFTREGISTER), TYPE_BIT(SHIFTREGISTER)) \
+	X(period, TYPE_BIT(SHIFTREGISTER), TYPE_BIT(SHIFTREGISTER)) \
+	X(interp, TYPE_BIT(SHIFTREGISTER), 0) \
+	X(age_range, TYPE_BIT(SHIFTREGISTER), 0)
+
+typedef enum ConfigKey {
+#define X(key, types, required) CONFIG_##key,
+	CONFIG_KEYS
+#undef X
+	CONFIG_KEY_COUNT
+}ConfigKey;
+
+typedef struct ConfigKeyInfo {
+	const char *name;
+	size_t len;
+	uint32_t types;
+	uint32_t required;
+}ConfigKeyInfo;
+
+const ConfigKeyInfo config_keys[] = {
+#define X(key, types, required) { #key, sizeof(#key) - 1, types, required },
+	CONFIG_KEYS
+#undef X
+};
+
+const char *config_shape_names[] = { "sine", "triangle", "saw", "square" };
+const char *config_interp_names[] = { "linear", "quadratic", "none" };
+
+typedef struct ConfigString {
+	const char *text;
+	size_t len;
+}ConfigString;
+
+//Where the parser is, saved to report errors at the start of an object or to parse an array again
+typedef struct ConfigPos {
+	const char *at;
+	const char *line_start;
+	int line;
+}ConfigPos;
+
+typedef struct ConfigParser {
+	ConfigPos pos;
+	const char *end;
+	bool build; //false in the validation pass
+	float *table; //scratch buffer for wave tables
+	LoadError *error;
+}ConfigParser;
+
+//Everything a modulator object can say, gathered before the modulator is constructed
+typedef struct ConfigModulator {
+	uint32_t keys; //bit per ConfigKey that was given
+	ConfigPos start;
+	ConfigString name;
+	ModulatorType type;
+	bool enabled;
+	bool lazy;
+	uint64_t seed;
+	float amplitude;
+	float frequency;
+	WaveShape shape;
+	ConfigPos table;
+	float smooth;
+	float undamp;
+	float initial;
+	float goal;
+	ConfigPos regions;
+	bool random_region;
+	float threshold;
+	float vel_threshold;
+	ValueRange pause_range;
+	Modulator *follower;
+	ValueRange speed_limit;
+	ValueRange acceleration;
+	ValueRange deceleration;
+	uint64_t buckets;
+	ValueRange value_range;
+	float odds;
+	float period;
+	ShiftRegisterInterp interp;
+	ValueRange age_range;
+}ConfigModulator;
+
+bool config_fail_at(ConfigParser *p, ConfigPos pos, const char *format, ...) {
+	LoadError *error = p->error;
+	if (error && !error->message[0]) {
+		error->line = pos.line;
+		error->column = (int)(pos.at - pos.line_start) + 1;
+		va_list args;
+		va_start(args, format);
+		vsnprintf(error->message, sizeof(error->message), format, args);
+		va_end(args);
+	}
+	return false;
+}
+
+#define config_fail(p, ...) config_fail_at(p, (p)->pos, __VA_ARGS__)
+
+//Skip whitespace and // comments
+void config_skip(ConfigParser *p) {
+	ConfigPos *pos = &p->pos;
+	while (pos->at < p->end) {
+		char c = *pos->at;
+		if (c == '\n') {
+			pos->line++;
+			pos->line_start = ++pos->at;
+		}
+		else if (c == ' ' || c == '\t' || c == '\r') {
+			pos->at++;
+		}
+		else if (c == '/' && pos->at + 1 < p->end && pos->at[1] == '/') {
+			while (pos->at < p->end && *pos->at != '\n') {
+				pos->at++;
+			}
+		}
+		else {
+			break;
+		}
+	}
+}
+
+//Skip to the next token and return where it starts
+ConfigPos config_here(ConfigParser *p) {
+	config_skip(p);
+	return p->pos;
+}
+
+//Skip to the next token and consume it if it is c
+bool config_accept(ConfigParser *p, char c) {
+	config_skip(p);
+	if (p->pos.at < p->end && *p->pos.at == c) {
+		p->pos.at++;
+		return true;
+	}
+	return false;
+}
+
+bool config_expect(ConfigParser *p, char c) {
+	if (!config_accept(p, c)) {
+		return p->pos.at < p->end ? config_fail(p, "expected '%c'", c) : config_fail(p, "expected '%c' before the end of the text", c);
+	}
+	return true;
+}
+
+//After an element of an array or object: true if another one follows, false at close or on an error
+bool config_next(ConfigParser *p, char close, bool *ok) {
+	if (config_accept(p, ',')) {
+		return true;
+	}
+	*ok = config_expect(p, close);
+	return false;
+}
+
+bool config_string(ConfigParser *p, ConfigString *out) {
+	if (!config_expect(p, '"')) {
+		return false;
+	}
+	const char *start = p->pos.at;
+	const char *s = start;
+	while (s < p->end && *s != '"') {
+		if (*s == '\\') {
+			p->pos.at = s;
+			return config_fail(p, "escapes are not supported");
+		}
+		if ((unsigned char)*s < 0x20) {
+			p->pos.at = s;
+			return config_fail(p, "unterminated string");
+		}
+		s++;
+	}
+	if (s == p->end) {
+		return config_fail(p, "unterminated string");
+	}
+	out->text = start;
+	out->len = (size_t)(s - start);
+	p->pos.at = s + 1;
+	return true;
+}
+
+bool config_string_is(ConfigString s, const char *str, size_t len) {
+	return s.len == len && memcmp(s.text, str, len) == 0;
+}
+
+//Index of the string in names, or -1
+int config_lookup(ConfigString s, const char **names, int count) {
+	for (int i = 0; i < count; i++) {
+		if (config_string_is(s, names[i], strlen(names[i]))) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+bool config_enum(ConfigParser *p, const char *what, const char **names, int count, int *out) {
+	ConfigPos pos = config_here(p);
+	ConfigString s;
+	if (!config_string(p, &s)) {
+		return false;
+	}
+	*out = config_lookup(s, names, count);
+	if (*out < 0) {
+		return config_fail_at(p, pos, "unknown %s '%.*s'", what, (int)MIN(s.len, (size_t)64), s.text);
+	}
+	return true;
+}
+
+bool config_bool(ConfigParser *p, bool *out) {
+	config_skip(p);
+	size_t left = (size_t)(p->end - p->pos.at);
+	if (left >= 4 && memcmp(p->pos.at, "true", 4) == 0) {
+		*out = true;
+		p->pos.at += 4;
+	}
+	else if (left >= 5 && memcmp(p->pos.at, "false", 5) == 0) {
+		*out = false;
+		p->pos.at += 5;
+	}
+	else {
+		return config_fail(p, "expected true or false");
+	}
+	return true;
+}
+
+static inline bool config_digit(ConfigParser *p, const char *s) {
+	return s < p->end && *s >= '0' && *s <= '9';
+}
+
+//A JSON number. Up to 18 significant digits are used, which is plenty for floats.
+bool config_number(ConfigParser *p, double *out) {
+	config_skip(p);
+	const char *s = p->pos.at;
+	bool negative = s < p->end && *s == '-';
+	s += negative;
+	if (!config_digit(p, s)) {
+		return config_fail(p, "expected a number");
+	}
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	for (; config_digit(p, s); s++) {
+		if (mantissa < 100000000000000000ull) {
+			mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+		}
+		else {
+			exponent++;
+		}
+	}
+	if (s < p->end && *s == '.') {
+		s++;
+		if (!config_digit(p, s)) {
+			p->pos.at = s;
+			return config_fail(p, "expected a digit");
+		}
+		for (; config_digit(p, s); s++) {
+			if (mantissa < 100000000000000000ull) {
+				mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+				exponent--;
+			}
+		}
+	}
+	if (s < p->end && (*s == 'e' || *s == 'E')) {
+		s++;
+		int sign = 1;
+		if (s < p->end && (*s == '+' || *s == '-')) {
+			sign = *s++ == '-' ? -1 : 1;
+		}
+		if (!config_digit(p, s)) {
+			p->pos.at = s;
+			return config_fail(p, "expected a digit");
+		}
+		int e = 0;
+		for (; config_digit(p, s); s++) {
+			if (e < 10000) {
+				e = e * 10 + (*s - '0');
+			}
+		}
+		exponent += sign * e;
+	}
+	//powers of ten up to 1e22 are exact doubles, so the common case is a single rounding
+	static const double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	double v = (double)mantissa;
+	if (mantissa == 0) {
+		v = 0.0; //0e999 would be 0 * inf
+	}
+	else if (exponent > 22 || exponent < -22) {
+		v = exponent > 0 ? v * pow(10.0, exponent) : v / pow(10.0, -exponent);
+	}
+	else if (exponent > 0) {
+		v *= powers_of_ten[exponent];
+	}
+	else if (exponent < 0) {
+		v /= powers_of_ten[-exponent];
+	}
+	*out = negative ? -v : v;
+	p->pos.at = s;
+	return true;
+}
+
+bool config_float(ConfigParser *p, float *out) {
+	ConfigPos pos = config_here(p);
+	double v;
+	if (!config_number(p, &v)) {
+		return false;
+	}
+	if (!isfinite(v) || fabs(v) > FLT_MAX) {
+		return config_fail_at(p, pos, "number out of range");
+	}
+	*out = (float)v;
+	return true;
+}
+
+//A float that is not negative, eg. a rate or a threshold
+bool config_nonnegative(ConfigParser *p, float *out) {
+	ConfigPos pos = config_here(p);
+	if (!config_float(p, out)) {
+		return false;
+	}
+	return *out >= 0.0f || config_fail_at(p, pos, "expected a non-negative number");
+}
+
+//Odds from 0 to 1
+bool config_odds(ConfigParser *p, float *out) {
+	ConfigPos pos = config_here(p);
+	if (!config_float(p, out)) {
+		return false;
+	}
+	return (*out >= 0.0f && *out <= 1.0f) || config_fail_at(p, pos, "expected odds from 0 to 1");
+}
+
+//A non-negative integer up to max
+bool config_uint(ConfigParser *p, uint64_t max, uint64_t *out) {
+	config_skip(p);
+	const char *s = p->pos.at;
+	if (!config_digit(p, s)) {
+		return config_fail(p, "expected a non-negative integer");
+	}
+	uint64_t v = 0;
+	for (; config_digit(p, s); s++) {
+		uint64_t d = (uint64_t)(*s - '0');
+		if (v > (max - d) / 10) {
+			return config_fail(p, "integer out of range");
+		}
+		v = v * 10 + d;
+	}
+	if (s < p->end && (*s == '.' || *s == 'e' || *s == 'E')) {
+		return config_fail(p, "expected an integer");
+	}
+	*out = v;
+	p->pos.at = s;
+	return true;
+}
+
+bool config_range(ConfigParser *p, ValueRange *out) {
+	return config_expect(p, '[') && config_float(p, &out->min) && config_expect(p, ',') && config_float(p, &out->max) && config_expect(p, ']');
+}
+
+//A range of durations, speeds or ages: not negative and min first
+bool config_nonnegative_range(ConfigParser *p, ValueRange *out) {
+	ConfigPos pos = config_here(p);
+	if (!config_range(p, out)) {
+		return false;
+	}
+	return (out->min >= 0.0f && out->min <= out->max) || config_fail_at(p, pos, "expected a range of non-negative numbers, min first");
+}
+
+//An array of ranges, added as regions to m unless it is NULL
+bool config_regions(ConfigParser *p, Modulator *m) {
+	if (!config_expect(p, '[')) {
+		return false;
+	}
+	if (config_accept(p, ']')) {
+		return true;
+	}
+	bool ok = true;
+	do {
+		ValueRange region;
+		if (!config_range(p, &region)) {
+			return false;
+		}
+		if (m) {
+			add_region(m, region);
+		}
+	} while (config_next(p, ']', &ok));
+	return ok;
+}
+
+//An array of at least one number, kept in p->table if store is set
+bool config_table(ConfigParser *p, bool store) {
+	buf_clear(p->table);
+	if (!config_expect(p, '[')) {
+		return false;
+	}
+	bool ok = true;
+	do {
+		float v = 0.0f;
+		if (!config_float(p, &v)) {
+			return false;
+		}
+		if (store) {
+			buf_push(p->table, v);
+		}
+	} while (config_next(p, ']', &ok));
+	return ok;
+}
+
+//Parse an array that was validated before again, from where it started
+void config_reparse(ConfigParser *p, ConfigPos at, bool (*parse)(ConfigParser *p, Modulator *m), Modulator *m) {
+	ConfigPos pos = p->pos;
+	p->pos = at;
+	parse(p, m);
+	p->pos = pos;
+}
+
+bool config_table_into(ConfigParser *p, Modulator *m) {
+	if (!config_table(p, true)) {
+		return false;
+	}
+	set_wave_table(m, p->table, buf_len(p->table));
+	return true;
+}
+
+Modulator *config_build_modulator(ConfigParser *p, ConfigModulator *c) {
+	const char *name = intern_name_n(c->name.text, c->name.len);
+	uint32_t keys = c->keys;
+	Modulator *m = NULL;
+	switch (c->type) {
+	case(WAVE):
+		m = wave_modulator(name, c->amplitude, c->frequency);
+		if (keys & (1u << CONFIG_shape)) {
+			set_wave_shape(m, c->shape);
+		}
+		if (keys & (1u << CONFIG_table)) {
+			config_reparse(p, c->table, config_table_into, m);
+		}
+		break;
+	case(SCALARSPRING):
+		m = scalar_spring(name, c->smooth, c->undamp, c->initial);
+		break;
+	case(SCALARGOALFOLLOWER):
+		m = scalar_goal_follower(name);
+		POOLED(m, scalar_goal_follower, random_region) = c->random_region;
+		POOLED(m, scalar_goal_follower, threshold) = c->threshold;
+		POOLED(m, scalar_goal_follower, vel_threshold) = c->vel_threshold;
+		POOLED(m, scalar_goal_follower, pause_range) = c->pause_range;
+		if (keys & (1u << CONFIG_regions)) {
+			config_reparse(p, c->regions, config_regions, m);
+		}
+		break;
+	case(NEWTONIAN):
+		m = newtonian(name, c->speed_limit, c->acceleration, c->deceleration, c->initial);
+		break;
+	case(SHIFTREGISTER):
+		m = shift_register(name, (size_t)c->buckets, c->value_range, c->odds, c->period, c->interp);
+		if (keys & (1u << CONFIG_age_range)) {
+			set_age_range(m, c->age_range);
+		}
+		break;
+	default:
+		assert(0);
+		break;
+	}
+	if (keys & (1u << CONFIG_seed)) {
+		set_seed(m, c->seed);
+	}
+	if (c->follower) {
+		set_follower(m, c->follower);
+	}
+	if (keys & (1u << CONFIG_goal)) {
+		set_goal(m, c->goal);
+	}
+	if (keys & (1u << CONFIG_lazy)) {
+		set_lazy(m, c->lazy);
+	}
+	if (keys & (1u << CONFIG_enabled)) {
+		set_enabled(m, c->enabled);
+	}
+	return m;
+}
+
+//Check the keys of a complete modulator object against its type
+bool config_check_modulator(ConfigParser *p, ConfigModulator *c) {
+	if (!(c->keys & (1u << CONFIG_type))) {
+		return config_fail_at(p, c->start, "modulator without a type");
+	}
+	const char *type_name = modulator_type_names[c->type];
+	for (int k = 0; k < CONFIG_KEY_COUNT; k++) {
+		bool given = (c->keys >> k) & 1;
+		if (given && !(config_keys[k].types & TYPE_BIT(c->type))) {
+			return config_fail_at(p, c->start, "'%s' does not apply to %s", config_keys[k].name, type_name);
+		}
+		if (!given && (config_keys[k].required & TYPE_BIT(c->type))) {
+			return config_fail_at(p, c->start, "%s without '%s'", type_name, config_keys[k].name);
+		}
+	}
+	if (c->type == SHIFTREGISTER && !(c->period > 0.0f)) {
+		return config_fail_at(p, c->start, "shift_register with a period that is not positive");
+	}
+	return true;
+}
+
+bool config_modulator(ConfigParser *p, int depth, Modulator **out);
+
+bool config_modulator_key(ConfigParser *p, ConfigModulator *c, ConfigKey key, int depth) {
+	int index;
+	switch (key) {
+	case(CONFIG_name): return config_string(p, &c->name);
+	case(CONFIG_type): {
+		bool ok = config_enum(p, "modulator type", modulator_type_names, MODULATOR_TYPE_COUNT, &index);
+		c->type = (ModulatorType)index;
+		return ok;
+	}
+	case(CONFIG_enabled): return config_bool(p, &c->enabled);
+	case(CONFIG_lazy): return config_bool(p, &c->lazy);
+	case(CONFIG_seed): return config_uint(p, UINT64_MAX, &c->seed);
+	case(CONFIG_amplitude): return config_float(p, &c->amplitude);
+	case(CONFIG_frequency): return config_float(p, &c->frequency);
+	case(CONFIG_shape): {
+		bool ok = config_enum(p, "shape", config_shape_names, SQUARE + 1, &index);
+		c->shape = (WaveShape)index;
+		return ok;
+	}
+	case(CONFIG_table):
+		c->table = config_here(p);
+		return config_table(p, false);
+	case(CONFIG_smooth): return config_nonnegative(p, &c->smooth);
+	case(CONFIG_undamp): return config_nonnegative(p, &c->undamp);
+	case(CONFIG_initial): return config_float(p, &c->initial);
+	case(CONFIG_goal): return config_float(p, &c->goal);
+	case(CONFIG_regions):
+		c->regions = config_here(p);
+		return config_regions(p, NULL);
+	case(CONFIG_random_region): return config_bool(p, &c->random_region);
+	case(CONFIG_threshold): return config_nonnegative(p, &c->threshold);
+	case(CONFIG_vel_threshold): return config_nonnegative(p, &c->vel_threshold);
+	case(CONFIG_pause_range): return config_nonnegative_range(p, &c->pause_range);
+	case(CONFIG_follower):
+		if (depth >= CONFIG_MAX_DEPTH) {
+			return config_fail(p, "followers nested too deep");
+		}
+		return config_modulator(p, depth + 1, &c->follower);
+	case(CONFIG_speed_limit): return config_nonnegative_range(p, &c->speed_limit);
+	case(CONFIG_acceleration): return config_nonnegative_range(p, &c->acceleration);
+	case(CONFIG_deceleration): return config_nonnegative_range(p, &c->deceleration);
+	case(CONFIG_buckets): {
+		ConfigPos pos = config_here(p);
+		if (!config_uint(p, UINT32_MAX, &c->buckets)) {
+			return false;
+		}
+		return c->buckets > 0 || config_fail_at(p, pos, "a shift_register needs at least one bucket");
+	}
+	case(CONFIG_value_range): return config_range(p, &c->value_range);
+	case(CONFIG_odds): return config_odds(p, &c->odds);
+	case(CONFIG_period): return config_float(p, &c->period);
+	case(CONFIG_interp): {
+		bool ok = config_enum(p, "interp", config_interp_names, NONE + 1, &index);
+		c->interp = (ShiftRegisterInterp)index;
+		return ok;
+	}
+	case(CONFIG_age_range): return config_nonnegative_range(p, &c->age_range);
+	default:
+		assert(0);
+		return false;
+	}
+}
+
+//A modulator object, constructed into *out in the build pass (detached, the caller adds it)
+bool config_modulator(ConfigParser *p, int depth, Modulator **out) {
+	ConfigModulator c = {
+		.enabled = true,
+		.threshold = 0.01f,
+		.vel_threshold = 0.0001f,
+		.interp = LINEAR,
+	};
+	*out = NULL;
+	c.start = config_here(p);
+	if (!config_expect(p, '{')) {
+		return false;
+	}
+	bool ok = true;
+	if (!config_accept(p, '}')) {
+		do {
+			ConfigPos pos = config_here(p);
+			ConfigString name;
+			if (!config_string(p, &name) || !config_expect(p, ':')) {
+				return false;
+			}
+			int key = 0;
+			while (key < CONFIG_KEY_COUNT && !config_string_is(name, config_keys[key].name, config_keys[key].len)) {
+				key++;
+			}
+			if (key == CONFIG_KEY_COUNT) {
+				return config_fail_at(p, pos, "unknown key '%.*s'", (int)MIN(name.len, (size_t)64), name.text);
+			}
+			if (c.keys & (1u << key)) {
+				return config_fail_at(p, pos, "duplicate key '%s'", config_keys[key].name);
+			}
+			c.keys |= 1u << key;
+			if (!config_modulator_key(p, &c, (ConfigKey)key, depth)) {
+				return false;
+			}
+		} while (config_next(p, '}', &ok));
+	}
+	if (!ok || !config_check_modulator(p, &c)) {
+		return false;
+	}
+	if (p->build) {
+		*out = config_build_modulator(p, &c);
+	}
+	return true;
+}
+
+bool config_environment(ConfigParser *p) {
+	ConfigPos start = config_here(p);
+	if (!config_expect(p, '{')) {
+		return false;
+	}
+	EnvId env = INVALID_ID;
+	bool named = false;
+	bool ok = true;
+	if (!config_accept(p, '}')) {
+		do {
+			ConfigPos pos = config_here(p);
+			ConfigString key;
+			if (!config_string(p, &key) || !config_expect(p, ':')) {
+				return false;
+			}
+			if (config_string_is(key, "name", 4)) {
+				if (named) {
+					return config_fail_at(p, pos, "duplicate key 'name'");
+				}
+				ConfigString name;
+				if (!config_string(p, &name)) {
+					return false;
+				}
+				if (p->build) {
+					env = environment_id(intern_name_n(name.text, name.len));
+				}
+				named = true;
+			}
+			else if (config_string_is(key, "modulators", 10)) {
+				if (!named) {
+					return config_fail_at(p, pos, "'name' must come before 'modulators'");
+				}
+				if (!config_expect(p, '[')) {
+					return false;
+				}
+				if (!config_accept(p, ']')) {
+					bool elements_ok = true;
+					do {
+						Modulator *m;
+						if (!config_modulator(p, 0, &m)) {
+							return false;
+						}
+						if (m) {
+							add_modulator_id(env, m);
+						}
+					} while (config_next(p, ']', &elements_ok));
+					if (!elements_ok) {
+						return false;
+					}
+				}
+			}
+			else {
+				return config_fail_at(p, pos, "unknown key '%.*s'", (int)MIN(key.len, (size_t)64), key.text);
+			}
+		} while (config_next(p, '}', &ok));
+	}
+	if (ok && !named) {
+		return config_fail_at(p, start, "environment without a name");
+	}
+	return ok;
+}
+
+bool config_document(ConfigParser *p) {
+	//skip a UTF-8 byte order mark
+	if (p->end - p->pos.at >= 3 && memcmp(p->pos.at, "\xef\xbb\xbf", 3) == 0) {
+		p->pos.at += 3;
+	}
+	if (!config_expect(p, '{')) {
+		return false;
+	}
+	bool ok = true;
+	if (!config_accept(p, '}')) {
+		do {
+			ConfigPos pos = config_here(p);
+			ConfigString key;
+			if (!config_string(p, &key) || !config_expect(p, ':')) {
+				return false;
+			}
+			if (!config_string_is(key, "environments", 12)) {
+				return config_fail_at(p, pos, "unknown key '%.*s'", (int)MIN(key.len, (size_t)64), key.text);
+			}
+			if (!config_expect(p, '[')) {
+				return false;
+			}
+			if (!config_accept(p, ']')) {
+				bool elements_ok = true;
+				do {
+					if (!config_environment(p)) {
+						return false;
+					}
+				} while (config_next(p, ']', &elements_ok));
+				if (!elements_ok) {
+					return false;
+				}
+			}
+		} while (config_next(p, '}', &ok));
+	}
+	config_skip(p);
+	if (ok && p->pos.at != p->end) {
+		return config_fail(p, "unexpected text after the document");
+	}
+	return ok;
+}
+
+//Build the environments described by the len characters of text (not necessarily terminated).
+//Returns false and fills in error (if not NULL) when the text is invalid, nothing is built then.
+bool load_environments(const char *text, size_t len, LoadError *error) {
+	LoadError unused;
+	if (!error) {
+		error = &unused;
+	}
+	memset(error, 0, sizeof(*error));
+	ConfigParser p = { { text, text, 1 }, text + len, false, NULL, error };
+	if (!config_document(&p)) {
+		return false;
+	}
+	p.pos = (ConfigPos){ text, text, 1 };
+	p.build = true;
+	bool ok = config_document(&p);
+	assert(ok);
+	buf_free(p.table);
+	return ok;
+}
+
+//load_environments on the contents of a file, read with a single allocation
+bool load_environments_file(const char *path, LoadError *error) {
+	LoadError unused;
+	if (!error) {
+		error = &unused;
+	}
+	memset(error, 0, sizeof(*error));
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		snprintf(error->message, sizeof(error->message), "can't open %s", path);
+		return false;
+	}
+	char *text = NULL;
+	long size = -1;
+	if (fseek(file, 0, SEEK_END) == 0) {
+		size = ftell(file);
+	}
+	if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+		text = xmalloc((size_t)size + 1);
+		if (fread(text, 1, (size_t)size, file) != (size_t)size) {
+			free(text);
+			text = NULL;
+		}
+	}
+	fclose(file);
+	if (!text) {
+		snprintf(error->message, sizeof(error->message), "can't read %s", path);
+		return false;
+	}
+	bool ok = load_environments(text, (size_t)size, error);
+	free(text);
+	return ok;
+}
+
+//
+//Multithreaded stepping
+//
+//advance_all splits the pools of every environment into chunks of at most STEP_CHUNK modulators.
+//Each worker starts with an equal share of the chunks and steals half of another worker's
+//remaining share once it runs out. Goal followers are stepped in a second phase after all other
+//chunks are done: they advance their followers, which the (masked) bulk kernels of the first
+//phase might otherwise be rewriting at the same time.
+//
+
+#define STEP_CHUNK 4096
+
+typedef struct StepTask {
+	ModulatorPools *pools;
+	ModulatorType type;
+	size_t begin;
+	size_t end;
+}StepTask;
+
+//Range of task indices left to a worker, begin in the low and end in the high 32 bits.
+//Padded to a cache line so workers don't fight over each other's ranges.
+typedef struct WorkerQueue {
+	volatile int64_t range;
+	char pad[64 - sizeof(int64_t)];
+}WorkerQueue;
+
+typedef struct StepScheduler {
+	int num_workers; //including the calling thread
+	ModThread *threads;
+	WorkerQueue *queues;
+	StepTask *tasks;
+	uint64_t dt;
+	ModMutex lock;
+	ModCond wake;
+	ModCond done;
+	uint64_t generation;
+	int busy;
+	bool quit;
+}StepScheduler;
+
+typedef struct StepWorker {
+	StepScheduler *scheduler;
+	int index;
+}StepWorker;
+
+StepScheduler step_scheduler;
+StepWorker *step_workers;
+
+static inline int64_t pack_range(int64_t begin, int64_t end) {
+	return (end << 32) | begin;
+}
+
+static inline int64_t range_begin(int64_t range) {
+	return range & 0xffffffff;
+}
+
+static inline int64_t range_end(int64_t range) {
+	return range >> 32;
+}
+
+void run_step_task(StepTask *task, uint64_t dt) {
+	ModulatorPools *pools = task->pools;
+	STATS_BEGIN();
+	switch (task->type) {
+#define ADVANCE_RANGE_CASE(type, prefix, pool, ...) case(type): prefix##_advance_range(&pools->pool, task->begin, task->end, dt); break;
+	MODULATOR_TYPES(ADVANCE_RANGE_CASE)
+#undef ADVANCE_RANGE_CASE
+	default: assert(0); break;
+	}
+	STATS_END(pools, task->type, STATS_POOL_ADVANCE, task->end - task->begin);
+}
+
+//Take the next task of our own range, -1 when it is empty
+int64_t pop_task(WorkerQueue *queue) {
+	for (;;) {
+		int64_t r = atomic_load_i64(&queue->range);
+		int64_t b = range_begin(r);
+		int64_t e = range_end(r);
+		if (b >= e) {
+			return -1;
+		}
+		if (atomic_cas_i64(&queue->range, r, pack_range(b + 1, e))) {
+			return b;
+		}
+	}
+}
+
+//Steal the back half of another worker's range, run the first stolen task and keep the rest
+int64_t steal_task(StepScheduler *s, int thief) {
+	for (int k = 1; k < s->num_workers; k++) {
+		WorkerQueue *victim = &s->queues[(thief + k) % s->num_workers];
+		for (;;) {
+			int64_t r = atomic_load_i64(&victim->range);
+			int64_t b = range_begin(r);
+			int64_t e = range_end(r);
+			if (b >= e) {
+				break;
+			}
+			int64_t mid = e - (e - b + 1) / 2;
+			if (atomic_cas_i64(&victim->range, r, pack_range(b, mid))) {
+				atomic_store_i64(&s->queues[thief].range, pack_range(mid + 1, e));
+				return mid;
+			}
+		}
+	}
+	return -1;
+}
+
+void run_step_worker(StepScheduler *s, int index) {
+	for (;;) {
+		int64_t t = pop_task(&s->queues[index]);
+		if (t < 0) {
+			t = steal_task(s, index);
+		}
+		if (t < 0) {
+			return;
+		}
+		run_step_task(&s->tasks[t], s->dt);
+	}
+}
+
+void step_worker_main(void *arg) {
+	StepWorker *worker = arg;
+	StepScheduler *s = worker->scheduler;
+	uint64_t seen = 0;
+	for (;;) {
+		mod_mutex_lock(&s->lock);
+		while (!s->quit && s->generation == seen) {
+			mod_cond_wait(&s->wake, &s->lock);
+		}
+		seen = s->generation;
+		bool quit = s->quit;
+		mod_mutex_unlock(&s->lock);
+		if (quit) {
+			return;
+		}
+
+		run_step_worker(s, worker->index);
+
+		mod_mutex_lock(&s->lock);
+		if (--s->busy == 0) {
+			mod_cond_signal(&s->done);
+		}
+		mod_mutex_unlock(&s->lock);
+	}
+}
+
+void stop_step_threads(void) {
+	StepScheduler *s = &step_scheduler;
+	if (s->num_workers == 0) {
+		return;
+	}
+	mod_mutex_lock(&s->lock);
+	s->quit = true;
+	mod_cond_broadcast(&s->wake);
+	mod_mutex_unlock(&s->lock);
+	for (int i = 0; i < s->num_workers - 1; i++) {
+		mod_thread_join(s->threads[i]);
+	}
+	mod_cond_destroy(&s->wake);
+	mod_cond_destroy(&s->done);
+	mod_mutex_destroy(&s->lock);
+	free(s->threads);
+	free(s->queues);
+	free(step_workers);
+	buf_free(s->tasks);
+	memset(s, 0, sizeof(*s));
+	step_workers = NULL;
+}
+
+void start_step_threads(int threads) {
+	StepScheduler *s = &step_scheduler;
+	if (s->num_workers == threads) {
+		return;
+	}
+	stop_step_threads();
+	if (!scalar_spring_kernel) {
+		set_simd_level(detect_simd_level());
+	}
+	s->num_workers = threads;
+	s->threads = xcalloc(threads, sizeof(ModThread));
+	s->queues = xcalloc(threads, sizeof(WorkerQueue));
+	step_workers = xcalloc(threads, sizeof(StepWorker));
+	mod_mutex_init(&s->lock);
+	mod_cond_init(&s->wake);
+	mod_cond_init(&s->done);
+	for (int i = 1; i < threads; i++) {
+		step_workers[i].scheduler = s;
+		step_workers[i].index = i;
+		mod_thread_create(&s->threads[i - 1], step_worker_main, &step_workers[i]);
+	}
+}
+
+void push_step_tasks(StepTask **tasks, ModulatorPools *pools, ModulatorType type, size_t len) {
+	for (size_t begin = 0; begin < len; begin += STEP_CHUNK) {
+		StepTask task = { pools, type, begin, MIN(begin + STEP_CHUNK, len) };
+		buf_push(*tasks, task);
+	}
+}
+
+//Run the queued tasks on all workers and wait for them to finish
+void run_step_phase(StepScheduler *s) {
+	size_t n = buf_len(s->tasks);
+	if (n == 0) {
+		return;
+	}
+	for (int w = 0; w < s->num_workers; w++) {
+		int64_t b = (int64_t)(n * w / s->num_workers);
+		int64_t e = (int64_t)(n * (w + 1) / s->num_workers);
+		atomic_store_i64(&s->queues[w].range, pack_range(b, e));
+	}
+
+	mod_mutex_lock(&s->lock);
+	s->busy = s->num_workers - 1;
+	s->generation++;
+	mod_cond_broadcast(&s->wake);
+	mod_mutex_unlock(&s->lock);
+
+	run_step_worker(s, 0);
+
+	mod_mutex_lock(&s->lock);
+	while (s->busy > 0) {
+		mod_cond_wait(&s->done, &s->lock);
+	}
+	mod_mutex_unlock(&s->lock);
+}
+
+//Advance every environment, spread over the given number of threads (the caller included)
+void advance_all(uint64_t dt, int threads) {
+	size_t count = buf_len(live_environments);
+	if (threads <= 1) {
+		for (size_t i = 0; i < count; i++) {
+			pools_advance(&live_environments[i]->pools, dt);
+		}
+		return;
+	}
+
+	start_step_threads(threads);
+	StepScheduler *s = &step_scheduler;
+	s->dt = dt;
+
+	buf_clear(s->tasks);
+	for (size_t i = 0; i < count; i++) {
+		ModulatorPools *pools = &live_environments[i]->pools;
+		pools_drain_commands(pools);
+		RECORD_STEP_BEGIN(pools, dt);
+		pools_wake_due(pools, dt);
+		push_step_tasks(&s->tasks, pools, WAVE, pools->wave.active);
+		push_step_tasks(&s->tasks, pools, SCALARSPRING, pools->scalar_spring.active);
+		push_step_tasks(&s->tasks, pools, NEWTONIAN, pools->newtonian.active);
+		push_step_tasks(&s->tasks, pools, SHIFTREGISTER, pools->shift_register.active);
+	}
+	run_step_phase(s);
+
+	buf_clear(s->tasks);
+	for (size_t i = 0; i < count; i++) {
+		ModulatorPools *pools = &live_environments[i]->pools;
+		push_step_tasks(&s->tasks, pools, SCALARGOALFOLLOWER, pools->scalar_goal_follower.active);
+	}
+	run_step_phase(s);
+
+	for (size_t i = 0; i < count; i++) {
+		ModulatorPools *pools = &live_environments[i]->pools;
+		pools_route(pools);
+		pools_settle(pools, dt);
+		pools_publish(pools);
+		RECORD_STEP_END(pools);
 	}
 }
@@ -0,0 +1,253 @@
+#ifndef MODULATORS_H
+#define MODULATORS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+//
+//Modulators
+//
+//The interface of libmodulators. modulators.c includes it, so a program either links the library and
+//includes this header, or includes modulators.c (after common.c) as a unity build like the demo does.
+//A Modulator is a handle the library hands out, only ever used through the functions below.
+//The build options (MODULATORS_STATS, MODULATORS_SWITCH_DISPATCH, ...) have to be the same for the
+//library and the programs that use it, CMake passes them to every target.
+//
+
+#ifndef MODULATORS_SWITCH_DISPATCH
+#define MODULATORS_SWITCH_DISPATCH 0
+#endif
+
+typedef struct Modulator Modulator;
+
+typedef enum ModulatorType {
+	WAVE,
+	SCALARSPRING,
+	SCALARGOALFOLLOWER,
+	NEWTONIAN,
+	SHIFTREGISTER
+}ModulatorType;
+
+typedef struct ValueRange {
+	float min;
+	float max;
+}ValueRange;
+
+typedef enum WaveShape {
+	SINE,
+	TRIANGLE,
+	SAW,
+	SQUARE,
+	WAVETABLE
+}WaveShape;
+
+typedef enum ShiftRegisterInterp{
+	LINEAR,
+	QUADRATIC,
+	NONE
+}ShiftRegisterInterp;
+
+typedef enum SimdLevel {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2
+}SimdLevel;
+
+//Ids handed out when an environment is created or a modulator is added to one. The low ID_INDEX_BITS
+//index the registry, the high bits are the generation of the registry slot. A slot gets the next
+//generation when it is freed, so the ids of removed modulators and destroyed environments no longer
+//resolve after the slot has been handed out again. A slot is retired before its generation would wrap.
+typedef uint64_t EnvId;
+typedef uint64_t ModId;
+
+#define INVALID_ID UINT64_MAX
+#define ID_INDEX_BITS 32
+#define ID_INDEX_MASK ((1ull << ID_INDEX_BITS) - 1)
+
+//Turns the ticks of the caller's clock into microsecond steps without drift, see time_base_step
+typedef struct ModTimeBase {
+	uint64_t rate; //ticks per second of the clock driving the modulators, eg. 60 for frames or 48000 for samples
+	uint64_t ticks; //ticks seen so far
+	uint64_t us; //microseconds handed out so far, ticks * 1000000 / rate rounded down
+}ModTimeBase;
+
+//What a route drives in its target
+typedef enum ModParam {
+	PARAM_GOAL, //SCALARSPRING, SCALARGOALFOLLOWER, NEWTONIAN
+	PARAM_AMPLITUDE, //WAVE
+	PARAM_FREQUENCY, //WAVE
+	PARAM_PERIOD, //SHIFTREGISTER
+	PARAM_COUNT
+}ModParam;
+
+typedef enum CommandOp {
+	COMMAND_SET_GOAL,
+	COMMAND_SET_ENABLED,
+	COMMAND_JUMP_TO,
+}CommandOp;
+
+typedef struct Command {
+	ModId id;
+	CommandOp op;
+	float value;
+}Command;
+
+typedef struct ReplayResult {
+	EnvId env; //the copy of the environment the trace ran in, it stays around
+	uint64_t steps;
+	uint64_t modulator_steps; //number of modulators summed over the steps, for throughput
+	char *values; //if collected: for every step the number of modulators (uint32_t) and their values
+	size_t values_size; //bytes in values
+}ReplayResult;
+
+typedef struct ValueDiff {
+	uint64_t mismatches; //values that differ by more than the tolerance
+	uint64_t step; //where the first of them is
+	uint32_t modulator;
+	float expected;
+	float actual;
+	float largest; //largest difference of all values
+}ValueDiff;
+
+typedef struct LoadError {
+	int line; //0 if the error is not in the text, eg. the file could not be read
+	int column;
+	char message[128];
+}LoadError;
+
+//--setup
+
+SimdLevel detect_simd_level(void);
+void set_simd_level(SimdLevel level);
+void set_default_seed(uint64_t seed);
+void set_wave_sine_table(bool enabled);
+void set_shift_register_catch_up(bool enabled);
+
+ModTimeBase time_base(uint64_t ticks_per_second);
+uint64_t time_base_step(ModTimeBase *tb, uint64_t ticks);
+uint64_t time_base_step_to(ModTimeBase *tb, uint64_t now);
+
+//--modulators
+
+Modulator *wave_modulator(const char *name, float amplitude, float frequency);
+Modulator *scalar_spring(const char *name, float smooth, float undamp, float initial);
+Modulator *scalar_goal_follower(const char *name);
+Modulator *newtonian(const char *name, ValueRange speed_limit_range, ValueRange acceleration_range, ValueRange deceleration_range, float initial);
+Modulator *shift_register(const char *name, size_t buckets, ValueRange value_range, float odds, float period, ShiftRegisterInterp interp);
+
+float value(Modulator *m);
+ValueRange range(Modulator *m);
+float goal(Modulator *m);
+void set_goal(Modulator *m, float f);
+uint64_t elapsed_us(Modulator *m);
+bool enabled(Modulator *m);
+void set_enabled(Modulator *m, bool enabled);
+void advance(Modulator *m, uint64_t dt);
+void render_block(Modulator *m, uint64_t dt, float *out, size_t n);
+void set_lazy(Modulator *m, bool lazy);
+void set_seed(Modulator *m, uint64_t seed);
+
+void set_wave_shape(Modulator *m, WaveShape shape);
+void set_wave_table(Modulator *m, const float *table, size_t n);
+void set_amplitude(Modulator *m, float amplitude);
+void set_frequency(Modulator *m, float frequency);
+void spring_to(Modulator *m, float goal);
+void jump_to(Modulator *m, float goal);
+void set_follower(Modulator *m, Modulator *follower);
+void add_region(Modulator *m, ValueRange region);
+void reset(Modulator *m, float value);
+void move_to(Modulator *m, float goal);
+void set_period(Modulator *m, float period);
+void set_age_range(Modulator *m, ValueRange age_range);
+
+//--environments
+
+EnvId find_environment(const char *environment_name);
+EnvId environment_id(const char *environment_name);
+ModId find_modulator(EnvId env_id, const char *modulator_name);
+Modulator *get_modulator(ModId id);
+ModId add_modulator_id(EnvId env_id, Modulator *modulator);
+ModId add_modulator(const char *environment_name, Modulator *modulator);
+void remove_modulator(Modulator *m);
+bool remove_modulator_id(ModId id);
+void destroy_environment_id(EnvId env_id);
+void destroy_environment(const char *environment_name);
+void advance_environment_id(EnvId env_id, uint64_t dt);
+void advance_environment(const char *environment_name, uint64_t dt);
+void advance_all(uint64_t dt, int threads);
+void stop_step_threads(void);
+size_t environment_count(void);
+EnvId environment_at(size_t k);
+size_t environment_modulator_count_id(EnvId env_id);
+size_t environment_modulator_count(const char *environment_name);
+Modulator *const *environment_modulators(EnvId env_id, size_t *count);
+
+//Going over the environments and their modulators, see Iteration in modulators.c:
+//
+//	EnvId env;
+//	for_each_environment(env) {
+//		Modulator *m;
+//		for_each_modulator(m, env) {
+//			...
+//		}
+//	}
+typedef struct ModIterator {
+	Modulator *const *members;
+	size_t count;
+	size_t next;
+}ModIterator;
+
+ModIterator iterate_modulators(EnvId env_id);
+
+//The next modulator, NULL after the last one
+static inline Modulator *next_modulator(ModIterator *it) {
+	return it->next < it->count ? it->members[it->next++] : NULL;
+}
+
+#define for_each_environment(env_id) for (size_t env_id##_k = 0; ((env_id) = environment_at(env_id##_k)) != INVALID_ID; env_id##_k++)
+#define for_each_modulator(m, env_id) for (ModIterator m##_it = iterate_modulators(env_id); ((m) = next_modulator(&m##_it)) != NULL;)
+
+size_t render_environment_block_id(EnvId env_id, uint64_t dt, float *out, size_t n, bool interleaved);
+size_t render_environment_block(const char *environment_name, uint64_t dt, float *out, size_t n, bool interleaved);
+
+//--routes
+
+bool connect_modulators(Modulator *source, Modulator *target, ModParam param, float scale, float offset);
+void disconnect_modulator(Modulator *target, ModParam param);
+bool compile_routes(EnvId env_id);
+
+//--other threads
+
+bool publish_values(EnvId env_id);
+size_t read_published_values(EnvId env_id, float *out, size_t capacity);
+bool read_published(Modulator *const *mods, size_t n, float *out);
+float published_value(Modulator *m);
+bool create_command_queue(EnvId env_id, size_t capacity);
+bool post_command(EnvId env_id, Command command);
+bool post_set_goal(EnvId env_id, ModId id, float goal);
+bool post_set_enabled(EnvId env_id, ModId id, bool enabled);
+bool post_jump_to(EnvId env_id, ModId id, float goal);
+
+//--snapshots, traces and files
+
+size_t snapshot_environment_id(EnvId env_id, void *out, size_t cap);
+size_t snapshot_environment(const char *environment_name, void *out, size_t cap);
+EnvId restore_environment_as(const void *blob, size_t size, const char *name);
+EnvId restore_environment(const void *blob, size_t size);
+bool start_recording(EnvId env_id);
+void record_snapshot(EnvId env_id);
+void *stop_recording(EnvId env_id, size_t *size);
+bool replay_trace(const void *trace, size_t size, bool collect, ReplayResult *result);
+void replay_result_free(ReplayResult *result);
+bool compare_values(const char *expected, size_t expected_size, const char *actual, size_t actual_size, float tolerance, ValueDiff *diff);
+bool load_environments(const char *text, size_t len, LoadError *error);
+bool load_environments_file(const char *path, LoadError *error);
+
+//--instrumentation
+
+void stats_dump(FILE *out, bool json);
+void stats_reset(void);
+
+#endif
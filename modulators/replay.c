@@ -0,0 +1,181 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stddef.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <float.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "modulators.h"
+
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
+#define MAX(x, y) ((x) >= (y) ? (x) : (y))
+
+//
+//Replay
+//
+//Runs a trace an application recorded with start_recording and stop_recording and wrote to a file as is.
+//The values of all modulators after every step are compared with a golden file (the values of an earlier
+//replay, written with --write-golden) within a tolerance; the first difference is reported. The trace is
+//then replayed again without collecting values to measure how fast this input is stepped.
+//
+//usage: replay TRACE [--golden FILE] [--write-golden FILE] [--tolerance T] [--repeat N]
+//
+//Exits with 1 if the trace can't be replayed or its values differ from the golden file.
+//
+
+double replay_now_ns(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1e9 / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+//The whole file in one allocation (malloc'ed, so aligned for replay_trace), NULL if it can't be read
+char *replay_read_file(const char *path, size_t *size) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+	char *data = NULL;
+	long len = -1;
+	if (fseek(file, 0, SEEK_END) == 0) {
+		len = ftell(file);
+	}
+	if (len >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+		data = malloc((size_t)len + 1);
+		if (data && fread(data, 1, (size_t)len, file) != (size_t)len) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(file);
+	*size = data ? (size_t)len : 0;
+	return data;
+}
+
+bool replay_write_file(const char *path, const void *data, size_t size) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+	bool ok = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && ok;
+}
+
+int main(int argc, char **argv) {
+	const char *trace_path = NULL;
+	const char *golden_path = NULL;
+	const char *write_golden_path = NULL;
+	float tolerance = 0.0f;
+	int repeat = 5;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+			golden_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--write-golden") == 0 && i + 1 < argc) {
+			write_golden_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+			tolerance = strtof(argv[++i], NULL);
+		}
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+			repeat = MAX(1, atoi(argv[++i]));
+		}
+		else if (argv[i][0] != '-' && !trace_path) {
+			trace_path = argv[i];
+		}
+		else {
+			trace_path = NULL;
+			break;
+		}
+	}
+	if (!trace_path) {
+		fprintf(stderr, "usage: %s TRACE [--golden FILE] [--write-golden FILE] [--tolerance T] [--repeat N]\n", argv[0]);
+		return 1;
+	}
+
+	size_t size;
+	char *trace = replay_read_file(trace_path, &size);
+	if (!trace) {
+		fprintf(stderr, "can't read %s\n", trace_path);
+		return 1;
+	}
+
+	ReplayResult result;
+	if (!replay_trace(trace, size, golden_path || write_golden_path, &result)) {
+		fprintf(stderr, "%s is not a trace this build can replay\n", trace_path);
+		return 1;
+	}
+	destroy_environment_id(result.env);
+	printf("%s: %llu steps, %.1f modulators per step\n", trace_path, (unsigned long long)result.steps,
+		result.steps ? (double)result.modulator_steps / (double)result.steps : 0.0);
+
+	int status = 0;
+	if (write_golden_path) {
+		if (!replay_write_file(write_golden_path, result.values, result.values_size)) {
+			fprintf(stderr, "can't write %s\n", write_golden_path);
+			status = 1;
+		}
+	}
+	if (golden_path) {
+		size_t golden_size;
+		char *golden = replay_read_file(golden_path, &golden_size);
+		ValueDiff diff;
+		if (!golden) {
+			fprintf(stderr, "can't read %s\n", golden_path);
+			status = 1;
+		}
+		else if (compare_values(golden, golden_size, result.values, result.values_size, tolerance, &diff)) {
+			printf("matches %s, largest difference %g\n", golden_path, diff.largest);
+		}
+		else if (diff.mismatches == 0) {
+			printf("differs from %s: the steps or modulators do not match\n", golden_path);
+			status = 1;
+		}
+		else {
+			printf("differs from %s: %llu values off by more than %g, the first in step %llu, modulator %u: %.9g instead of %.9g; largest difference %g\n",
+				golden_path, (unsigned long long)diff.mismatches, tolerance, (unsigned long long)diff.step, diff.modulator,
+				diff.actual, diff.expected, diff.largest);
+			status = 1;
+		}
+		free(golden);
+	}
+	replay_result_free(&result);
+
+	//fastest of repeat runs, restoring the snapshots included
+	double best = INFINITY;
+	for (int r = 0; r < repeat; r++) {
+		double start = replay_now_ns();
+		replay_trace(trace, size, false, &result);
+		double ns = replay_now_ns() - start;
+		best = MIN(best, ns);
+		destroy_environment_id(result.env);
+	}
+	printf("replay: %.3f ms, %.1f ns per step, %.3f ns per modulator step\n", best * 1e-6,
+		result.steps ? best / (double)result.steps : 0.0, result.modulator_steps ? best / (double)result.modulator_steps : 0.0);
+
+	free(trace);
+	return status;
+}